@@ -0,0 +1,324 @@
+/*
+ * rcu.c
+ *
+ * This file implements the "read-copy-update" synchronization
+ * construct.
+ *
+ * The rcu_init() and rcu_destroy() functions, respectively,
+ * allow you to initialize/create and destroy/free an RCU domain.
+ * Each thread that reads calls rcu_register() first, and
+ * rcu_unregister() when done.
+ *
+ * The rcu_readlock() function begins a read-side section, and
+ * rcu_readunlock() ends it. Neither takes a lock, or writes
+ * anything but the reader's own cache line.
+ *
+ * The rcu_writelock() and rcu_writeunlock() functions serialize
+ * writers. rcu_retire() hands over a version that has been
+ * replaced, to be freed after a grace period, and
+ * rcu_synchronize() waits for a grace period, freeing every
+ * version retired before it was called.
+ *
+ * A reader stores its epoch and then loads the pointer; a writer
+ * swaps the pointer and then loads the readers' epochs. A
+ * sequentially consistent fence between the two steps on each
+ * side makes sure that either the writer sees the reader's epoch,
+ * or the reader sees the new pointer.
+ */
+#include "rcu.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "errors.h"
+
+/*
+ * Initialize an RCU domain
+ */
+int
+rcu_init(rcu_t* rcu)
+{
+  int status;
+
+  atomic_init(&rcu->epoch, 1);
+  rcu->readers       = NULL;
+  rcu->retired       = NULL;
+  rcu->retired_count = 0;
+  status             = pthread_mutex_init(&rcu->mutex, NULL);
+  if (status != 0)
+    return status;
+  status = pthread_mutex_init(&rcu->write, NULL);
+  if (status != 0) {
+    /* if unable to create write mutex, destroy the other */
+    pthread_mutex_destroy(&rcu->mutex);
+    return status;
+  }
+  rcu->valid = RCU_VALID;
+  return 0;
+}
+
+/*
+ * Return the oldest epoch any reader may be reading in. Called
+ * with the mutex locked.
+ */
+static unsigned long
+rcu_oldest(rcu_t* rcu)
+{
+  rcu_reader_t* reader;
+  unsigned long oldest, epoch;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  oldest = atomic_load(&rcu->epoch);
+  for (reader = rcu->readers; reader != NULL; reader = reader->next) {
+    epoch = atomic_load_explicit(&reader->epoch, memory_order_acquire);
+    if (epoch != 0 && epoch < oldest)
+      oldest = epoch;
+  }
+  return oldest;
+}
+
+/*
+ * Unlink the retired versions no reader can be using any longer
+ * (those retired before "oldest"), and return them. Called with
+ * the mutex locked.
+ */
+static rcu_retired_t*
+rcu_expired(rcu_t* rcu, unsigned long oldest)
+{
+  rcu_retired_t **link, *retired, *expired = NULL;
+
+  link = &rcu->retired;
+  while ((retired = *link) != NULL) {
+    if (retired->epoch < oldest) {
+      *link         = retired->next;
+      retired->next = expired;
+      expired       = retired;
+      rcu->retired_count--;
+    }
+    else
+      link = &retired->next;
+  }
+  return expired;
+}
+
+/*
+ * Free a list of expired versions. Called with the mutex
+ * unlocked, so that "reclaim" may take its time.
+ */
+static void
+rcu_reclaim(rcu_retired_t* expired)
+{
+  rcu_retired_t* next;
+
+  while (expired != NULL) {
+    next = expired->next;
+    expired->reclaim(expired->version);
+    free(expired);
+    expired = next;
+  }
+}
+
+/*
+ * Destroy an RCU domain, freeing any versions still retired.
+ */
+int
+rcu_destroy(rcu_t* rcu)
+{
+  rcu_retired_t* expired;
+  int status, status2;
+
+  if (rcu->valid != RCU_VALID)
+    return EINVAL;
+  status = pthread_mutex_lock(&rcu->mutex);
+  if (status != 0)
+    return status;
+
+  /*
+   * Check whether any readers are still registered; report
+   * EBUSY if so.
+   */
+  if (rcu->readers != NULL) {
+    pthread_mutex_unlock(&rcu->mutex);
+    return EBUSY;
+  }
+
+  expired    = rcu_expired(rcu, atomic_load(&rcu->epoch) + 1);
+  rcu->valid = 0;
+  status     = pthread_mutex_unlock(&rcu->mutex);
+  if (status != 0)
+    return status;
+  rcu_reclaim(expired);
+  status  = pthread_mutex_destroy(&rcu->mutex);
+  status2 = pthread_mutex_destroy(&rcu->write);
+  return (status != 0 ? status : status2);
+}
+
+/*
+ * Register a reading thread with an RCU domain.
+ */
+int
+rcu_register(rcu_t* rcu, rcu_reader_t* reader)
+{
+  int status;
+
+  if (rcu->valid != RCU_VALID)
+    return EINVAL;
+  atomic_init(&reader->epoch, 0);
+  reader->nesting = 0;
+  reader->rcu     = rcu;
+  status          = pthread_mutex_lock(&rcu->mutex);
+  if (status != 0)
+    return status;
+  reader->next = rcu->readers;
+  rcu->readers = reader;
+  return pthread_mutex_unlock(&rcu->mutex);
+}
+
+/*
+ * Unregister a reading thread, which must not be reading.
+ */
+int
+rcu_unregister(rcu_reader_t* reader)
+{
+  rcu_t* rcu = reader->rcu;
+  rcu_reader_t** link;
+  int status;
+
+  if (rcu == NULL || rcu->valid != RCU_VALID)
+    return EINVAL;
+  if (reader->nesting > 0)
+    return EBUSY;
+  status = pthread_mutex_lock(&rcu->mutex);
+  if (status != 0)
+    return status;
+  for (link = &rcu->readers; *link != NULL; link = &(*link)->next)
+    if (*link == reader) {
+      *link = reader->next;
+      break;
+    }
+  reader->rcu = NULL;
+  return pthread_mutex_unlock(&rcu->mutex);
+}
+
+/*
+ * Begin a read-side section, noting the current epoch.
+ */
+int
+rcu_readlock(rcu_reader_t* reader)
+{
+  rcu_t* rcu = reader->rcu;
+  unsigned long epoch;
+
+  if (rcu == NULL || rcu->valid != RCU_VALID)
+    return EINVAL;
+  if (reader->nesting++ == 0) {
+    epoch = atomic_load_explicit(&rcu->epoch, memory_order_acquire);
+    atomic_store_explicit(&reader->epoch, epoch, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+  }
+  return 0;
+}
+
+/*
+ * End a read-side section. After the outermost one, the reader
+ * no longer holds back reclamation.
+ */
+int
+rcu_readunlock(rcu_reader_t* reader)
+{
+  if (reader->rcu == NULL || reader->nesting <= 0)
+    return EINVAL;
+  if (--reader->nesting == 0)
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+  return 0;
+}
+
+/*
+ * Lock an RCU domain for writing.
+ */
+int
+rcu_writelock(rcu_t* rcu)
+{
+  if (rcu->valid != RCU_VALID)
+    return EINVAL;
+  return pthread_mutex_lock(&rcu->write);
+}
+
+/*
+ * Unlock an RCU domain from writing.
+ */
+int
+rcu_writeunlock(rcu_t* rcu)
+{
+  if (rcu->valid != RCU_VALID)
+    return EINVAL;
+  return pthread_mutex_unlock(&rcu->write);
+}
+
+/*
+ * Retire a version that has been replaced, to be freed by
+ * calling "reclaim" once no reader can be using it. Free any
+ * earlier versions that have become safe meanwhile, and wait for
+ * a grace period if too many are waiting.
+ */
+int
+rcu_retire(rcu_t* rcu, void* version, void (*reclaim)(void*))
+{
+  rcu_retired_t *retired, *expired;
+  int count, status;
+
+  if (rcu->valid != RCU_VALID)
+    return EINVAL;
+  retired = (rcu_retired_t*) malloc(sizeof(rcu_retired_t));
+  if (retired == NULL)
+    return ENOMEM;
+  retired->version = version;
+  retired->reclaim = reclaim;
+  status           = pthread_mutex_lock(&rcu->mutex);
+  if (status != 0) {
+    free(retired);
+    return status;
+  }
+  retired->epoch = atomic_fetch_add(&rcu->epoch, 1);
+  retired->next  = rcu->retired;
+  rcu->retired   = retired;
+  rcu->retired_count++;
+  expired = rcu_expired(rcu, rcu_oldest(rcu));
+  count   = rcu->retired_count;
+  status  = pthread_mutex_unlock(&rcu->mutex);
+  rcu_reclaim(expired);
+  if (status == 0 && count > RCU_RETIRE_MAX)
+    status = rcu_synchronize(rcu);
+  return status;
+}
+
+/*
+ * Wait for a grace period: until every reader that was reading
+ * when called has finished. Then free the versions retired
+ * before.
+ */
+int
+rcu_synchronize(rcu_t* rcu)
+{
+  rcu_retired_t* expired;
+  unsigned long epoch, oldest;
+  int status;
+
+  if (rcu->valid != RCU_VALID)
+    return EINVAL;
+  status = pthread_mutex_lock(&rcu->mutex);
+  if (status != 0)
+    return status;
+  epoch = atomic_fetch_add(&rcu->epoch, 1);
+  while ((oldest = rcu_oldest(rcu)) <= epoch) {
+    pthread_mutex_unlock(&rcu->mutex);
+    sched_yield();
+    status = pthread_mutex_lock(&rcu->mutex);
+    if (status != 0)
+      return status;
+  }
+  expired = rcu_expired(rcu, oldest);
+  status  = pthread_mutex_unlock(&rcu->mutex);
+  rcu_reclaim(expired);
+  return status;
+}
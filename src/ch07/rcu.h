@@ -0,0 +1,115 @@
+/*
+ * rcu.h
+ *
+ * This header file describes the "read-copy-update" (RCU)
+ * synchronization construct. The type rcu_t describes the full
+ * state of an RCU domain including the POSIX 1003.1c
+ * synchronization objects necessary.
+ *
+ * RCU protects read-mostly data reached through a pointer. A
+ * writer never changes the data in place: it copies it, changes
+ * the copy, and publishes the copy by swapping the pointer, with
+ * rcu_publish(). Readers use whichever version they found, and
+ * take no lock at all. The old version is "retired", and freed
+ * once every reader that might still be using it has finished,
+ * after a "grace period".
+ *
+ * Reclamation is epoch-based. Each reading thread registers an
+ * rcu_reader_t, on a cache line of its own, in which it notes the
+ * domain's current epoch while it reads. Retiring a version
+ * advances the epoch; the version can be freed once no reader
+ * is left in an epoch as old as the one in which it was retired.
+ * For example:
+ *
+ *     rcu_readlock(&reader);
+ *     config = rcu_dereference(current);
+ *     ... use *config ...
+ *     rcu_readunlock(&reader);
+ *
+ *     rcu_writelock(&rcu);
+ *     copy = ... a changed copy of current ...
+ *     old  = rcu_publish(current, copy);
+ *     rcu_writeunlock(&rcu);
+ *     rcu_retire(&rcu, old, free);
+ *
+ * Read-side sections may nest, but a thread must not retire or
+ * wait for a grace period from inside one, since it would be
+ * waiting for itself.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define RCU_CACHE_LINE 64
+
+/*
+ * Once this many versions are waiting for their grace period,
+ * rcu_retire() waits for one, rather than let them pile up.
+ */
+#define RCU_RETIRE_MAX 64
+
+/*
+ * Load and swap pointers declared as _Atomic(type*).
+ * rcu_publish() returns the old version.
+ */
+#define rcu_dereference(pointer)                                               \
+  atomic_load_explicit(&(pointer), memory_order_acquire)
+#define rcu_publish(pointer, version)                                          \
+  atomic_exchange_explicit(&(pointer), (version), memory_order_acq_rel)
+
+/*
+ * Structure describing a reading thread.
+ */
+typedef struct rcu_reader_tag {
+  _Alignas(RCU_CACHE_LINE) atomic_ulong epoch; /* 0 when not reading */
+  int nesting;                                  /* read-side depth */
+  struct rcu_tag* rcu;                          /* domain registered with */
+  struct rcu_reader_tag* next;                  /* next registered reader */
+} rcu_reader_t;
+
+/*
+ * Structure describing a retired version.
+ */
+typedef struct rcu_retired_tag {
+  void* version;
+  void (*reclaim)(void*);       /* frees "version" */
+  unsigned long epoch;          /* epoch in which it was retired */
+  struct rcu_retired_tag* next; /* next, retired earlier */
+} rcu_retired_t;
+
+/*
+ * Structure describing an RCU domain.
+ */
+typedef struct rcu_tag {
+  pthread_mutex_t mutex;  /* guard readers and retired */
+  pthread_mutex_t write;  /* serialize writers */
+  atomic_ulong epoch;     /* current epoch, from 1 */
+  rcu_reader_t* readers;  /* registered readers */
+  rcu_retired_t* retired; /* versions awaiting reclamation */
+  int retired_count;      /* number of them */
+  int valid;              /* set when valid */
+} rcu_t;
+
+#define RCU_VALID 0xc0ffee
+
+/*
+ * Support static initialization of RCU domains
+ */
+#define RCU_INITIALIZER                                                        \
+  {                                                                            \
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, 1, NULL, NULL, 0,    \
+        RCU_VALID                                                              \
+  }
+
+/*
+ * Define RCU functions
+ */
+extern int rcu_init(rcu_t* rcu);
+extern int rcu_destroy(rcu_t* rcu);
+extern int rcu_register(rcu_t* rcu, rcu_reader_t* reader);
+extern int rcu_unregister(rcu_reader_t* reader);
+extern int rcu_readlock(rcu_reader_t* reader);
+extern int rcu_readunlock(rcu_reader_t* reader);
+extern int rcu_writelock(rcu_t* rcu);
+extern int rcu_writeunlock(rcu_t* rcu);
+extern int rcu_retire(rcu_t* rcu, void* version, void (*reclaim)(void*));
+extern int rcu_synchronize(rcu_t* rcu);
@@ -0,0 +1,285 @@
+/*
+ * rcu_main.c
+ *
+ * Compare read-copy-update with read-write locks on the workload
+ * of rwlock_main.c: THREADS threads walk an array of DATASIZE
+ * elements, updating an element every "interval" iterations and
+ * reading it otherwise. The same workload is run once with an
+ * rwlock_t per element, and once with each element a pointer to
+ * a record that writers copy, change and publish, retiring the
+ * old record to be freed after a grace period.
+ *
+ * Besides the times, the program checks that no update was lost,
+ * and that every retired record has been freed after a final
+ * grace period.
+ */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "errors.h"
+#include "rcu.h"
+#include "rwlock.h"
+
+#define THREADS 5
+#define DATASIZE 15
+#define ITERATIONS 1000000
+
+/*
+ * Keep statistics for each thread.
+ */
+typedef struct thread_tag {
+  rcu_reader_t reader;
+  int thread_num;
+  pthread_t thread_id;
+  int updates;
+  int reads;
+  int interval;
+  int rcu;
+} thread_t;
+
+/*
+ * A version of an element's data, for RCU.
+ */
+typedef struct record_tag {
+  int data;
+  int updates;
+} record_t;
+
+/*
+ * Read-write lock and shared data, and the current record.
+ */
+typedef struct data_tag {
+  rwlock_t lock;
+  int data;
+  int updates;
+  _Atomic(record_t*) record;
+} data_t;
+
+thread_t threads[THREADS];
+data_t data[DATASIZE];
+rcu_t rcu = RCU_INITIALIZER;
+atomic_long reclaimed;
+
+/*
+ * Free a retired record.
+ */
+void
+reclaim_record(void* version)
+{
+  free(version);
+  atomic_fetch_add(&reclaimed, 1);
+}
+
+/*
+ * Update an element by publishing a changed copy of its record.
+ */
+void
+update_rcu(data_t* element, thread_t* self)
+{
+  record_t *old, *copy;
+  int status;
+
+  copy = (record_t*) malloc(sizeof(record_t));
+  if (copy == NULL)
+    errno_abort("Allocate record");
+  status = rcu_writelock(&rcu);
+  if (status != 0)
+    err_abort(status, "Write lock");
+  old        = rcu_dereference(element->record);
+  *copy      = *old;
+  copy->data = self->thread_num;
+  copy->updates++;
+  old    = rcu_publish(element->record, copy);
+  status = rcu_writeunlock(&rcu);
+  if (status != 0)
+    err_abort(status, "Write unlock");
+  status = rcu_retire(&rcu, old, reclaim_record);
+  if (status != 0)
+    err_abort(status, "Retire record");
+}
+
+/*
+ * Read an element's current record.
+ */
+int
+read_rcu(data_t* element, thread_t* self)
+{
+  int value, status;
+
+  status = rcu_readlock(&self->reader);
+  if (status != 0)
+    err_abort(status, "Read lock");
+  value  = rcu_dereference(element->record)->data;
+  status = rcu_readunlock(&self->reader);
+  if (status != 0)
+    err_abort(status, "Read unlock");
+  return value;
+}
+
+/*
+ * Update an element under its read-write lock.
+ */
+void
+update_rwlock(data_t* element, thread_t* self)
+{
+  int status;
+
+  status = rwl_writelock(&element->lock);
+  if (status != 0)
+    err_abort(status, "Write lock");
+  element->data = self->thread_num;
+  element->updates++;
+  status = rwl_writeunlock(&element->lock);
+  if (status != 0)
+    err_abort(status, "Write unlock");
+}
+
+/*
+ * Read an element under its read-write lock.
+ */
+int
+read_rwlock(data_t* element)
+{
+  int value, status;
+
+  status = rwl_readlock(&element->lock);
+  if (status != 0)
+    err_abort(status, "Read lock");
+  value  = element->data;
+  status = rwl_readunlock(&element->lock);
+  if (status != 0)
+    err_abort(status, "Read unlock");
+  return value;
+}
+
+/*
+ * Thread start routine that reads and updates the data.
+ */
+void*
+thread_routine(void* arg)
+{
+  thread_t* self = (thread_t*) arg;
+  int repeats    = 0;
+  int iteration;
+  int element = 0;
+  int status;
+
+  if (self->rcu) {
+    status = rcu_register(&rcu, &self->reader);
+    if (status != 0)
+      err_abort(status, "Register reader");
+  }
+  for (iteration = 0; iteration < ITERATIONS; iteration++) {
+    if ((iteration % self->interval) == 0) {
+      if (self->rcu)
+        update_rcu(&data[element], self);
+      else
+        update_rwlock(&data[element], self);
+      self->updates++;
+    }
+    else {
+      if (self->rcu) {
+        if (read_rcu(&data[element], self) == self->thread_num)
+          repeats++;
+      }
+      else if (read_rwlock(&data[element]) == self->thread_num)
+        repeats++;
+      self->reads++;
+    }
+    element++;
+    if (element >= DATASIZE)
+      element = 0;
+  }
+  if (self->rcu) {
+    status = rcu_unregister(&self->reader);
+    if (status != 0)
+      err_abort(status, "Unregister reader");
+  }
+  return (void*) (long) repeats;
+}
+
+/*
+ * Run the workload with rwlock_t or with RCU, and report.
+ */
+void
+run(const char* name, int use_rcu)
+{
+  struct timespec start, end;
+  unsigned int seed = 1;
+  long updates = 0, thread_updates, reads = 0;
+  record_t* record;
+  int count, data_count, status;
+
+  for (data_count = 0; data_count < DATASIZE; data_count++) {
+    data[data_count].data    = 0;
+    data[data_count].updates = 0;
+    status                   = rwl_init(&data[data_count].lock);
+    if (status != 0)
+      err_abort(status, "Init rw lock");
+    record = (record_t*) calloc(1, sizeof(record_t));
+    if (record == NULL)
+      errno_abort("Allocate record");
+    atomic_init(&data[data_count].record, record);
+  }
+  atomic_store(&reclaimed, 0);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (count = 0; count < THREADS; count++) {
+    threads[count].thread_num = count;
+    threads[count].updates    = 0;
+    threads[count].reads      = 0;
+    threads[count].interval   = rand_r(&seed) % 71;
+    threads[count].rcu        = use_rcu;
+    status                    = pthread_create(&threads[count].thread_id,
+                            NULL,
+                            thread_routine,
+                            (void*) &threads[count]);
+    if (status != 0)
+      err_abort(status, "Create thread");
+  }
+  for (count = 0; count < THREADS; count++) {
+    status = pthread_join(threads[count].thread_id, NULL);
+    if (status != 0)
+      err_abort(status, "Join thread");
+    updates += threads[count].updates;
+    reads += threads[count].reads;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  thread_updates = updates;
+  for (data_count = 0; data_count < DATASIZE; data_count++) {
+    record = atomic_load(&data[data_count].record);
+    thread_updates -= data[data_count].updates + record->updates;
+    free(record);
+    rwl_destroy(&data[data_count].lock);
+  }
+  printf("%-6s %8.1f msec  %9ld reads  %s",
+         name,
+         (end.tv_sec - start.tv_sec) * 1000.0
+             + (end.tv_nsec - start.tv_nsec) / 1000000.0,
+         reads,
+         thread_updates == 0 ? "updates match" : "UPDATES LOST");
+  if (use_rcu) {
+    status = rcu_synchronize(&rcu);
+    if (status != 0)
+      err_abort(status, "Synchronize");
+    printf(", %s",
+           atomic_load(&reclaimed) == updates ? "records reclaimed"
+                                               : "RECORDS LEAKED");
+  }
+  printf("\n");
+}
+
+int
+main(int argc, char* argv[])
+{
+  int status;
+
+  run("rwlock", 0);
+  run("rcu", 1);
+  status = rcu_destroy(&rcu);
+  if (status != 0)
+    err_abort(status, "Destroy RCU domain");
+  return 0;
+}
@@ -20,157 +20,1192 @@
  * exclusive write access, and rwl_writeunlock() releases the
  * lock. rwl_writetrylock() attempts to lock a read-write lock
  * for write access, and returns EBUSY instead of blocking.
+ *
+ * The policy, chosen by rwl_init_attr(), decides who goes
+ * first when both readers and writers are waiting (see
+ * rwlock.h), and whether readers of a read-mostly lock may
+ * bypass the mutex.
+ *
+ * The rwl_upgradelock() function locks a read-write lock for
+ * upgradable read access, and rwl_upgradeunlock() releases the
+ * lock. rwl_upgrade() turns an upgradable read lock into a write
+ * lock, and rwl_downgrade() a write lock into a read lock.
+ *
+ * rwl_timedreadlock() and rwl_timedwritelock() are like
+ * rwl_readlock() and rwl_writelock(), but return ETIMEDOUT
+ * if the lock can't be had by a deadline.
+ *
+ * With RWL_PROFILE defined, each lock keeps a profile of how it
+ * was used (see rwlock.h), which rwl_profile_get() returns, and
+ * rwl_profile_dump() prints the most contended locks'.
+ *
+ * The rwl_table_init() and rwl_table_destroy() functions create
+ * and destroy a striped table of padded locks, and
+ * rwl_table_lock() finds the lock that guards a key.
  */
 #include "rwlock.h"
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "errors.h"
 
+/*
+ * Cleanup argument for a reader waiting for the lock: the
+ * phase in which it started waiting tells it whether a writer
+ * has admitted it since.
+ */
+typedef struct rwl_waiter_tag {
+  rwlock_t* rwl;
+  unsigned long phase;
+} rwl_waiter_t;
+
+/*
+ * A reader slot for read-mostly locks, on a cache line of its
+ * own. "owner" tells a reader whether the slot naming its lock
+ * is its own, or another reader's that hashed to the same slot.
+ */
+typedef struct rwl_slot_tag {
+  _Alignas(RWL_CACHE_LINE) _Atomic(rwlock_t*) lock;
+  _Atomic(void*) owner;
+} rwl_slot_t;
+
+static rwl_slot_t rwl_slots[RWL_SLOTS];
+
+/*
+ * The address of rwl_self identifies the calling thread.
+ */
+static _Thread_local char rwl_self;
+
+/*
+ * Return CLOCK_MONOTONIC in nanoseconds.
+ */
+static long
+rwl_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * The number of CPUs, which tells whether spinning is worth it.
+ */
+static pthread_once_t rwl_once = PTHREAD_ONCE_INIT;
+static int rwl_cpus            = 1;
+
+static void
+rwl_count_cpus(void)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  rwl_cpus = (cpus > 0 ? (int) cpus : 1);
+}
+
+/*
+ * Tell the CPU that we're spinning.
+ */
+static void
+rwl_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/*
+ * Return the calling thread's slot for a lock.
+ */
+static rwl_slot_t*
+rwl_slot(rwlock_t* rwl)
+{
+  uint64_t key = (uintptr_t) rwl * 31 + (uintptr_t) &rwl_self;
+
+  key *= 0x9e3779b97f4a7c15ULL;
+  return &rwl_slots[key >> (64 - RWL_SLOT_BITS)];
+}
+
+/*
+ * Try to lock a read-mostly lock for read access through the
+ * calling thread's slot, without the mutex. Return 1 if the
+ * lock is held.
+ *
+ * A writer clears "rbias" and then scans the slots, while we
+ * claim a slot and then check "rbias": either the writer sees
+ * our slot and waits for it, or we see "rbias" clear and back
+ * out to the slow path.
+ */
+static int
+rwl_fastread(rwlock_t* rwl)
+{
+  rwl_slot_t* slot;
+  rwlock_t* expected = NULL;
+
+  if (!atomic_load_explicit(&rwl->rbias, memory_order_relaxed))
+    return 0;
+  slot = rwl_slot(rwl);
+  if (!atomic_compare_exchange_strong(&slot->lock, &expected, rwl))
+    return 0;
+  if (atomic_load(&rwl->rbias)) {
+    atomic_store_explicit(&slot->owner, &rwl_self, memory_order_relaxed);
+    return 1;
+  }
+  atomic_store(&slot->lock, NULL);
+  return 0;
+}
+
+/*
+ * Release a read lock taken by rwl_fastread(). Return 0 if the
+ * calling thread holds no slot for the lock, so that it holds a
+ * read lock from the slow path instead.
+ */
+static int
+rwl_fastunlock(rwlock_t* rwl)
+{
+  rwl_slot_t* slot = rwl_slot(rwl);
+
+  if (atomic_load_explicit(&slot->lock, memory_order_relaxed) != rwl
+      || atomic_load_explicit(&slot->owner, memory_order_relaxed)
+             != &rwl_self)
+    return 0;
+  atomic_store_explicit(&slot->owner, NULL, memory_order_relaxed);
+  atomic_store_explicit(&slot->lock, NULL, memory_order_release);
+  return 1;
+}
+
+/*
+ * Let readers of a read-mostly lock use the slots again, unless
+ * a recent revocation inhibits it, or a writer is waiting or
+ * revoking. Called by a slow path reader, with the mutex locked.
+ */
+static void
+rwl_bias(rwlock_t* rwl)
+{
+  if (rwl->readmostly && rwl->w_wait == 0 && !rwl->upgrading
+      && !rwl->revoking
+      && !atomic_load_explicit(&rwl->rbias, memory_order_relaxed)
+      && rwl_now() >= rwl->inhibit)
+    atomic_store(&rwl->rbias, 1);
+}
+
+/*
+ * Stop readers from using the slots, and wait for those that
+ * hold the lock through them to unlock. Only one thread may
+ * revoke at a time, since a clear "rbias" means no reader holds
+ * a slot only once the revocation is over: the writer that
+ * holds the lock, the thread that set "revoking", or, if "wait"
+ * is 0, a thread with the mutex locked while neither exists.
+ *
+ * Return how long the revocation took in nsec (0 if "rbias" was
+ * already clear), which the caller should note in "inhibit" once
+ * it has the mutex. If "wait" is 0, or "abstime" (on the
+ * CLOCK_MONOTONIC clock) passes first, give up, restoring
+ * "rbias", and return -1.
+ */
+static long
+rwl_revoke(rwlock_t* rwl, int wait, const struct timespec* abstime)
+{
+  long start, deadline = 0;
+  int index;
+
+  if (!atomic_load_explicit(&rwl->rbias, memory_order_relaxed))
+    return 0;
+  atomic_store(&rwl->rbias, 0);
+  start = rwl_now();
+  if (abstime != NULL)
+    deadline = abstime->tv_sec * 1000000000L + abstime->tv_nsec;
+  for (index = 0; index < RWL_SLOTS; index++)
+    while (atomic_load(&rwl_slots[index].lock) == rwl) {
+      if (!wait || (abstime != NULL && rwl_now() >= deadline)) {
+        atomic_store(&rwl->rbias, 1);
+        return -1;
+      }
+      sched_yield();
+    }
+  return rwl_now() - start;
+}
+
+/*
+ * Keep slow path readers from setting "rbias" again until
+ * RWL_INHIBIT times as long as a revocation "took" has passed.
+ * Called with the mutex locked.
+ */
+static void
+rwl_inhibit(rwlock_t* rwl, long took)
+{
+  if (took > 0)
+    rwl->inhibit = rwl_now() + took * RWL_INHIBIT;
+}
+
+#ifdef RWL_PROFILE
+/*
+ * The registry of profiled locks, linked through their
+ * profiles. Lock it before any lock's mutex.
+ */
+static pthread_mutex_t rwl_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static rwlock_t* rwl_registry             = NULL;
+
+/*
+ * Enter a lock in the registry, if it isn't already. Called
+ * with the lock's mutex unlocked, before it's first used.
+ */
+static void
+rwl_prof_register(rwlock_t* rwl)
+{
+  if (atomic_load_explicit(&rwl->profile.registered, memory_order_acquire))
+    return;
+  pthread_mutex_lock(&rwl_registry_mutex);
+  if (!atomic_load_explicit(&rwl->profile.registered, memory_order_relaxed)) {
+    rwl->profile.next = rwl_registry;
+    rwl_registry      = rwl;
+    atomic_store_explicit(&rwl->profile.registered, 1, memory_order_release);
+  }
+  pthread_mutex_unlock(&rwl_registry_mutex);
+}
+
+/*
+ * Remove a lock from the registry.
+ */
+static void
+rwl_prof_unregister(rwlock_t* rwl)
+{
+  rwlock_t** link;
+
+  pthread_mutex_lock(&rwl_registry_mutex);
+  for (link = &rwl_registry; *link != NULL; link = &(*link)->profile.next)
+    if (*link == rwl) {
+      *link = rwl->profile.next;
+      break;
+    }
+  atomic_store_explicit(&rwl->profile.registered, 0, memory_order_relaxed);
+  pthread_mutex_unlock(&rwl_registry_mutex);
+}
+
+/*
+ * Record a read lock, for which the caller started waiting at
+ * "start" (0 if it didn't wait). Called with the mutex locked.
+ */
+static void
+rwl_prof_read(rwlock_t* rwl, long start)
+{
+  rwl_stats_t* stats = &rwl->profile.stats;
+
+  stats->r_acquired++;
+  if (start != 0) {
+    stats->r_contended++;
+    stats->r_wait += rwl_now() - start;
+  }
+  if (rwl->r_active > stats->r_max)
+    stats->r_max = rwl->r_active;
+}
+
+/*
+ * Record a write lock, for which the caller started waiting at
+ * "start" (0 if it didn't wait). Called with the mutex locked.
+ */
+static void
+rwl_prof_write(rwlock_t* rwl, long start)
+{
+  rwl_stats_t* stats = &rwl->profile.stats;
+
+  stats->w_acquired++;
+  rwl->profile.w_since = rwl_now();
+  if (start != 0) {
+    stats->w_contended++;
+    stats->w_wait += rwl->profile.w_since - start;
+  }
+}
+
+/*
+ * Record the end of a write lock. Called with the mutex locked.
+ */
+static void
+rwl_prof_unwrite(rwlock_t* rwl)
+{
+  long hold = rwl_now() - rwl->profile.w_since;
+
+  if (hold > rwl->profile.stats.w_hold_max)
+    rwl->profile.stats.w_hold_max = hold;
+}
+
+/*
+ * When a caller started waiting, if "blocked" says it must.
+ */
+#define RWL_PROF_START(blocked) ((blocked) ? rwl_now() : 0L)
+#else
+#define rwl_prof_register(rwl)
+#define rwl_prof_unregister(rwl)
+#define rwl_prof_read(rwl, start) ((void) (start))
+#define rwl_prof_write(rwl, start) ((void) (start))
+#define rwl_prof_unwrite(rwl)
+#define RWL_PROF_START(blocked) 0L
+#endif
+
+/*
+ * Initialize read-write lock attributes.
+ */
+int
+rwl_attr_init(rwl_attr_t* attr)
+{
+  attr->policy     = RWL_PREFER_READER;
+  attr->readmostly = 0;
+  attr->valid      = RWL_ATTR_VALID;
+  return 0;
+}
+
+/*
+ * Destroy read-write lock attributes.
+ */
+int
+rwl_attr_destroy(rwl_attr_t* attr)
+{
+  if (attr->valid != RWL_ATTR_VALID)
+    return EINVAL;
+  attr->valid = 0;
+  return 0;
+}
+
+/*
+ * Select the lock policy: RWL_PREFER_READER, RWL_PREFER_WRITER
+ * or RWL_PHASE_FAIR.
+ */
+int
+rwl_attr_setpolicy(rwl_attr_t* attr, int policy)
+{
+  if (attr->valid != RWL_ATTR_VALID)
+    return EINVAL;
+  if (policy != RWL_PREFER_READER && policy != RWL_PREFER_WRITER
+      && policy != RWL_PHASE_FAIR)
+    return EINVAL;
+  attr->policy = policy;
+  return 0;
+}
+
+int
+rwl_attr_getpolicy(const rwl_attr_t* attr, int* policy)
+{
+  if (attr->valid != RWL_ATTR_VALID)
+    return EINVAL;
+  *policy = attr->policy;
+  return 0;
+}
+
+/*
+ * Make the lock read-mostly: readers take it without the mutex
+ * while no writer has used it recently, at the price of slower
+ * write locking.
+ */
+int
+rwl_attr_setreadmostly(rwl_attr_t* attr, int readmostly)
+{
+  if (attr->valid != RWL_ATTR_VALID)
+    return EINVAL;
+  attr->readmostly = (readmostly != 0);
+  return 0;
+}
+
+int
+rwl_attr_getreadmostly(const rwl_attr_t* attr, int* readmostly)
+{
+  if (attr->valid != RWL_ATTR_VALID)
+    return EINVAL;
+  *readmostly = attr->readmostly;
+  return 0;
+}
+
 /*
  * Initialize a read-write lock
  */
 int
 rwl_init(rwlock_t* rwl)
 {
+  return rwl_init_attr(rwl, NULL);
+}
+
+/*
+ * Initialize a read-write lock with attributes; NULL means the
+ * defaults.
+ */
+int
+rwl_init_attr(rwlock_t* rwl, const rwl_attr_t* attr)
+{
+  pthread_condattr_t cond_attr;
+  int status;
+
+  if (attr != NULL && attr->valid != RWL_ATTR_VALID)
+    return EINVAL;
+  rwl->policy     = (attr != NULL ? attr->policy : RWL_PREFER_READER);
+  rwl->phase      = 0;
+  rwl->readmostly = (attr != NULL ? attr->readmostly : 0);
+  rwl->revoking   = 0;
+  rwl->inhibit    = 0;
+  rwl->clock      = CLOCK_MONOTONIC;
+  rwl->spin       = 0;
+  atomic_init(&rwl->rbias, 0);
+  atomic_init(&rwl->releases, 0);
+#ifdef RWL_PROFILE
+  memset(&rwl->profile, 0, sizeof(rwl->profile));
+  atomic_init(&rwl->profile.registered, 0);
+#endif
+
+  rwl->r_active = 0;
+  rwl->r_wait = rwl->w_wait = 0;
+  rwl->w_active             = 0;
+  rwl->u_active = rwl->u_wait = 0;
+  rwl->upgrading              = 0;
+  status                      = pthread_condattr_init(&cond_attr);
+  if (status != 0)
+    return status;
+  status = pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  if (status != 0) {
+    pthread_condattr_destroy(&cond_attr);
+    return status;
+  }
+  status = pthread_mutex_init(&rwl->mutex, NULL);
+  if (status != 0) {
+    pthread_condattr_destroy(&cond_attr);
+    return status;
+  }
+  status = pthread_cond_init(&rwl->read, &cond_attr);
+  if (status != 0) {
+    /* if unable to create read CV, destroy mutex */
+    pthread_mutex_destroy(&rwl->mutex);
+    pthread_condattr_destroy(&cond_attr);
+    return status;
+  }
+  status = pthread_cond_init(&rwl->write, &cond_attr);
+  if (status != 0) {
+    /* if unable to create write CV, destroy read CV and mutex */
+    pthread_cond_destroy(&rwl->read);
+    pthread_mutex_destroy(&rwl->mutex);
+    pthread_condattr_destroy(&cond_attr);
+    return status;
+  }
+  status = pthread_cond_init(&rwl->upgrade, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  if (status != 0) {
+    /* if unable to create upgrade CV, destroy the others */
+    pthread_cond_destroy(&rwl->write);
+    pthread_cond_destroy(&rwl->read);
+    pthread_mutex_destroy(&rwl->mutex);
+    return status;
+  }
+  rwl->valid = RWLOCK_VALID;
+  return 0;
+}
+
+/*
+ * Destroy a read-write lock
+ */
+int
+rwl_destroy(rwlock_t* rwl)
+{
+  int status, status1, status2, status3;
+
+  if (rwl->valid != RWLOCK_VALID)
+    return EINVAL;
+  status = pthread_mutex_lock(&rwl->mutex);
+  if (status != 0)
+    return status;
+
+  /*
+   * Check whether any threads own the lock; report "BUSY" if
+   * so.
+   */
+  if (rwl->r_active > 0 || rwl->w_active) {
+    pthread_mutex_unlock(&rwl->mutex);
+    return EBUSY;
+  }
+
+  /*
+   * Check whether any threads are known to be waiting; report
+   * EBUSY if so.
+   */
+  if (rwl->r_wait != 0 || rwl->w_wait != 0 || rwl->u_wait != 0
+      || rwl->revoking) {
+    pthread_mutex_unlock(&rwl->mutex);
+    return EBUSY;
+  }
+
+  /*
+   * Check whether any readers hold a read-mostly lock through
+   * the slots; report EBUSY if so.
+   */
+  if (rwl->readmostly && rwl_revoke(rwl, 0, NULL) < 0) {
+    pthread_mutex_unlock(&rwl->mutex);
+    return EBUSY;
+  }
+
+  rwl->valid = 0;
+  status     = pthread_mutex_unlock(&rwl->mutex);
+  if (status != 0)
+    return status;
+  rwl_prof_unregister(rwl);
+  status  = pthread_mutex_destroy(&rwl->mutex);
+  status1 = pthread_cond_destroy(&rwl->read);
+  status2 = pthread_cond_destroy(&rwl->write);
+  status3 = pthread_cond_destroy(&rwl->upgrade);
+  if (status == 0)
+    status = (status1 != 0 ? status1 : (status2 != 0 ? status2 : status3));
+  return status;
+}
+
+/*
+ * Return whether a reader must wait for the lock. Unless
+ * readers are preferred, they wait for waiting writers too.
+ * Whatever the policy, they wait for an upgradable reader that
+ * is waiting to upgrade, which would otherwise wait for them.
+ */
+static int
+rwl_readblocked(rwlock_t* rwl)
+{
+  return rwl->w_active || rwl->upgrading
+         || (rwl->policy != RWL_PREFER_READER && rwl->w_wait > 0);
+}
+
+/*
+ * Return whether a writer must wait for the lock. While another
+ * thread is revoking the readers' bias of a read-mostly lock,
+ * readers may hold it through the slots.
+ */
+static int
+rwl_writeblocked(rwlock_t* rwl)
+{
+  return rwl->w_active || rwl->r_active > 0 || rwl->revoking;
+}
+
+/*
+ * Tell spinning threads that a holder has unlocked. Called with
+ * the mutex locked.
+ */
+static void
+rwl_released(rwlock_t* rwl)
+{
+  unsigned int releases;
+
+  releases = atomic_load_explicit(&rwl->releases, memory_order_relaxed);
+  atomic_store_explicit(&rwl->releases, releases + 1, memory_order_relaxed);
+}
+
+/*
+ * Before waiting, spin with the mutex unlocked while "blocked"
+ * says the caller must wait, up to twice as many polls as
+ * spinning has usually taken to succeed. Each time a holder
+ * unlocks, lock the mutex and check again. Don't spin on a
+ * uniprocessor, where the holder can't run meanwhile. Called,
+ * and returns, with the mutex locked, unless it fails to lock
+ * it again.
+ */
+static int
+rwl_spin(rwlock_t* rwl, int (*blocked)(rwlock_t*))
+{
+  unsigned int releases;
+  int limit, spins = 0, status;
+
+  pthread_once(&rwl_once, rwl_count_cpus);
+  if (rwl_cpus < 2 || !blocked(rwl))
+    return 0;
+  limit = rwl->spin * 2 + RWL_SPIN_MIN;
+  if (limit > RWL_SPIN_MAX)
+    limit = RWL_SPIN_MAX;
+  while (spins < limit) {
+    releases = atomic_load_explicit(&rwl->releases, memory_order_relaxed);
+    pthread_mutex_unlock(&rwl->mutex);
+    do {
+      rwl_pause();
+      spins++;
+    } while (atomic_load_explicit(&rwl->releases, memory_order_relaxed)
+                 == releases
+             && spins < limit);
+    status = pthread_mutex_lock(&rwl->mutex);
+    if (status != 0)
+      return status;
+    if (!blocked(rwl)) {
+      rwl->spin += (spins - rwl->spin) / 8;
+      return 0;
+    }
+  }
+  rwl->spin -= rwl->spin / 8 + 1;
+  if (rwl->spin < 0)
+    rwl->spin = 0;
+  return 0;
+}
+
+/*
+ * Wait on one of the lock's condition variables, until
+ * "abstime" (on the CLOCK_MONOTONIC clock) if it's non-NULL.
+ * The condition variables of a lock initialized statically
+ * with RWL_INITIALIZER use CLOCK_REALTIME, so the deadline is
+ * converted for them.
+ */
+static int
+rwl_condwait(rwlock_t* rwl,
+             pthread_cond_t* cv,
+             const struct timespec* abstime)
+{
+  struct timespec now, deadline;
+  long nsec;
+
+  if (abstime == NULL)
+    return pthread_cond_wait(cv, &rwl->mutex);
+  if (rwl->clock == CLOCK_MONOTONIC)
+    return pthread_cond_timedwait(cv, &rwl->mutex, abstime);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  nsec = (abstime->tv_sec - now.tv_sec) * 1000000000L
+         + (abstime->tv_nsec - now.tv_nsec);
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  if (nsec > 0) {
+    deadline.tv_sec += nsec / 1000000000L;
+    deadline.tv_nsec += nsec % 1000000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+  return pthread_cond_timedwait(cv, &rwl->mutex, &deadline);
+}
+
+/*
+ * Revoke the readers' bias of a read-mostly lock before a writer
+ * or upgrading reader holds off readers, so that a thread that
+ * holds the lock through its slot may still lock it for read
+ * again, as it could a plain lock under RWL_PREFER_READER, and
+ * go on to unlock it. Meanwhile "revoking" keeps other writers
+ * out, and readers from setting "rbias" again; when done, wake
+ * the writers and upgraders that waited for it. If another
+ * thread is revoking, or a writer holds the lock (and so has
+ * revoked it), leave it to them. Gives up with ETIMEDOUT when
+ * "abstime" passes. Called, and returns, with the mutex locked,
+ * unless it fails to lock it again.
+ */
+static int
+rwl_unbias(rwlock_t* rwl, const struct timespec* abstime)
+{
+  long took;
+  int status;
+
+  if (!rwl->readmostly || rwl->revoking || rwl->w_active
+      || !atomic_load_explicit(&rwl->rbias, memory_order_relaxed))
+    return 0;
+  rwl->revoking = 1;
+  pthread_mutex_unlock(&rwl->mutex);
+  took   = rwl_revoke(rwl, 1, abstime);
+  status = pthread_mutex_lock(&rwl->mutex);
+  if (status != 0)
+    return status;
+  rwl->revoking = 0;
+  rwl_inhibit(rwl, took);
+  rwl_released(rwl);
+  if (rwl->w_wait > 0)
+    pthread_cond_broadcast(&rwl->write);
+  if (rwl->u_wait > 0 || rwl->upgrading)
+    pthread_cond_broadcast(&rwl->upgrade);
+  return (took < 0 ? ETIMEDOUT : 0);
+}
+
+/*
+ * Revoke the readers' bias of a read-mostly lock that the
+ * caller has just locked for write, in case readers set it again
+ * before then, and note the time it took. Called with the mutex
+ * unlocked. Return ETIMEDOUT if "abstime" passes first.
+ */
+static int
+rwl_revokeheld(rwlock_t* rwl, const struct timespec* abstime)
+{
+  long took;
+  int status;
+
+  took = rwl_revoke(rwl, 1, abstime);
+  if (took <= 0)
+    return (took < 0 ? ETIMEDOUT : 0);
+  status = pthread_mutex_lock(&rwl->mutex);
+  if (status != 0)
+    return status;
+  rwl_inhibit(rwl, took);
+  return pthread_mutex_unlock(&rwl->mutex);
+}
+
+/*
+ * Record that a reader has released the lock, and wake a writer
+ * or upgrading reader that is waiting for it. Called with the
+ * mutex locked.
+ */
+static int
+rwl_readdone(rwlock_t* rwl)
+{
+  rwl_released(rwl);
+  rwl->r_active--;
+  if (rwl->upgrading && rwl->r_active == 1)
+    return pthread_cond_broadcast(&rwl->upgrade);
+  if (rwl->r_active == 0 && rwl->w_wait > 0)
+    return pthread_cond_signal(&rwl->write);
+  return 0;
+}
+
+/*
+ * End a write phase of an RWL_PHASE_FAIR lock: hand the lock to
+ * every reader waiting for it, counting them active before they
+ * wake, so that no writer can get in first. Readers that arrive
+ * later wait for the next writer. Called with the mutex locked
+ * and no writer active.
+ */
+static int
+rwl_admit(rwlock_t* rwl)
+{
+  rwl->phase++;
+  rwl->r_active += rwl->r_wait;
+  rwl->r_wait = 0;
+  return pthread_cond_broadcast(&rwl->read);
+}
+
+/*
+ * Handle cleanup when the read lock condition variable
+ * wait is cancelled.
+ *
+ * Record that the thread is no longer waiting, and unlock the
+ * mutex. A reader that an RWL_PHASE_FAIR writer had already
+ * admitted holds the lock, so it releases it instead.
+ */
+static void
+rwl_readcleanup(void* arg)
+{
+  rwl_waiter_t* waiter = (rwl_waiter_t*) arg;
+  rwlock_t* rwl        = waiter->rwl;
+
+  if (rwl->phase != waiter->phase)
+    rwl_readdone(rwl);
+  else
+    rwl->r_wait--;
+  pthread_mutex_unlock(&rwl->mutex);
+}
+
+/*
+ * Lock a read-write lock for read access, waiting until
+ * "abstime" if it's non-NULL.
+ */
+static int
+rwl_readwait(rwlock_t* rwl, const struct timespec* abstime)
+{
+  rwl_waiter_t waiter;
+  long start;
+  int status;
+
+  if (rwl->valid != RWLOCK_VALID)
+    return EINVAL;
+  if (rwl->readmostly && rwl_fastread(rwl))
+    return 0;
+  rwl_prof_register(rwl);
+  status = pthread_mutex_lock(&rwl->mutex);
+  if (status != 0)
+    return status;
+  start  = RWL_PROF_START(rwl_readblocked(rwl));
+  status = rwl_spin(rwl, rwl_readblocked);
+  if (status != 0)
+    return status;
+  if (rwl_readblocked(rwl)) {
+    waiter.rwl   = rwl;
+    waiter.phase = rwl->phase;
+    rwl->r_wait++;
+    pthread_cleanup_push(rwl_readcleanup, (void*) &waiter);
+    while (rwl->phase == waiter.phase && rwl_readblocked(rwl)) {
+      status = rwl_condwait(rwl, &rwl->read, abstime);
+      if (status != 0)
+        break;
+    }
+    pthread_cleanup_pop(0);
+    if (rwl->phase != waiter.phase) {
+      /* admitted by rwl_admit(), which counted us active */
+      rwl_prof_read(rwl, start);
+      pthread_mutex_unlock(&rwl->mutex);
+      return 0;
+    }
+    rwl->r_wait--;
+    if (status == ETIMEDOUT && !rwl_readblocked(rwl))
+      status = 0;
+  }
+  if (status == 0) {
+    rwl->r_active++;
+    rwl_prof_read(rwl, start);
+    rwl_bias(rwl);
+  }
+  pthread_mutex_unlock(&rwl->mutex);
+  return status;
+}
+
+/*
+ * Lock a read-write lock for read access.
+ */
+int
+rwl_readlock(rwlock_t* rwl)
+{
+  return rwl_readwait(rwl, NULL);
+}
+
+/*
+ * Lock a read-write lock for read access, or return ETIMEDOUT
+ * if that can't be done by "abstime", on the CLOCK_MONOTONIC
+ * clock.
+ */
+int
+rwl_timedreadlock(rwlock_t* rwl, const struct timespec* abstime)
+{
+  if (abstime == NULL)
+    return EINVAL;
+  return rwl_readwait(rwl, abstime);
+}
+
+/*
+ * Attempt to lock a read-write lock for read access (don't
+ * block if unavailable).
+ */
+int
+rwl_readtrylock(rwlock_t* rwl)
+{
+  int status, status2;
+
+  if (rwl->valid != RWLOCK_VALID)
+    return EINVAL;
+  if (rwl->readmostly && rwl_fastread(rwl))
+    return 0;
+  rwl_prof_register(rwl);
+  status = pthread_mutex_lock(&rwl->mutex);
+  if (status != 0)
+    return status;
+  if (rwl_readblocked(rwl))
+    status = EBUSY;
+  else {
+    rwl->r_active++;
+    rwl_prof_read(rwl, 0L);
+    rwl_bias(rwl);
+  }
+  status2 = pthread_mutex_unlock(&rwl->mutex);
+  return (status2 != 0 ? status2 : status);
+}
+
+/*
+ * Unlock a read-write lock from read access.
+ */
+int
+rwl_readunlock(rwlock_t* rwl)
+{
+  int status, status2;
+
+  if (rwl->valid != RWLOCK_VALID)
+    return EINVAL;
+  if (rwl->readmostly && rwl_fastunlock(rwl))
+    return 0;
+  status = pthread_mutex_lock(&rwl->mutex);
+  if (status != 0)
+    return status;
+  status  = rwl_readdone(rwl);
+  status2 = pthread_mutex_unlock(&rwl->mutex);
+  return (status2 == 0 ? status : status2);
+}
+
+/*
+ * Clean up after a waiting writer that has given up, by being
+ * cancelled or timing out, with the mutex locked. If it was the
+ * last waiting writer, readers it was holding off can have the
+ * lock. If it was signalled just as it gave up, pass the signal
+ * on to another writer.
+ */
+static void
+rwl_writegone(rwlock_t* rwl)
+{
+  rwl_released(rwl);
+  if (rwl->w_wait == 0 && !rwl->w_active && rwl->r_wait > 0) {
+    if (rwl->policy == RWL_PHASE_FAIR)
+      rwl_admit(rwl);
+    else if (rwl->policy == RWL_PREFER_WRITER)
+      pthread_cond_broadcast(&rwl->read);
+  }
+  if (rwl->w_wait == 0 && rwl->u_wait > 0)
+    pthread_cond_broadcast(&rwl->upgrade);
+  if (rwl->w_wait > 0 && !rwl_writeblocked(rwl))
+    pthread_cond_signal(&rwl->write);
+}
+
+/*
+ * Handle cleanup when the write lock condition variable
+ * wait is cancelled.
+ *
+ * Record that the thread is no longer waiting, and unlock the
+ * mutex.
+ */
+static void
+rwl_writecleanup(void* arg)
+{
+  rwlock_t* rwl = (rwlock_t*) arg;
+
+  rwl->w_wait--;
+  rwl_writegone(rwl);
+  pthread_mutex_unlock(&rwl->mutex);
+}
+
+/*
+ * Lock a read-write lock for write access, waiting until
+ * "abstime" if it's non-NULL.
+ */
+static int
+rwl_writewait(rwlock_t* rwl, const struct timespec* abstime)
+{
+  long start;
   int status;
 
-  rwl->r_active = 0;
-  rwl->r_wait = rwl->w_wait = 0;
-  rwl->w_active             = 0;
-  status                    = pthread_mutex_init(&rwl->mutex, NULL);
+  if (rwl->valid != RWLOCK_VALID)
+    return EINVAL;
+  rwl_prof_register(rwl);
+  status = pthread_mutex_lock(&rwl->mutex);
   if (status != 0)
     return status;
-  status = pthread_cond_init(&rwl->read, NULL);
-  if (status != 0) {
-    /* if unable to create read CV, destroy mutex */
-    pthread_mutex_destroy(&rwl->mutex);
+  start  = RWL_PROF_START(rwl_writeblocked(rwl));
+  status = rwl_spin(rwl, rwl_writeblocked);
+  if (status != 0)
+    return status;
+  status = rwl_unbias(rwl, abstime);
+  if (status == ETIMEDOUT) {
+    rwl_writegone(rwl);
+    pthread_mutex_unlock(&rwl->mutex);
     return status;
   }
-  status = pthread_cond_init(&rwl->write, NULL);
-  if (status != 0) {
-    /* if unable to create write CV, destroy read CV and mutex */
-    pthread_cond_destroy(&rwl->read);
-    pthread_mutex_destroy(&rwl->mutex);
+  if (status != 0)
     return status;
+  if (rwl_writeblocked(rwl)) {
+    rwl->w_wait++;
+    pthread_cleanup_push(rwl_writecleanup, (void*) rwl);
+    while (rwl_writeblocked(rwl)) {
+      status = rwl_condwait(rwl, &rwl->write, abstime);
+      if (status != 0)
+        break;
+    }
+    pthread_cleanup_pop(0);
+    rwl->w_wait--;
+    if (status == ETIMEDOUT && !rwl_writeblocked(rwl))
+      status = 0;
+    else if (status != 0)
+      rwl_writegone(rwl);
   }
-  rwl->valid = RWLOCK_VALID;
-  return 0;
+  if (status == 0) {
+    rwl->w_active = 1;
+    rwl_prof_write(rwl, start);
+  }
+  pthread_mutex_unlock(&rwl->mutex);
+  if (status == 0 && rwl->readmostly) {
+    status = rwl_revokeheld(rwl, abstime);
+    if (status != 0) {
+      /* readers got back into the slots meanwhile */
+      rwl_writeunlock(rwl);
+    }
+  }
+  return status;
 }
 
 /*
- * Destroy a read-write lock
+ * Lock a read-write lock for write access.
  */
 int
-rwl_destroy(rwlock_t* rwl)
+rwl_writelock(rwlock_t* rwl)
+{
+  return rwl_writewait(rwl, NULL);
+}
+
+/*
+ * Lock a read-write lock for write access, or return ETIMEDOUT
+ * if that can't be done by "abstime", on the CLOCK_MONOTONIC
+ * clock.
+ */
+int
+rwl_timedwritelock(rwlock_t* rwl, const struct timespec* abstime)
+{
+  if (abstime == NULL)
+    return EINVAL;
+  return rwl_writewait(rwl, abstime);
+}
+
+/*
+ * Attempt to lock a read-write lock for write access. Don't
+ * block if unavailable.
+ */
+int
+rwl_writetrylock(rwlock_t* rwl)
 {
-  int status, status1, status2;
+  int status, status2;
 
   if (rwl->valid != RWLOCK_VALID)
     return EINVAL;
+  rwl_prof_register(rwl);
   status = pthread_mutex_lock(&rwl->mutex);
   if (status != 0)
     return status;
-
-  /*
-   * Check whether any threads own the lock; report "BUSY" if
-   * so.
-   */
-  if (rwl->r_active > 0 || rwl->w_active) {
-    pthread_mutex_unlock(&rwl->mutex);
-    return EBUSY;
+  if (rwl_writeblocked(rwl))
+    status = EBUSY;
+  else if (rwl->readmostly && rwl_revoke(rwl, 0, NULL) < 0)
+    status = EBUSY; /* readers hold it through the slots */
+  else {
+    rwl->w_active = 1;
+    rwl_prof_write(rwl, 0L);
   }
+  status2 = pthread_mutex_unlock(&rwl->mutex);
+  return (status != 0 ? status : status2);
+}
 
-  /*
-   * Check whether any threads are known to be waiting; report
-   * EBUSY if so.
-   */
-  if (rwl->r_wait != 0 || rwl->w_wait != 0) {
-    pthread_mutex_unlock(&rwl->mutex);
-    return EBUSY;
-  }
+/*
+ * Unlock a read-write lock from write access. Waiting readers
+ * go first, unless writers are preferred and one is waiting.
+ */
+int
+rwl_writeunlock(rwlock_t* rwl)
+{
+  int status;
 
-  rwl->valid = 0;
-  status     = pthread_mutex_unlock(&rwl->mutex);
+  if (rwl->valid != RWLOCK_VALID)
+    return EINVAL;
+  status = pthread_mutex_lock(&rwl->mutex);
   if (status != 0)
     return status;
-  status  = pthread_mutex_destroy(&rwl->mutex);
-  status1 = pthread_cond_destroy(&rwl->read);
-  status2 = pthread_cond_destroy(&rwl->write);
-  return (status == 0 ? status : (status1 == 0 ? status1 : status2));
+  rwl->w_active = 0;
+  rwl_prof_unwrite(rwl);
+  rwl_released(rwl);
+  if (rwl->policy == RWL_PREFER_WRITER && rwl->w_wait > 0) {
+    status = pthread_cond_signal(&rwl->write);
+    if (status != 0) {
+      pthread_mutex_unlock(&rwl->mutex);
+      return status;
+    }
+  }
+  else if (rwl->r_wait > 0) {
+    if (rwl->policy == RWL_PHASE_FAIR)
+      status = rwl_admit(rwl);
+    else
+      status = pthread_cond_broadcast(&rwl->read);
+    if (status != 0) {
+      pthread_mutex_unlock(&rwl->mutex);
+      return status;
+    }
+  }
+  else if (rwl->w_wait > 0) {
+    status = pthread_cond_signal(&rwl->write);
+    if (status != 0) {
+      pthread_mutex_unlock(&rwl->mutex);
+      return status;
+    }
+  }
+  if (rwl->u_wait > 0) {
+    status = pthread_cond_broadcast(&rwl->upgrade);
+    if (status != 0) {
+      pthread_mutex_unlock(&rwl->mutex);
+      return status;
+    }
+  }
+  status = pthread_mutex_unlock(&rwl->mutex);
+  return status;
 }
 
 /*
- * Handle cleanup when the read lock condition variable
- * wait is cancelled.
+ * Return whether an upgradable reader must wait for the lock: as
+ * a reader must, or for another upgradable reader, or for a
+ * thread revoking the readers' bias. It isn't admitted with the
+ * readers at the end of an RWL_PHASE_FAIR write phase, but waits
+ * for writers as if they were preferred.
+ */
+static int
+rwl_upgradeblocked(rwlock_t* rwl)
+{
+  return rwl->u_active || rwl->w_active || rwl->upgrading || rwl->revoking
+         || (rwl->policy != RWL_PREFER_READER && rwl->w_wait > 0);
+}
+
+/*
+ * Handle cleanup when the upgradable read lock condition
+ * variable wait is cancelled.
  *
  * Simply record that the thread is no longer waiting,
  * and unlock the mutex.
  */
 static void
-rwl_readcleanup(void* arg)
+rwl_upgradecleanup(void* arg)
 {
   rwlock_t* rwl = (rwlock_t*) arg;
 
-  rwl->r_wait--;
+  rwl->u_wait--;
   pthread_mutex_unlock(&rwl->mutex);
 }
 
 /*
- * Lock a read-write lock for read access.
+ * Lock a read-write lock for upgradable read access. The
+ * holder shares the lock with plain readers, but not with other
+ * upgradable readers. Upgradable readers never use the slots of
+ * a read-mostly lock.
  */
 int
-rwl_readlock(rwlock_t* rwl)
+rwl_upgradelock(rwlock_t* rwl)
 {
+  long start;
   int status;
 
   if (rwl->valid != RWLOCK_VALID)
     return EINVAL;
+  rwl_prof_register(rwl);
   status = pthread_mutex_lock(&rwl->mutex);
   if (status != 0)
     return status;
-  if (rwl->w_active) {
-    rwl->r_wait++;
-    pthread_cleanup_push(rwl_readcleanup, (void*) rwl);
-    while (rwl->w_active) {
-      status = pthread_cond_wait(&rwl->read, &rwl->mutex);
+  start = RWL_PROF_START(rwl_upgradeblocked(rwl));
+  if (rwl_upgradeblocked(rwl)) {
+    rwl->u_wait++;
+    pthread_cleanup_push(rwl_upgradecleanup, (void*) rwl);
+    while (rwl_upgradeblocked(rwl)) {
+      status = pthread_cond_wait(&rwl->upgrade, &rwl->mutex);
       if (status != 0)
         break;
     }
     pthread_cleanup_pop(0);
-    rwl->r_wait--;
+    rwl->u_wait--;
   }
-  if (status == 0)
+  if (status == 0) {
+    rwl->u_active = 1;
     rwl->r_active++;
+    rwl_prof_read(rwl, start);
+  }
   pthread_mutex_unlock(&rwl->mutex);
   return status;
 }
 
 /*
- * Attempt to lock a read-write lock for read access (don't
- * block if unavailable).
+ * Attempt to lock a read-write lock for upgradable read access
+ * (don't block if unavailable).
  */
 int
-rwl_readtrylock(rwlock_t* rwl)
+rwl_upgradetrylock(rwlock_t* rwl)
 {
   int status, status2;
 
   if (rwl->valid != RWLOCK_VALID)
     return EINVAL;
+  rwl_prof_register(rwl);
   status = pthread_mutex_lock(&rwl->mutex);
   if (status != 0)
     return status;
-  if (rwl->w_active)
+  if (rwl_upgradeblocked(rwl))
     status = EBUSY;
-  else
+  else {
+    rwl->u_active = 1;
     rwl->r_active++;
+    rwl_prof_read(rwl, 0L);
+  }
   status2 = pthread_mutex_unlock(&rwl->mutex);
   return (status2 != 0 ? status2 : status);
 }
 
 /*
- * Unlock a read-write lock from read access.
+ * Unlock a read-write lock from upgradable read access.
  */
 int
-rwl_readunlock(rwlock_t* rwl)
+rwl_upgradeunlock(rwlock_t* rwl)
 {
   int status, status2;
 
@@ -179,35 +1214,47 @@ rwl_readunlock(rwlock_t* rwl)
   status = pthread_mutex_lock(&rwl->mutex);
   if (status != 0)
     return status;
-  rwl->r_active--;
-  if (rwl->r_active == 0 && rwl->w_wait > 0)
-    status = pthread_cond_signal(&rwl->write);
+  rwl->u_active = 0;
+  status        = rwl_readdone(rwl);
+  if (status == 0 && rwl->u_wait > 0)
+    status = pthread_cond_broadcast(&rwl->upgrade);
   status2 = pthread_mutex_unlock(&rwl->mutex);
   return (status2 == 0 ? status : status2);
 }
 
 /*
- * Handle cleanup when the write lock condition variable
- * wait is cancelled.
+ * Handle cleanup when the wait to upgrade is cancelled.
  *
- * Simply record that the thread is no longer waiting,
- * and unlock the mutex.
+ * The thread still holds its upgradable read lock. Let the
+ * readers it was holding off have the lock, and unlock the
+ * mutex.
  */
 static void
-rwl_writecleanup(void* arg)
+rwl_upgradingcleanup(void* arg)
 {
   rwlock_t* rwl = (rwlock_t*) arg;
 
-  rwl->w_wait--;
+  rwl->upgrading = 0;
+  rwl_released(rwl);
+  if (rwl->r_wait > 0) {
+    if (rwl->policy == RWL_PHASE_FAIR && rwl->w_wait == 0)
+      rwl_admit(rwl);
+    else
+      pthread_cond_broadcast(&rwl->read);
+  }
   pthread_mutex_unlock(&rwl->mutex);
 }
 
 /*
- * Lock a read-write lock for write access.
+ * Turn an upgradable read lock into a write lock, waiting for
+ * the other readers to unlock; new readers wait meanwhile. No
+ * other writer can get the lock first. If the wait is
+ * cancelled, the thread still holds the upgradable read lock.
  */
 int
-rwl_writelock(rwlock_t* rwl)
+rwl_upgrade(rwlock_t* rwl)
 {
+  long start;
   int status;
 
   if (rwl->valid != RWLOCK_VALID)
@@ -215,29 +1262,46 @@ rwl_writelock(rwlock_t* rwl)
   status = pthread_mutex_lock(&rwl->mutex);
   if (status != 0)
     return status;
-  if (rwl->w_active || rwl->r_active > 0) {
-    rwl->w_wait++;
-    pthread_cleanup_push(rwl_writecleanup, (void*) rwl);
-    while (rwl->w_active || rwl->r_active > 0) {
-      status = pthread_cond_wait(&rwl->write, &rwl->mutex);
+  if (!rwl->u_active) {
+    pthread_mutex_unlock(&rwl->mutex);
+    return EPERM;
+  }
+  status = rwl_unbias(rwl, NULL);
+  if (status != 0)
+    return status;
+  start = RWL_PROF_START(rwl->r_active > 1 || rwl->revoking);
+  if (rwl->r_active > 1 || rwl->revoking) {
+    rwl->upgrading = 1;
+    pthread_cleanup_push(rwl_upgradingcleanup, (void*) rwl);
+    while (rwl->r_active > 1 || rwl->revoking) {
+      status = pthread_cond_wait(&rwl->upgrade, &rwl->mutex);
       if (status != 0)
         break;
     }
     pthread_cleanup_pop(0);
-    rwl->w_wait--;
+    rwl->upgrading = 0;
   }
-  if (status == 0)
+  if (status == 0) {
+    rwl->u_active = 0;
+    rwl->r_active = 0;
     rwl->w_active = 1;
+    rwl_prof_write(rwl, start);
+  }
+  else if (rwl->r_wait > 0)
+    pthread_cond_broadcast(&rwl->read);
   pthread_mutex_unlock(&rwl->mutex);
+  if (status == 0 && rwl->readmostly)
+    rwl_revokeheld(rwl, NULL);
   return status;
 }
 
 /*
- * Attempt to lock a read-write lock for write access. Don't
- * block if unavailable.
+ * Turn a write lock into a read lock, letting in the readers
+ * that were waiting for the writer (unless writers are
+ * preferred and one is waiting).
  */
 int
-rwl_writetrylock(rwlock_t* rwl)
+rwl_downgrade(rwlock_t* rwl)
 {
   int status, status2;
 
@@ -246,42 +1310,254 @@ rwl_writetrylock(rwlock_t* rwl)
   status = pthread_mutex_lock(&rwl->mutex);
   if (status != 0)
     return status;
-  if (rwl->w_active || rwl->r_active > 0)
-    status = EBUSY;
-  else
-    rwl->w_active = 1;
+  if (!rwl->w_active) {
+    pthread_mutex_unlock(&rwl->mutex);
+    return EPERM;
+  }
+  rwl->w_active = 0;
+  rwl->r_active++;
+  rwl_prof_unwrite(rwl);
+  rwl_released(rwl);
+  if (rwl->r_wait > 0) {
+    if (rwl->policy == RWL_PHASE_FAIR)
+      status = rwl_admit(rwl);
+    else if (rwl->policy == RWL_PREFER_READER || rwl->w_wait == 0)
+      status = pthread_cond_broadcast(&rwl->read);
+  }
+  if (status == 0 && rwl->u_wait > 0)
+    status = pthread_cond_broadcast(&rwl->upgrade);
+  rwl_bias(rwl);
   status2 = pthread_mutex_unlock(&rwl->mutex);
-  return (status != 0 ? status : status2);
+  return (status2 == 0 ? status : status2);
 }
 
 /*
- * Unlock a read-write lock from write access.
+ * Name a lock in its profile, for rwl_profile_dump(). The name
+ * isn't copied.
  */
 int
-rwl_writeunlock(rwlock_t* rwl)
+rwl_profile_setname(rwlock_t* rwl, const char* name)
 {
+#ifdef RWL_PROFILE
   int status;
 
   if (rwl->valid != RWLOCK_VALID)
     return EINVAL;
+  rwl_prof_register(rwl);
   status = pthread_mutex_lock(&rwl->mutex);
   if (status != 0)
     return status;
-  rwl->w_active = 0;
-  if (rwl->r_wait > 0) {
-    status = pthread_cond_broadcast(&rwl->read);
+  rwl->profile.stats.name = name;
+  return pthread_mutex_unlock(&rwl->mutex);
+#else
+  if (rwl->valid != RWLOCK_VALID)
+    return EINVAL;
+  return 0;
+#endif
+}
+
+/*
+ * Copy a lock's profile into "stats". Returns ENOSYS unless
+ * compiled with RWL_PROFILE.
+ */
+int
+rwl_profile_get(rwlock_t* rwl, rwl_stats_t* stats)
+{
+#ifdef RWL_PROFILE
+  int status;
+
+  if (rwl->valid != RWLOCK_VALID)
+    return EINVAL;
+  status = pthread_mutex_lock(&rwl->mutex);
+  if (status != 0)
+    return status;
+  *stats = rwl->profile.stats;
+  return pthread_mutex_unlock(&rwl->mutex);
+#else
+  if (rwl->valid != RWLOCK_VALID)
+    return EINVAL;
+  return ENOSYS;
+#endif
+}
+
+#ifdef RWL_PROFILE
+/*
+ * A copy of a registered lock's profile, for sorting.
+ */
+typedef struct rwl_snapshot_tag {
+  rwlock_t* rwl;
+  rwl_stats_t stats;
+} rwl_snapshot_t;
+
+/*
+ * qsort() comparison putting the locks that were waited for
+ * most often first, and then those waited for longest.
+ */
+static int
+rwl_prof_compare(const void* arg1, const void* arg2)
+{
+  const rwl_stats_t* stats1 = &((const rwl_snapshot_t*) arg1)->stats;
+  const rwl_stats_t* stats2 = &((const rwl_snapshot_t*) arg2)->stats;
+  unsigned long contended1  = stats1->r_contended + stats1->w_contended;
+  unsigned long contended2  = stats2->r_contended + stats2->w_contended;
+  long wait1                = stats1->r_wait + stats1->w_wait;
+  long wait2                = stats2->r_wait + stats2->w_wait;
+
+  if (contended1 != contended2)
+    return (contended1 < contended2 ? 1 : -1);
+  if (wait1 != wait2)
+    return (wait1 < wait2 ? 1 : -1);
+  return 0;
+}
+#endif
+
+/*
+ * Print the profiles of the "top" most contended registered
+ * locks (all of them if "top" is 0) to "file", most contended
+ * first. Returns ENOSYS unless compiled with RWL_PROFILE.
+ */
+int
+rwl_profile_dump(FILE* file, int top)
+{
+#ifdef RWL_PROFILE
+  rwl_snapshot_t* snapshots;
+  rwl_stats_t* stats;
+  rwlock_t* rwl;
+  char address[32];
+  int count = 0, index, status;
+
+  status = pthread_mutex_lock(&rwl_registry_mutex);
+  if (status != 0)
+    return status;
+  for (rwl = rwl_registry; rwl != NULL; rwl = rwl->profile.next) count++;
+  snapshots = malloc((count > 0 ? count : 1) * sizeof(rwl_snapshot_t));
+  if (snapshots == NULL) {
+    pthread_mutex_unlock(&rwl_registry_mutex);
+    return ENOMEM;
+  }
+  for (index = 0, rwl = rwl_registry; rwl != NULL; rwl = rwl->profile.next) {
+    pthread_mutex_lock(&rwl->mutex);
+    snapshots[index].rwl     = rwl;
+    snapshots[index++].stats = rwl->profile.stats;
+    pthread_mutex_unlock(&rwl->mutex);
+  }
+  pthread_mutex_unlock(&rwl_registry_mutex);
+  qsort(snapshots, count, sizeof(rwl_snapshot_t), rwl_prof_compare);
+
+  if (top <= 0 || top > count)
+    top = count;
+  fprintf(file,
+          "%-14s %8s %7s %8s %8s %7s %8s %4s %8s\n",
+          "lock",
+          "reads",
+          "waited",
+          "wait ms",
+          "writes",
+          "waited",
+          "wait ms",
+          "rmax",
+          "hold ms");
+  for (index = 0; index < top; index++) {
+    stats = &snapshots[index].stats;
+    if (stats->name == NULL)
+      snprintf(address, sizeof(address), "%p", (void*) snapshots[index].rwl);
+    fprintf(file,
+            "%-14.14s %8lu %7lu %8.1f %8lu %7lu %8.1f %4d %8.2f\n",
+            stats->name != NULL ? stats->name : address,
+            stats->r_acquired,
+            stats->r_contended,
+            stats->r_wait / 1000000.0,
+            stats->w_acquired,
+            stats->w_contended,
+            stats->w_wait / 1000000.0,
+            stats->r_max,
+            stats->w_hold_max / 1000000.0);
+  }
+  free(snapshots);
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+/*
+ * Initialize a striped table of "size" read-write locks, each
+ * initialized with "attr" (NULL means the defaults).
+ */
+int
+rwl_table_init(rwl_table_t* table, unsigned int size, const rwl_attr_t* attr)
+{
+  void* locks;
+  unsigned int index;
+  int status;
+
+  if (size == 0)
+    return EINVAL;
+  if (attr != NULL && attr->valid != RWL_ATTR_VALID)
+    return EINVAL;
+  if (attr != NULL)
+    table->attr = *attr;
+  else
+    rwl_attr_init(&table->attr);
+  status = posix_memalign(
+      &locks, RWL_CACHE_LINE, size * sizeof(rwlock_padded_t));
+  if (status != 0)
+    return status;
+  table->locks = (rwlock_padded_t*) locks;
+  for (index = 0; index < size; index++) {
+    status = rwl_init_attr(&table->locks[index].lock, &table->attr);
     if (status != 0) {
-      pthread_mutex_unlock(&rwl->mutex);
+      /* destroy the locks already initialized */
+      while (index-- > 0) rwl_destroy(&table->locks[index].lock);
+      free(table->locks);
       return status;
     }
   }
-  else if (rwl->w_wait > 0) {
-    status = pthread_cond_signal(&rwl->write);
+  table->size  = size;
+  table->valid = RWL_TABLE_VALID;
+  return 0;
+}
+
+/*
+ * Destroy a striped table of read-write locks. If any lock is
+ * busy, return EBUSY and leave the table as it was.
+ */
+int
+rwl_table_destroy(rwl_table_t* table)
+{
+  unsigned int index;
+  int status;
+
+  if (table->valid != RWL_TABLE_VALID)
+    return EINVAL;
+  for (index = 0; index < table->size; index++) {
+    status = rwl_destroy(&table->locks[index].lock);
     if (status != 0) {
-      pthread_mutex_unlock(&rwl->mutex);
+      /* put back the locks already destroyed */
+      while (index-- > 0)
+        rwl_init_attr(&table->locks[index].lock, &table->attr);
       return status;
     }
   }
-  status = pthread_mutex_unlock(&rwl->mutex);
-  return status;
+  table->valid = 0;
+  free(table->locks);
+  return 0;
+}
+
+/*
+ * Return in "*rwlock" the lock of a striped table that guards
+ * "key". The key is hashed (by Fibonacci hashing), so that keys
+ * that are close together, such as array indexes or pointers,
+ * spread over the locks.
+ */
+int
+rwl_table_lock(rwl_table_t* table, unsigned long key, rwlock_t** rwlock)
+{
+  uint64_t hash;
+
+  if (table->valid != RWL_TABLE_VALID)
+    return EINVAL;
+  hash    = (uint64_t) key * UINT64_C(0x9e3779b97f4a7c15);
+  *rwlock = &table->locks[(hash >> 32) % table->size].lock;
+  return 0;
 }
@@ -9,22 +9,143 @@
  * read access or exclusive write access.
  *
  * The rwl_init() and rwl_destroy() functions, respectively, allow you to
- * initialize/create and destroy/free the reader/writer lock.
+ * initialize/create and destroy/free the reader/writer lock. rwl_init_attr()
+ * initializes a lock with attributes, which select the policy that decides
+ * whether waiting readers or writers go first, and whether the lock is
+ * "read-mostly".
+ *
+ * An "upgradable" read lock (rwl_upgradelock()) shares the lock with plain
+ * readers, but excludes other upgradable readers, so that its holder can
+ * become the writer with rwl_upgrade() without unlocking: nobody else can
+ * have changed the data meanwhile. rwl_downgrade() turns a write lock into a
+ * read lock, again without unlocking.
+ *
+ * rwl_timedreadlock() and rwl_timedwritelock() give up with ETIMEDOUT when
+ * a deadline on the CLOCK_MONOTONIC clock passes. Before waiting, readers
+ * and writers spin for a while on a multiprocessor, in case the lock is
+ * released soon; how long adapts to how long spinning took to succeed
+ * before, between RWL_SPIN_MIN and RWL_SPIN_MAX polls.
+ *
+ * When compiled with RWL_PROFILE defined, each lock counts its
+ * acquisitions, how many had to wait and for how long, the most readers it
+ * had at once and the longest it was held for writing. Locks are entered in
+ * a registry when first used, and rwl_profile_dump() prints the most
+ * contended of them. Without RWL_PROFILE, none of this is compiled in. (Reads
+ * through the slots of a read-mostly lock are never counted, since that
+ * would defeat them.)
+ *
+ * Locks in an array, or next to the data they protect, share cache lines
+ * with their neighbours, so that threads locking different elements on
+ * different CPUs still steal the lines from each other ("false sharing").
+ * rwlock_padded_t is a lock alone on its own cache lines, and an rwl_table_t
+ * is a "striped" table of them, for data with too many items to give each a
+ * lock of its own: rwl_table_lock() hashes a key onto one of the locks.
  */
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Lock policies. With RWL_PREFER_READER, readers get the lock whenever no
+ * writer holds it, so a steady stream of readers can keep writers out
+ * indefinitely. With RWL_PREFER_WRITER, readers wait while any writer is
+ * waiting, so writers can starve readers instead. RWL_PHASE_FAIR alternates:
+ * a waiting writer holds off new readers, but when a writer unlocks, every
+ * reader waiting at that point gets the lock before the next writer, so
+ * neither side waits for more than one phase of the other.
+ */
+#define RWL_PREFER_READER 0
+#define RWL_PREFER_WRITER 1
+#define RWL_PHASE_FAIR 2
+
+/*
+ * A read-mostly lock lets readers avoid the mutex, in the manner of BRAVO
+ * ("Biased Locking for Reader-Writer Locks"). While the lock's "rbias" is
+ * set, a reader just claims a slot in a global table, chosen by hashing the
+ * lock and the thread, so that readers on different CPUs write different
+ * cache lines. A writer clears "rbias" and waits for every slot naming the
+ * lock to empty, before it takes the lock as usual. Since that is slow, the
+ * next slow path reader doesn't set "rbias" again until RWL_INHIBIT times as
+ * long as the revocation took has passed. Only one thread revokes at a time;
+ * other writers wait for it to finish. Since the writer doesn't hold off
+ * readers until it has emptied the slots, a thread holding the lock for read
+ * may lock it for read again while a writer waits, as with a plain lock
+ * under RWL_PREFER_READER.
+ */
+#define RWL_SLOT_BITS 10
+#define RWL_SLOTS (1 << RWL_SLOT_BITS)
+#define RWL_INHIBIT 9
+
+#define RWL_SPIN_MIN 10
+#define RWL_SPIN_MAX 1000
+
+#define RWL_CACHE_LINE 64
+
+/*
+ * Structure describing read-write lock creation attributes.
+ */
+typedef struct rwl_attr_tag {
+  int valid;      /* set when valid */
+  int policy;     /* RWL_PREFER_READER etc. */
+  int readmostly; /* readers use the slot table */
+} rwl_attr_t;
+
+#define RWL_ATTR_VALID 0xfacadf
+
+/*
+ * Structure describing a lock's profile (with RWL_PROFILE).
+ * Times are in nanoseconds.
+ */
+typedef struct rwl_stats_tag {
+  const char* name;          /* set by rwl_profile_setname */
+  unsigned long r_acquired;  /* read locks */
+  unsigned long r_contended; /* read locks that had to wait */
+  long r_wait;               /* total time waiting to read */
+  unsigned long w_acquired;  /* write locks */
+  unsigned long w_contended; /* write locks that had to wait */
+  long w_wait;               /* total time waiting to write */
+  int r_max;                 /* most readers at once */
+  long w_hold_max;           /* longest write lock */
+} rwl_stats_t;
+
+#ifdef RWL_PROFILE
+typedef struct rwl_profile_tag {
+  rwl_stats_t stats;
+  long w_since;            /* when the writer locked it */
+  atomic_int registered;   /* entered in the registry */
+  struct rwlock_tag* next; /* next in the registry */
+} rwl_profile_t;
+#endif
 
 /*
  * Structure describing a read-write lock.
  */
 typedef struct rwlock_tag {
   pthread_mutex_t mutex;
-  pthread_cond_t read;  /* wait for read */
-  pthread_cond_t write; /* wait for write */
-  int valid;            /* set when valid */
-  int r_active;         /* readers active */
-  int w_active;         /* writer active */
-  int r_wait;           /* readers waiting */
-  int w_wait;           /* writers waiting */
+  pthread_cond_t read;    /* wait for read */
+  pthread_cond_t write;   /* wait for write */
+  pthread_cond_t upgrade; /* wait for upgradable read or upgrade */
+  int valid;              /* set when valid */
+  int r_active;           /* readers active */
+  int w_active;           /* writer active */
+  int r_wait;             /* readers waiting */
+  int w_wait;             /* writers waiting */
+  int u_active;           /* upgradable reader active */
+  int u_wait;             /* upgradable readers waiting */
+  int upgrading;          /* upgradable reader waiting to write */
+  int policy;             /* RWL_PREFER_READER etc. */
+  unsigned long phase;    /* write phases ended (RWL_PHASE_FAIR) */
+  int readmostly;         /* readers use the slot table */
+  atomic_int rbias;       /* readers may use the slot table now */
+  int revoking;           /* a thread is emptying the slots */
+  long inhibit;           /* no "rbias" until then (nsec) */
+  clockid_t clock;        /* clock of the condition variables */
+  int spin;               /* average polls that succeeded */
+  atomic_uint releases;   /* bumped when a holder unlocks */
+#ifdef RWL_PROFILE
+  rwl_profile_t profile;  /* last, so RWL_INITIALIZER zeroes it */
+#endif
 } rwlock_t;
 
 #define RWLOCK_VALID 0xfacade
@@ -35,17 +156,65 @@ typedef struct rwlock_tag {
 #define RWL_INITIALIZER                                                        \
   {                                                                            \
     PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,                       \
-        PTHREAD_COND_INITIALIZER, RWLOCK_VALID, 0, 0, 0, 0                     \
+        PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, RWLOCK_VALID, 0,   \
+        0, 0, 0, 0, 0, 0, RWL_PREFER_READER, 0, 0, 0, 0, 0, CLOCK_REALTIME, 0, \
+        0                                                                      \
   }
 
+/*
+ * Structure describing a read-write lock padded to whole cache lines.
+ */
+typedef struct rwlock_padded_tag {
+  _Alignas(RWL_CACHE_LINE) rwlock_t lock;
+} rwlock_padded_t;
+
+#define RWL_PADDED_INITIALIZER { RWL_INITIALIZER }
+
+/*
+ * Structure describing a striped table of read-write locks.
+ */
+typedef struct rwl_table_tag {
+  rwlock_padded_t* locks; /* "size" padded locks */
+  unsigned int size;      /* number of locks */
+  rwl_attr_t attr;        /* attributes of the locks */
+  int valid;              /* set when valid */
+} rwl_table_t;
+
+#define RWL_TABLE_VALID 0xfacae0
+
 /*
  * Define read-write lock functions
  */
+extern int rwl_attr_init(rwl_attr_t* attr);
+extern int rwl_attr_destroy(rwl_attr_t* attr);
+extern int rwl_attr_setpolicy(rwl_attr_t* attr, int policy);
+extern int rwl_attr_getpolicy(const rwl_attr_t* attr, int* policy);
+extern int rwl_attr_setreadmostly(rwl_attr_t* attr, int readmostly);
+extern int rwl_attr_getreadmostly(const rwl_attr_t* attr, int* readmostly);
 extern int rwl_init(rwlock_t* rwlock);
+extern int rwl_init_attr(rwlock_t* rwlock, const rwl_attr_t* attr);
 extern int rwl_destroy(rwlock_t* rwlock);
 extern int rwl_readlock(rwlock_t* rwlock);
+extern int rwl_timedreadlock(rwlock_t* rwlock, const struct timespec* abstime);
 extern int rwl_readtrylock(rwlock_t* rwlock);
 extern int rwl_readunlock(rwlock_t* rwlock);
 extern int rwl_writelock(rwlock_t* rwlock);
+extern int rwl_timedwritelock(rwlock_t* rwlock,
+                              const struct timespec* abstime);
 extern int rwl_writetrylock(rwlock_t* rwlock);
 extern int rwl_writeunlock(rwlock_t* rwlock);
+extern int rwl_upgradelock(rwlock_t* rwlock);
+extern int rwl_upgradetrylock(rwlock_t* rwlock);
+extern int rwl_upgradeunlock(rwlock_t* rwlock);
+extern int rwl_upgrade(rwlock_t* rwlock);
+extern int rwl_downgrade(rwlock_t* rwlock);
+extern int rwl_profile_setname(rwlock_t* rwlock, const char* name);
+extern int rwl_profile_get(rwlock_t* rwlock, rwl_stats_t* stats);
+extern int rwl_profile_dump(FILE* file, int top);
+extern int rwl_table_init(rwl_table_t* table,
+                          unsigned int size,
+                          const rwl_attr_t* attr);
+extern int rwl_table_destroy(rwl_table_t* table);
+extern int rwl_table_lock(rwl_table_t* table,
+                          unsigned long key,
+                          rwlock_t** rwlock);
@@ -0,0 +1,194 @@
+/*
+ * rwlock_pad_main.c
+ *
+ * Measure what false sharing costs read-write locks. Each of 1
+ * to MAXTHREADS threads locks an element of its own ITERATIONS
+ * times, writing every INTERVAL iterations and reading
+ * otherwise, so that the threads never contend for a lock:
+ *
+ *   packed   elements laid out as in rwlock_main.c, each lock
+ *            sharing cache lines with its neighbours' locks and
+ *            data;
+ *   padded   each element's lock a rwlock_padded_t, alone on
+ *            its own cache lines;
+ *   striped  KEYS keys guarded by a table of STRIPES padded
+ *            locks, each thread locking random keys (so threads
+ *            do contend, now and then).
+ *
+ * The program reports the throughput of each in lock operations
+ * per millisecond. Padding helps only when the threads run on
+ * different CPUs at once: on a uniprocessor, the columns should
+ * be much the same.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "errors.h"
+#include "rwlock.h"
+
+#define MAXTHREADS 8
+#define ITERATIONS 200000
+#define INTERVAL 10
+#define KEYS 4096
+#define STRIPES 64
+
+#define PACKED 0
+#define PADDED 1
+#define STRIPED 2
+
+/*
+ * Elements with packed and padded locks.
+ */
+typedef struct packed_tag {
+  rwlock_t lock;
+  int data;
+  int updates;
+} packed_t;
+
+typedef struct padded_tag {
+  rwlock_padded_t lock;
+  int data;
+  int updates;
+} padded_t;
+
+/*
+ * Keep statistics for each thread.
+ */
+typedef struct thread_tag {
+  int thread_num;
+  pthread_t thread_id;
+  int layout;
+  long value;
+} thread_t;
+
+thread_t threads[MAXTHREADS];
+packed_t packed[MAXTHREADS];
+padded_t padded[MAXTHREADS];
+rwl_table_t table;
+int keys[KEYS];
+
+/*
+ * Thread start routine that locks its element, or random keys.
+ */
+void*
+thread_routine(void* arg)
+{
+  thread_t* self    = (thread_t*) arg;
+  unsigned int seed = self->thread_num + 1;
+  rwlock_t* lock;
+  int* data;
+  int iteration, key, status;
+
+  for (iteration = 0; iteration < ITERATIONS; iteration++) {
+    if (self->layout == PACKED) {
+      lock = &packed[self->thread_num].lock;
+      data = &packed[self->thread_num].data;
+    }
+    else if (self->layout == PADDED) {
+      lock = &padded[self->thread_num].lock.lock;
+      data = &padded[self->thread_num].data;
+    }
+    else {
+      key    = rand_r(&seed) % KEYS;
+      status = rwl_table_lock(&table, key, &lock);
+      if (status != 0)
+        err_abort(status, "Find lock");
+      data = &keys[key];
+    }
+    if ((iteration % INTERVAL) == 0) {
+      status = rwl_writelock(lock);
+      if (status != 0)
+        err_abort(status, "Write lock");
+      (*data)++;
+      status = rwl_writeunlock(lock);
+      if (status != 0)
+        err_abort(status, "Write unlock");
+    }
+    else {
+      status = rwl_readlock(lock);
+      if (status != 0)
+        err_abort(status, "Read lock");
+      self->value += *data;
+      status = rwl_readunlock(lock);
+      if (status != 0)
+        err_abort(status, "Read unlock");
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Run "count" threads with one layout, and return the
+ * throughput in lock operations per millisecond.
+ */
+double
+run(int layout, int count)
+{
+  struct timespec start, end;
+  double msec;
+  int thread, status;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (thread = 0; thread < count; thread++) {
+    threads[thread].thread_num = thread;
+    threads[thread].layout     = layout;
+    threads[thread].value      = 0;
+    status                     = pthread_create(&threads[thread].thread_id,
+                            NULL,
+                            thread_routine,
+                            (void*) &threads[thread]);
+    if (status != 0)
+      err_abort(status, "Create thread");
+  }
+  for (thread = 0; thread < count; thread++) {
+    status = pthread_join(threads[thread].thread_id, NULL);
+    if (status != 0)
+      err_abort(status, "Join thread");
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  msec = (end.tv_sec - start.tv_sec) * 1000.0
+         + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+  return (double) count * ITERATIONS / msec;
+}
+
+int
+main(int argc, char* argv[])
+{
+  long writes = 0, total = 0;
+  int count, element, status;
+
+  for (element = 0; element < MAXTHREADS; element++) {
+    status = rwl_init(&packed[element].lock);
+    if (status != 0)
+      err_abort(status, "Init packed lock");
+    status = rwl_init(&padded[element].lock.lock);
+    if (status != 0)
+      err_abort(status, "Init padded lock");
+  }
+  status = rwl_table_init(&table, STRIPES, NULL);
+  if (status != 0)
+    err_abort(status, "Init lock table");
+  printf("sizeof(packed_t) %zu, sizeof(padded_t) %zu\n",
+         sizeof(packed_t),
+         sizeof(padded_t));
+
+  printf("threads   packed   padded  striped  (lock operations/msec)\n");
+  for (count = 1; count <= MAXTHREADS; count *= 2) {
+    printf("%7d", count);
+    printf(" %8.0f", run(PACKED, count));
+    printf(" %8.0f", run(PADDED, count));
+    printf(" %8.0f\n", run(STRIPED, count));
+    writes += count * ((ITERATIONS + INTERVAL - 1) / INTERVAL);
+  }
+
+  for (element = 0; element < KEYS; element++) total += keys[element];
+  for (element = 0; element < MAXTHREADS; element++) {
+    rwl_destroy(&packed[element].lock);
+    rwl_destroy(&padded[element].lock.lock);
+  }
+  status = rwl_table_destroy(&table);
+  if (status != 0)
+    err_abort(status, "Destroy lock table");
+  printf("striped writes %s\n", total == writes ? "match" : "LOST");
+  return 0;
+}
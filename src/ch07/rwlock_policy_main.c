@@ -0,0 +1,221 @@
+/*
+ * rwlock_policy_main.c
+ *
+ * Measure how long writers wait for a read-write lock under
+ * heavy read load, for each lock policy. READERS threads read
+ * the shared data continuously, while WRITERS threads each make
+ * WRITES updates, pausing INTERVAL microseconds between them,
+ * and time each rwl_writelock call. The writer wait-time
+ * percentiles show writers starving when readers are preferred.
+ *
+ * Readers give up after LIMIT seconds, so that starved writers
+ * do finish; a writer wait near LIMIT means it got the lock
+ * only then.
+ *
+ * Run with an argument of "reader", "writer" or "phase" to
+ * measure one policy; the default is all three.
+ */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "errors.h"
+#include "rwlock.h"
+
+#define READERS 4
+#define WRITERS 2
+#define WRITES 500   /* updates per writer */
+#define INTERVAL 200 /* usec between updates */
+#define DATASIZE 256 /* elements read under the lock */
+#define LIMIT 5      /* seconds readers keep reading */
+
+typedef struct thread_tag {
+  pthread_t thread_id;
+  long reads;
+  long waits[WRITES]; /* usec per rwl_writelock */
+} thread_t;
+
+rwlock_t lock;
+int data[DATASIZE];
+atomic_int done;
+long start;
+thread_t readers[READERS];
+thread_t writers[WRITERS];
+
+/*
+ * Return the time in microseconds since an arbitrary starting
+ * point.
+ */
+long
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * Reader thread: sum the shared data under a read lock, until
+ * the writers are done or LIMIT seconds have passed.
+ */
+void*
+reader_routine(void* arg)
+{
+  thread_t* self = (thread_t*) arg;
+  long sum       = 0;
+  int index, status;
+
+  while (!atomic_load(&done) && now() - start < LIMIT * 1000000L) {
+    status = rwl_readlock(&lock);
+    if (status != 0)
+      err_abort(status, "Read lock");
+    for (index = 0; index < DATASIZE; index++) sum += data[index];
+    self->reads++;
+    status = rwl_readunlock(&lock);
+    if (status != 0)
+      err_abort(status, "Read unlock");
+  }
+  return (void*) sum;
+}
+
+/*
+ * Writer thread: make WRITES updates, timing the wait for the
+ * write lock.
+ */
+void*
+writer_routine(void* arg)
+{
+  thread_t* self = (thread_t*) arg;
+  struct timespec interval;
+  long begin;
+  int count, index, status;
+
+  interval.tv_sec  = 0;
+  interval.tv_nsec = INTERVAL * 1000;
+  for (count = 0; count < WRITES; count++) {
+    nanosleep(&interval, NULL);
+    begin  = now();
+    status = rwl_writelock(&lock);
+    if (status != 0)
+      err_abort(status, "Write lock");
+    self->waits[count] = now() - begin;
+    for (index = 0; index < DATASIZE; index++) data[index]++;
+    status = rwl_writeunlock(&lock);
+    if (status != 0)
+      err_abort(status, "Write unlock");
+  }
+  return NULL;
+}
+
+int
+compare(const void* a, const void* b)
+{
+  long x = *(const long*) a, y = *(const long*) b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * Run the readers and writers on a lock with the given policy,
+ * and report writer wait-time percentiles and reader throughput.
+ */
+void
+run(const char* name, int policy)
+{
+  static long waits[WRITERS * WRITES];
+  rwl_attr_t attr;
+  long elapsed, reads = 0;
+  int count, nwaits, status;
+
+  status = rwl_attr_init(&attr);
+  if (status != 0)
+    err_abort(status, "Init lock attributes");
+  status = rwl_attr_setpolicy(&attr, policy);
+  if (status != 0)
+    err_abort(status, "Set lock policy");
+  status = rwl_init_attr(&lock, &attr);
+  if (status != 0)
+    err_abort(status, "Init rw lock");
+  rwl_attr_destroy(&attr);
+
+  memset(readers, 0, sizeof(readers));
+  memset(writers, 0, sizeof(writers));
+  atomic_store(&done, 0);
+  start = now();
+  for (count = 0; count < READERS; count++) {
+    status = pthread_create(
+        &readers[count].thread_id, NULL, reader_routine, &readers[count]);
+    if (status != 0)
+      err_abort(status, "Create reader");
+  }
+  for (count = 0; count < WRITERS; count++) {
+    status = pthread_create(
+        &writers[count].thread_id, NULL, writer_routine, &writers[count]);
+    if (status != 0)
+      err_abort(status, "Create writer");
+  }
+  for (count = 0; count < WRITERS; count++) {
+    status = pthread_join(writers[count].thread_id, NULL);
+    if (status != 0)
+      err_abort(status, "Join writer");
+  }
+  atomic_store(&done, 1);
+  for (count = 0; count < READERS; count++) {
+    status = pthread_join(readers[count].thread_id, NULL);
+    if (status != 0)
+      err_abort(status, "Join reader");
+    reads += readers[count].reads;
+  }
+  elapsed = now() - start;
+  status  = rwl_destroy(&lock);
+  if (status != 0)
+    err_abort(status, "Destroy rw lock");
+
+  nwaits = 0;
+  for (count = 0; count < WRITERS; count++) {
+    memcpy(&waits[nwaits], writers[count].waits, sizeof(writers[count].waits));
+    nwaits += WRITES;
+  }
+  qsort(waits, nwaits, sizeof(long), compare);
+  printf("%-7s %9ld %9ld %9ld %9ld %12.0f\n",
+         name,
+         waits[nwaits / 2],
+         waits[nwaits * 90 / 100],
+         waits[nwaits * 99 / 100],
+         waits[nwaits - 1],
+         reads * 1000000.0 / elapsed);
+}
+
+int
+main(int argc, char* argv[])
+{
+  const char* names[] = {"reader", "writer", "phase"};
+  int policies[]      = {RWL_PREFER_READER, RWL_PREFER_WRITER, RWL_PHASE_FAIR};
+  int npolicies       = sizeof(policies) / sizeof(policies[0]);
+  int count, ran = 0;
+
+  printf("%d readers, %d writers x %d updates; writer wait in usec\n",
+         READERS,
+         WRITERS,
+         WRITES);
+  printf("%-7s %9s %9s %9s %9s %12s\n",
+         "policy",
+         "p50",
+         "p90",
+         "p99",
+         "max",
+         "reads/sec");
+  for (count = 0; count < npolicies; count++) {
+    if (argc > 1 && strcmp(argv[1], names[count]) != 0)
+      continue;
+    run(names[count], policies[count]);
+    ran++;
+  }
+  if (ran == 0) {
+    fprintf(stderr, "Usage: %s [reader|writer|phase]\n", argv[0]);
+    return 1;
+  }
+  return 0;
+}
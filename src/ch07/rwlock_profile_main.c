@@ -0,0 +1,161 @@
+/*
+ * rwlock_profile_main.c
+ *
+ * Demonstrate read-write lock profiling; build with RWL_PROFILE
+ * defined. THREADS threads loop over LOCKS locks that are used
+ * differently: some are mostly read, some often written, some
+ * held for a long time and one hardly used at all. Each lock is
+ * named, and afterwards the program prints the TOP most
+ * contended of them, and the average waits for "counters".
+ *
+ * The "cold" lock is initialized statically, to show that locks
+ * are entered in the registry when first used.
+ */
+#include <stdio.h>
+#include <time.h>
+#include "errors.h"
+#include "rwlock.h"
+
+#define THREADS 4
+#define ITERATIONS 20000
+#define LOCKS 4
+#define TOP 3
+
+/*
+ * A lock, how often it's used, and how long it's held.
+ */
+typedef struct lock_tag {
+  const char* name;
+  rwlock_t* rwlock;
+  int every;    /* used every "every" iterations */
+  int interval; /* written every "interval" uses */
+  long hold;    /* usec a writer holds it */
+  long data;
+} lock_t;
+
+rwlock_t config, counters, cache;
+rwlock_t cold = RWL_INITIALIZER;
+
+lock_t locks[LOCKS] = {
+    {"config", &config, 1, 1000, 1, 0},
+    {"counters", &counters, 1, 2, 1, 0},
+    {"cache", &cache, 4, 10, 200, 0},
+    {"cold", &cold, 100, 10, 1, 0}};
+
+/*
+ * Return the time in microseconds since an arbitrary starting
+ * point.
+ */
+long
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * Busy-wait for "usec" microseconds.
+ */
+void
+work(long usec)
+{
+  long end = now() + usec;
+
+  while (now() < end) continue;
+}
+
+/*
+ * Thread start routine that reads and writes the locked data.
+ */
+void*
+thread_routine(void* arg)
+{
+  lock_t* lock;
+  long value = 0;
+  int iteration, index, status;
+
+  for (iteration = 1; iteration <= ITERATIONS; iteration++) {
+    for (index = 0; index < LOCKS; index++) {
+      lock = &locks[index];
+      if (iteration % lock->every != 0)
+        continue;
+      if ((iteration / lock->every) % lock->interval == 0) {
+        status = rwl_writelock(lock->rwlock);
+        if (status != 0)
+          err_abort(status, "Write lock");
+        lock->data++;
+        work(lock->hold);
+        status = rwl_writeunlock(lock->rwlock);
+        if (status != 0)
+          err_abort(status, "Write unlock");
+      }
+      else {
+        status = rwl_readlock(lock->rwlock);
+        if (status != 0)
+          err_abort(status, "Read lock");
+        value += lock->data;
+        status = rwl_readunlock(lock->rwlock);
+        if (status != 0)
+          err_abort(status, "Read unlock");
+      }
+    }
+  }
+  return (void*) value;
+}
+
+int
+main(int argc, char* argv[])
+{
+  pthread_t threads[THREADS];
+  rwl_stats_t stats;
+  int count, status;
+
+  for (count = 0; count < LOCKS; count++) {
+    if (locks[count].rwlock != &cold) {
+      status = rwl_init(locks[count].rwlock);
+      if (status != 0)
+        err_abort(status, "Init rw lock");
+    }
+    status = rwl_profile_setname(locks[count].rwlock, locks[count].name);
+    if (status != 0)
+      err_abort(status, "Name rw lock");
+  }
+  for (count = 0; count < THREADS; count++) {
+    status = pthread_create(&threads[count], NULL, thread_routine, NULL);
+    if (status != 0)
+      err_abort(status, "Create thread");
+  }
+  for (count = 0; count < THREADS; count++) {
+    status = pthread_join(threads[count], NULL);
+    if (status != 0)
+      err_abort(status, "Join thread");
+  }
+
+  status = rwl_profile_dump(stdout, TOP);
+  if (status == ENOSYS) {
+    printf("Profiling not compiled in; build with -DRWL_PROFILE\n");
+    return 0;
+  }
+  if (status != 0)
+    err_abort(status, "Dump profiles");
+  status = rwl_profile_get(&counters, &stats);
+  if (status != 0)
+    err_abort(status, "Get profile");
+  printf("\n%s: %lu reads (%lu waited %ld nsec on average), "
+         "%lu writes (%lu waited %ld nsec on average)\n",
+         stats.name,
+         stats.r_acquired,
+         stats.r_contended,
+         stats.r_contended ? stats.r_wait / (long) stats.r_contended : 0L,
+         stats.w_acquired,
+         stats.w_contended,
+         stats.w_contended ? stats.w_wait / (long) stats.w_contended : 0L);
+  for (count = 0; count < LOCKS; count++) {
+    status = rwl_destroy(locks[count].rwlock);
+    if (status != 0)
+      err_abort(status, "Destroy rw lock");
+  }
+  return 0;
+}
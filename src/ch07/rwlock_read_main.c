@@ -0,0 +1,146 @@
+/*
+ * rwlock_read_main.c
+ *
+ * Compare read throughput of an ordinary read-write lock, whose
+ * readers all lock the same mutex, with a read-mostly one, whose
+ * readers each claim a slot of their own. For 1, 2, 4 ... THREADS
+ * readers, each thread read-locks the lock, reads an element of
+ * the shared data, and unlocks it, for SECONDS seconds; a writer
+ * updates the data every INTERVAL microseconds, so that
+ * read-mostly readers keep having to return to the slow path.
+ */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "errors.h"
+#include "rwlock.h"
+
+#define THREADS 16
+#define DATASIZE 64
+#define SECONDS 1
+#define INTERVAL 10000 /* usec between updates */
+
+typedef struct thread_tag {
+  pthread_t thread_id;
+  long reads;
+} thread_t;
+
+rwlock_t lock;
+int data[DATASIZE];
+atomic_int done;
+thread_t threads[THREADS];
+
+/*
+ * Reader thread: read the data until told to stop.
+ */
+void*
+reader_routine(void* arg)
+{
+  thread_t* self = (thread_t*) arg;
+  long sum       = 0;
+  int status;
+
+  while (!atomic_load_explicit(&done, memory_order_relaxed)) {
+    status = rwl_readlock(&lock);
+    if (status != 0)
+      err_abort(status, "Read lock");
+    sum += data[self->reads % DATASIZE];
+    status = rwl_readunlock(&lock);
+    if (status != 0)
+      err_abort(status, "Read unlock");
+    self->reads++;
+  }
+  return (void*) sum;
+}
+
+/*
+ * Writer thread: update the data every INTERVAL microseconds.
+ */
+void*
+writer_routine(void* arg)
+{
+  struct timespec interval;
+  int index, status;
+
+  interval.tv_sec  = 0;
+  interval.tv_nsec = INTERVAL * 1000;
+  while (!atomic_load(&done)) {
+    nanosleep(&interval, NULL);
+    status = rwl_writelock(&lock);
+    if (status != 0)
+      err_abort(status, "Write lock");
+    for (index = 0; index < DATASIZE; index++) data[index]++;
+    status = rwl_writeunlock(&lock);
+    if (status != 0)
+      err_abort(status, "Write unlock");
+  }
+  return NULL;
+}
+
+/*
+ * Run "readers" readers on a lock, read-mostly or not, and
+ * return the reads per second.
+ */
+double
+run(int readers, int readmostly)
+{
+  rwl_attr_t attr;
+  pthread_t writer;
+  struct timespec duration;
+  long reads = 0;
+  int count, status;
+
+  status = rwl_attr_init(&attr);
+  if (status != 0)
+    err_abort(status, "Init lock attributes");
+  status = rwl_attr_setreadmostly(&attr, readmostly);
+  if (status != 0)
+    err_abort(status, "Set read-mostly");
+  status = rwl_init_attr(&lock, &attr);
+  if (status != 0)
+    err_abort(status, "Init rw lock");
+  rwl_attr_destroy(&attr);
+
+  memset(threads, 0, sizeof(threads));
+  atomic_store(&done, 0);
+  for (count = 0; count < readers; count++) {
+    status = pthread_create(
+        &threads[count].thread_id, NULL, reader_routine, &threads[count]);
+    if (status != 0)
+      err_abort(status, "Create reader");
+  }
+  status = pthread_create(&writer, NULL, writer_routine, NULL);
+  if (status != 0)
+    err_abort(status, "Create writer");
+
+  duration.tv_sec  = SECONDS;
+  duration.tv_nsec = 0;
+  nanosleep(&duration, NULL);
+  atomic_store(&done, 1);
+
+  status = pthread_join(writer, NULL);
+  if (status != 0)
+    err_abort(status, "Join writer");
+  for (count = 0; count < readers; count++) {
+    status = pthread_join(threads[count].thread_id, NULL);
+    if (status != 0)
+      err_abort(status, "Join reader");
+    reads += threads[count].reads;
+  }
+  status = rwl_destroy(&lock);
+  if (status != 0)
+    err_abort(status, "Destroy rw lock");
+  return (double) reads / SECONDS;
+}
+
+int
+main(int argc, char* argv[])
+{
+  int readers;
+
+  printf("%7s %14s %14s\n", "readers", "reads/sec", "read-mostly");
+  for (readers = 1; readers <= THREADS; readers *= 2)
+    printf("%7d %14.0f %14.0f\n", readers, run(readers, 0), run(readers, 1));
+  return 0;
+}
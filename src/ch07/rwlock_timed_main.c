@@ -0,0 +1,332 @@
+/*
+ * rwlock_timed_main.c
+ *
+ * Demonstrate timed read-write locking. READERS "request
+ * handler" threads each handle REQUESTS requests, which must
+ * read-lock the shared data within BUDGET microseconds or be
+ * refused; WRITERS threads do the same with write locks. A
+ * "maintenance" thread now and then holds the write lock for
+ * much longer than the budget, so that some requests time out.
+ *
+ * For each kind of request, the program reports how many got
+ * the lock and how many timed out, and how late the latest
+ * timeout was reported after its deadline. Finally, it checks
+ * that timeouts left no waiter counted, by destroying the lock.
+ *
+ * Then it does the same for a read-mostly lock, on which a
+ * reader holds the lock through its slot for LINGER
+ * microseconds: a timed write lock must still give up by its
+ * deadline, and leave the lock to other readers. Then WRITERS
+ * threads, and the main thread with rwl_writetrylock(), lock it
+ * for write while the reader still holds it: none may get the
+ * lock before the reader unlocks, nor while another holds it.
+ */
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include "errors.h"
+#include "rwlock.h"
+
+#define READERS 4
+#define WRITERS 2
+#define REQUESTS 2000
+#define BUDGET 2000   /* usec a request may wait */
+#define WORK 50       /* usec a request holds the lock */
+#define HOLD 10000    /* usec maintenance holds the lock */
+#define PAUSE 20000   /* usec between maintenance */
+#define LINGER 500000 /* usec the read-mostly reader holds it */
+
+typedef struct thread_tag {
+  pthread_t thread_id;
+  int writer;
+  long locked;
+  long timedout;
+  long late; /* worst usec past the deadline */
+} thread_t;
+
+rwlock_t lock;
+long data;
+atomic_int done;
+atomic_int lingering;
+atomic_int writing;
+atomic_int overlaps;
+thread_t threads[READERS + WRITERS];
+
+/*
+ * Return the time in microseconds since an arbitrary starting
+ * point.
+ */
+long
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * Busy-wait for "usec" microseconds.
+ */
+void
+work(long usec)
+{
+  long end = now() + usec;
+
+  while (now() < end) continue;
+}
+
+/*
+ * Handler thread: lock the data for each request, within the
+ * budget.
+ */
+void*
+handler_routine(void* arg)
+{
+  thread_t* self = (thread_t*) arg;
+  struct timespec deadline;
+  long value = 0, late;
+  int count, status;
+
+  for (count = 0; count < REQUESTS; count++) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += BUDGET * 1000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    if (self->writer)
+      status = rwl_timedwritelock(&lock, &deadline);
+    else
+      status = rwl_timedreadlock(&lock, &deadline);
+    if (status == ETIMEDOUT) {
+      late = now() - (deadline.tv_sec * 1000000L + deadline.tv_nsec / 1000);
+      self->timedout++;
+      if (late > self->late)
+        self->late = late;
+      continue;
+    }
+    if (status != 0)
+      err_abort(status, "Timed lock");
+    self->locked++;
+    if (self->writer)
+      data++;
+    else
+      value += data;
+    work(WORK);
+    if (self->writer)
+      status = rwl_writeunlock(&lock);
+    else
+      status = rwl_readunlock(&lock);
+    if (status != 0)
+      err_abort(status, "Unlock");
+  }
+  return (void*) value;
+}
+
+/*
+ * Maintenance thread: hold the write lock for HOLD microseconds
+ * every PAUSE microseconds, until the handlers are done.
+ */
+void*
+maintenance_routine(void* arg)
+{
+  struct timespec pause;
+  int status;
+
+  pause.tv_sec  = 0;
+  pause.tv_nsec = PAUSE * 1000L;
+  while (!atomic_load(&done)) {
+    nanosleep(&pause, NULL);
+    status = rwl_writelock(&lock);
+    if (status != 0)
+      err_abort(status, "Write lock");
+    work(HOLD);
+    status = rwl_writeunlock(&lock);
+    if (status != 0)
+      err_abort(status, "Write unlock");
+  }
+  return NULL;
+}
+
+/*
+ * Reader thread for the read-mostly lock: lock it once through
+ * the mutex, which lets later readers use the slots, and then
+ * hold it through a slot for LINGER microseconds.
+ */
+void*
+linger_routine(void* arg)
+{
+  rwlock_t* rwl = (rwlock_t*) arg;
+  int status;
+
+  status = rwl_readlock(rwl);
+  if (status != 0)
+    err_abort(status, "Read lock");
+  status = rwl_readunlock(rwl);
+  if (status != 0)
+    err_abort(status, "Read unlock");
+  status = rwl_readlock(rwl);
+  if (status != 0)
+    err_abort(status, "Read lock");
+  atomic_store(&lingering, 1);
+  work(LINGER);
+  atomic_store(&lingering, 0);
+  status = rwl_readunlock(rwl);
+  if (status != 0)
+    err_abort(status, "Read unlock");
+  return NULL;
+}
+
+/*
+ * Writer thread for the read-mostly lock: count it as an overlap
+ * if the lingering reader or another writer holds the lock too.
+ */
+void*
+exclude_routine(void* arg)
+{
+  rwlock_t* rwl = (rwlock_t*) arg;
+  int status;
+
+  status = rwl_writelock(rwl);
+  if (status != 0)
+    err_abort(status, "Write lock");
+  if (atomic_fetch_add(&writing, 1) != 0 || atomic_load(&lingering))
+    atomic_fetch_add(&overlaps, 1);
+  work(WORK);
+  atomic_fetch_sub(&writing, 1);
+  status = rwl_writeunlock(rwl);
+  if (status != 0)
+    err_abort(status, "Write unlock");
+  return NULL;
+}
+
+/*
+ * Time a write lock on a read-mostly lock held by a reader, and
+ * check that writers exclude the reader and each other.
+ */
+void
+readmostly_check(void)
+{
+  pthread_t reader, writers[WRITERS];
+  rwl_attr_t attr;
+  rwlock_t rwl;
+  struct timespec deadline;
+  long late;
+  int count, status;
+
+  rwl_attr_init(&attr);
+  rwl_attr_setreadmostly(&attr, 1);
+  status = rwl_init_attr(&rwl, &attr);
+  if (status != 0)
+    err_abort(status, "Init read-mostly lock");
+  status = pthread_create(&reader, NULL, linger_routine, (void*) &rwl);
+  if (status != 0)
+    err_abort(status, "Create reader");
+  while (!atomic_load(&lingering)) sched_yield();
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_nsec += BUDGET * 1000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  status = rwl_timedwritelock(&rwl, &deadline);
+  late   = now() - (deadline.tv_sec * 1000000L + deadline.tv_nsec / 1000);
+  printf("read-mostly writer %s, %ld usec past the deadline\n",
+         status == ETIMEDOUT ? "timed out" : "GOT THE LOCK",
+         late);
+  if (status == 0)
+    rwl_writeunlock(&rwl);
+  else if (status != ETIMEDOUT)
+    err_abort(status, "Timed write lock");
+  status = rwl_readtrylock(&rwl);
+  if (status != 0)
+    err_abort(status, "Read lock after timeout");
+  status = rwl_readunlock(&rwl);
+  if (status != 0)
+    err_abort(status, "Read unlock");
+
+  for (count = 0; count < WRITERS; count++) {
+    status = pthread_create(
+        &writers[count], NULL, exclude_routine, (void*) &rwl);
+    if (status != 0)
+      err_abort(status, "Create writer");
+  }
+  work(BUDGET);
+  status = rwl_writetrylock(&rwl);
+  if (status == 0) {
+    if (atomic_load(&lingering))
+      atomic_fetch_add(&overlaps, 1);
+    rwl_writeunlock(&rwl);
+  }
+  else if (status != EBUSY)
+    err_abort(status, "Write trylock");
+  status = pthread_join(reader, NULL);
+  if (status != 0)
+    err_abort(status, "Join reader");
+  for (count = 0; count < WRITERS; count++) {
+    status = pthread_join(writers[count], NULL);
+    if (status != 0)
+      err_abort(status, "Join writer");
+  }
+  printf("read-mostly writers %s\n",
+         atomic_load(&overlaps) == 0 ? "excluded the reader and each other"
+                                     : "OVERLAPPED");
+  status = rwl_destroy(&rwl);
+  if (status != 0)
+    err_abort(status, "Destroy read-mostly lock");
+  printf("readers unblocked, read-mostly lock destroyed cleanly\n");
+}
+
+int
+main(int argc, char* argv[])
+{
+  pthread_t maintenance;
+  long locked[2] = {0, 0}, timedout[2] = {0, 0}, late[2] = {0, 0};
+  int count, kind, status;
+
+  status = rwl_init(&lock);
+  if (status != 0)
+    err_abort(status, "Init rw lock");
+  status = pthread_create(&maintenance, NULL, maintenance_routine, NULL);
+  if (status != 0)
+    err_abort(status, "Create maintenance thread");
+  for (count = 0; count < READERS + WRITERS; count++) {
+    threads[count].writer = (count >= READERS);
+    status                = pthread_create(&threads[count].thread_id,
+                            NULL,
+                            handler_routine,
+                            (void*) &threads[count]);
+    if (status != 0)
+      err_abort(status, "Create handler");
+  }
+  for (count = 0; count < READERS + WRITERS; count++) {
+    status = pthread_join(threads[count].thread_id, NULL);
+    if (status != 0)
+      err_abort(status, "Join handler");
+    kind = threads[count].writer;
+    locked[kind] += threads[count].locked;
+    timedout[kind] += threads[count].timedout;
+    if (threads[count].late > late[kind])
+      late[kind] = threads[count].late;
+  }
+  atomic_store(&done, 1);
+  status = pthread_join(maintenance, NULL);
+  if (status != 0)
+    err_abort(status, "Join maintenance thread");
+
+  for (kind = 0; kind < 2; kind++)
+    printf("%-7s %6ld locked  %6ld timed out  %6ld usec late at worst\n",
+           kind ? "writers" : "readers",
+           locked[kind],
+           timedout[kind],
+           late[kind]);
+  status = rwl_destroy(&lock);
+  if (status != 0)
+    err_abort(status, "Destroy rw lock");
+  printf("data %ld, lock destroyed cleanly\n", data);
+  readmostly_check();
+  return 0;
+}
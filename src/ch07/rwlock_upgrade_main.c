@@ -0,0 +1,226 @@
+/*
+ * rwlock_upgrade_main.c
+ *
+ * Demonstrate upgradable read locks with a cache that threads
+ * fill on demand. Each of THREADS threads looks up ITERATIONS
+ * random keys under a read lock; on a miss it must compute the
+ * value (FILL_WORK loop iterations) and store it, in one of two
+ * ways:
+ *
+ * "write":   unlock, write-lock, recheck (another thread may have
+ *            filled the entry meanwhile), fill, write-unlock,
+ *            and read-lock again to use the value.
+ * "upgrade": unlock, take an upgradable read lock, recheck while
+ *            plain readers carry on, and only on a miss upgrade
+ *            to write and fill; then downgrade to read the value
+ *            without unlocking.
+ *
+ * The cache is cleared every CLEAR lookups by the first thread,
+ * so that misses keep happening.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "errors.h"
+#include "rwlock.h"
+
+#define THREADS 8
+#define ITERATIONS 200000
+#define KEYS 64
+#define FILL_WORK 2000 /* loop iterations to compute a value */
+#define CLEAR 5000     /* lookups between clearing the cache */
+
+typedef struct thread_tag {
+  pthread_t thread_id;
+  int number;
+  int upgrade;  /* use upgradable read locks */
+  long misses;  /* misses under the read lock */
+  long filled;  /* values computed */
+  long wasted;  /* exclusive locks taken for nothing */
+  long checked; /* sum of values, to use them */
+} thread_t;
+
+typedef struct entry_tag {
+  int valid;
+  long value;
+} entry_t;
+
+rwlock_t lock;
+entry_t cache[KEYS];
+thread_t threads[THREADS];
+
+/*
+ * Compute the value for a key, slowly.
+ */
+long
+compute(int key)
+{
+  long value = key;
+  int count;
+
+  for (count = 0; count < FILL_WORK; count++)
+    value = value * 6364136223846793005L + 1442695040888963407L;
+  return value;
+}
+
+/*
+ * Fill in a missing entry the old way. Returns with the lock
+ * read-locked.
+ */
+void
+fill_write(thread_t* self, int key)
+{
+  int status;
+
+  status = rwl_readunlock(&lock);
+  if (status != 0)
+    err_abort(status, "Read unlock");
+  status = rwl_writelock(&lock);
+  if (status != 0)
+    err_abort(status, "Write lock");
+  if (cache[key].valid)
+    self->wasted++;
+  else {
+    cache[key].value = compute(key);
+    cache[key].valid = 1;
+    self->filled++;
+  }
+  status = rwl_writeunlock(&lock);
+  if (status != 0)
+    err_abort(status, "Write unlock");
+  status = rwl_readlock(&lock);
+  if (status != 0)
+    err_abort(status, "Read lock");
+}
+
+/*
+ * Fill in a missing entry with an upgradable read lock. Returns
+ * with the lock read-locked, or upgradable-read-locked if the
+ * entry turned out to be there; "*upgradable" says which.
+ */
+void
+fill_upgrade(thread_t* self, int key, int* upgradable)
+{
+  int status;
+
+  status = rwl_readunlock(&lock);
+  if (status != 0)
+    err_abort(status, "Read unlock");
+  status = rwl_upgradelock(&lock);
+  if (status != 0)
+    err_abort(status, "Upgradable lock");
+  if (cache[key].valid) {
+    *upgradable = 1;
+    return;
+  }
+  status = rwl_upgrade(&lock);
+  if (status != 0)
+    err_abort(status, "Upgrade");
+  cache[key].value = compute(key);
+  cache[key].valid = 1;
+  self->filled++;
+  status = rwl_downgrade(&lock);
+  if (status != 0)
+    err_abort(status, "Downgrade");
+  *upgradable = 0;
+}
+
+/*
+ * Thread start routine: look up random keys, filling the cache
+ * on misses.
+ */
+void*
+thread_routine(void* arg)
+{
+  thread_t* self    = (thread_t*) arg;
+  unsigned int seed = self->number + 1;
+  int iteration, key, upgradable, status;
+
+  for (iteration = 0; iteration < ITERATIONS; iteration++) {
+    if (self->number == 0 && iteration % CLEAR == 0) {
+      status = rwl_writelock(&lock);
+      if (status != 0)
+        err_abort(status, "Write lock");
+      memset(cache, 0, sizeof(cache));
+      status = rwl_writeunlock(&lock);
+      if (status != 0)
+        err_abort(status, "Write unlock");
+    }
+
+    key        = rand_r(&seed) % KEYS;
+    upgradable = 0;
+    status     = rwl_readlock(&lock);
+    if (status != 0)
+      err_abort(status, "Read lock");
+    if (!cache[key].valid) {
+      self->misses++;
+      if (self->upgrade)
+        fill_upgrade(self, key, &upgradable);
+      else
+        fill_write(self, key);
+    }
+    self->checked += cache[key].value;
+    if (upgradable)
+      status = rwl_upgradeunlock(&lock);
+    else
+      status = rwl_readunlock(&lock);
+    if (status != 0)
+      err_abort(status, "Unlock");
+  }
+  return NULL;
+}
+
+/*
+ * Run the threads with one way of filling the cache, and report
+ * how it went.
+ */
+void
+run(const char* name, int upgrade)
+{
+  struct timespec start, end;
+  long misses = 0, filled = 0, wasted = 0;
+  int count, status;
+
+  status = rwl_init(&lock);
+  if (status != 0)
+    err_abort(status, "Init rw lock");
+  memset(cache, 0, sizeof(cache));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (count = 0; count < THREADS; count++) {
+    memset(&threads[count], 0, sizeof(threads[count]));
+    threads[count].number  = count;
+    threads[count].upgrade = upgrade;
+    status                 = pthread_create(
+        &threads[count].thread_id, NULL, thread_routine, &threads[count]);
+    if (status != 0)
+      err_abort(status, "Create thread");
+  }
+  for (count = 0; count < THREADS; count++) {
+    status = pthread_join(threads[count].thread_id, NULL);
+    if (status != 0)
+      err_abort(status, "Join thread");
+    misses += threads[count].misses;
+    filled += threads[count].filled;
+    wasted += threads[count].wasted;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  status = rwl_destroy(&lock);
+  if (status != 0)
+    err_abort(status, "Destroy rw lock");
+  printf("%-8s %8.1f msec  %7ld misses  %7ld filled  %7ld wasted\n",
+         name,
+         (end.tv_sec - start.tv_sec) * 1000.0
+             + (end.tv_nsec - start.tv_nsec) / 1000000.0,
+         misses,
+         filled,
+         wasted);
+}
+
+int
+main(int argc, char* argv[])
+{
+  run("write", 0);
+  run("upgrade", 1);
+  return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * seqlock.c
+ *
+ * This file implements the "sequence lock" synchronization
+ * construct.
+ *
+ * The seql_init() and seql_destroy() functions, respectively,
+ * allow you to initialize/create and destroy/free the sequence
+ * lock.
+ *
+ * A reader calls seql_readbegin() to get the current sequence
+ * number, reads the data, and then calls seql_readend() with
+ * that number, which returns EAGAIN if a writer may have changed
+ * the data meanwhile, in which case the reader starts over.
+ *
+ * The seql_writelock() function locks a sequence lock for
+ * exclusive write access, and seql_writeunlock() releases the
+ * lock.
+ *
+ * The ordering follows Boehm, "Can Seqlocks Get Along With
+ * Programming Language Memory Models?": the writer's release
+ * fence keeps its data stores after the odd sequence number, and
+ * the reader's acquire fence keeps its data loads before its
+ * second look at the sequence number.
+ */
+#include "seqlock.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "errors.h"
+
+/*
+ * Initialize a sequence lock
+ */
+int
+seql_init(seqlock_t* sl)
+{
+  int status;
+
+  atomic_init(&sl->seq, 0);
+  status = pthread_mutex_init(&sl->mutex, NULL);
+  if (status != 0)
+    return status;
+  sl->valid = SEQLOCK_VALID;
+  return 0;
+}
+
+/*
+ * Destroy a sequence lock
+ */
+int
+seql_destroy(seqlock_t* sl)
+{
+  int status;
+
+  if (sl->valid != SEQLOCK_VALID)
+    return EINVAL;
+  status = pthread_mutex_lock(&sl->mutex);
+  if (status != 0)
+    return status;
+  sl->valid = 0;
+  status    = pthread_mutex_unlock(&sl->mutex);
+  if (status != 0)
+    return status;
+  return pthread_mutex_destroy(&sl->mutex);
+}
+
+/*
+ * Begin reading: wait until no writer is active, and return the
+ * sequence number in "*seq".
+ */
+int
+seql_readbegin(seqlock_t* sl, unsigned int* seq)
+{
+  unsigned int current;
+  int spins = 0;
+
+  if (sl->valid != SEQLOCK_VALID)
+    return EINVAL;
+  while ((current = atomic_load_explicit(&sl->seq, memory_order_acquire))
+         & 1) {
+    if (++spins >= SEQL_SPIN) {
+      sched_yield();
+      spins = 0;
+    }
+  }
+  *seq = current;
+  return 0;
+}
+
+/*
+ * Finish reading: return EAGAIN if a writer has begun since
+ * seql_readbegin() returned "seq", so that what was read may be
+ * inconsistent.
+ */
+int
+seql_readend(seqlock_t* sl, unsigned int seq)
+{
+  if (sl->valid != SEQLOCK_VALID)
+    return EINVAL;
+  atomic_thread_fence(memory_order_acquire);
+  if (atomic_load_explicit(&sl->seq, memory_order_relaxed) != seq)
+    return EAGAIN;
+  return 0;
+}
+
+/*
+ * Lock a sequence lock for write access.
+ */
+int
+seql_writelock(seqlock_t* sl)
+{
+  unsigned int seq;
+  int status;
+
+  if (sl->valid != SEQLOCK_VALID)
+    return EINVAL;
+  status = pthread_mutex_lock(&sl->mutex);
+  if (status != 0)
+    return status;
+  seq = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+  atomic_store_explicit(&sl->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  return 0;
+}
+
+/*
+ * Unlock a sequence lock from write access.
+ */
+int
+seql_writeunlock(seqlock_t* sl)
+{
+  unsigned int seq;
+
+  if (sl->valid != SEQLOCK_VALID)
+    return EINVAL;
+  seq = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+  atomic_store_explicit(&sl->seq, seq + 1, memory_order_release);
+  return pthread_mutex_unlock(&sl->mutex);
+}
@@ -0,0 +1,62 @@
+/*
+ * seqlock.h
+ *
+ * This header file describes the "sequence lock" synchronization
+ * construct. The type seqlock_t describes the full state of the
+ * lock including the POSIX 1003.1c synchronization objects
+ * necessary.
+ *
+ * A sequence lock protects small, frequently read data. Writers
+ * are serialized by a mutex, and bump a sequence number before
+ * and after each update, so it's odd while an update is under
+ * way. Readers take no lock at all: they note the sequence
+ * number, read the data, and check that the number hasn't
+ * changed; if it has, the data may be torn, and they read it
+ * again. Readers write nothing, so they don't slow each other
+ * down, but a steady stream of writers can make them retry
+ * indefinitely.
+ *
+ * Since readers may read the data while a writer changes it, it
+ * must be accessed with atomic operations; relaxed ones are
+ * enough, since the sequence number orders them. For example:
+ *
+ *     do {
+ *       status = seql_readbegin(&lock, &seq);
+ *       value  = atomic_load_explicit(&data, memory_order_relaxed);
+ *       status = seql_readend(&lock, seq);
+ *     } while (status == EAGAIN);
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Structure describing a sequence lock.
+ */
+typedef struct seqlock_tag {
+  pthread_mutex_t mutex; /* serialize writers */
+  atomic_uint seq;       /* odd while writing */
+  int valid;             /* set when valid */
+} seqlock_t;
+
+#define SEQLOCK_VALID 0x5eca1e
+
+/*
+ * Readers that find an update under way spin this many times
+ * before yielding the processor to the writer.
+ */
+#define SEQL_SPIN 100
+
+/*
+ * Support static initialization of sequence locks
+ */
+#define SEQL_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, 0, SEQLOCK_VALID }
+
+/*
+ * Define sequence lock functions
+ */
+extern int seql_init(seqlock_t* seqlock);
+extern int seql_destroy(seqlock_t* seqlock);
+extern int seql_readbegin(seqlock_t* seqlock, unsigned int* seq);
+extern int seql_readend(seqlock_t* seqlock, unsigned int seq);
+extern int seql_writelock(seqlock_t* seqlock);
+extern int seql_writeunlock(seqlock_t* seqlock);
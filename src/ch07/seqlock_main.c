@@ -0,0 +1,208 @@
+/*
+ * seqlock_main.c
+ *
+ * Compare sequence locks with read-write locks on the workload
+ * of rwlock_main.c: THREADS threads walk an array of DATASIZE
+ * elements, each an int guarded by a lock, updating an element
+ * every "interval" iterations and reading it otherwise. The same
+ * workload is run once with an rwlock_t per element and once
+ * with a seqlock_t, and the times compared.
+ */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include "errors.h"
+#include "rwlock.h"
+#include "seqlock.h"
+
+#define THREADS 5
+#define DATASIZE 15
+#define ITERATIONS 1000000
+
+/*
+ * Keep statistics for each thread.
+ */
+typedef struct thread_tag {
+  int thread_num;
+  pthread_t thread_id;
+  int updates;
+  int reads;
+  int retries;
+  int interval;
+  int seqlock;
+} thread_t;
+
+/*
+ * Locks and shared data. "data" is read while a seqlock_t
+ * writer may be changing it, so it's atomic.
+ */
+typedef struct data_tag {
+  rwlock_t rwlock;
+  seqlock_t seqlock;
+  atomic_int data;
+  int updates;
+} data_t;
+
+thread_t threads[THREADS];
+data_t data[DATASIZE];
+
+/*
+ * Read an element under its read-write lock.
+ */
+int
+read_rwlock(data_t* element)
+{
+  int value, status;
+
+  status = rwl_readlock(&element->rwlock);
+  if (status != 0)
+    err_abort(status, "Read lock");
+  value  = atomic_load_explicit(&element->data, memory_order_relaxed);
+  status = rwl_readunlock(&element->rwlock);
+  if (status != 0)
+    err_abort(status, "Read unlock");
+  return value;
+}
+
+/*
+ * Read an element under its sequence lock, retrying if a writer
+ * got in the way.
+ */
+int
+read_seqlock(data_t* element, thread_t* self)
+{
+  unsigned int seq;
+  int value, status;
+
+  while (1) {
+    status = seql_readbegin(&element->seqlock, &seq);
+    if (status != 0)
+      err_abort(status, "Begin read");
+    value  = atomic_load_explicit(&element->data, memory_order_relaxed);
+    status = seql_readend(&element->seqlock, seq);
+    if (status == 0)
+      return value;
+    if (status != EAGAIN)
+      err_abort(status, "End read");
+    self->retries++;
+  }
+}
+
+/*
+ * Thread start routine that reads and updates the data.
+ */
+void*
+thread_routine(void* arg)
+{
+  thread_t* self = (thread_t*) arg;
+  data_t* current;
+  int repeats = 0;
+  int iteration;
+  int element = 0;
+  int status;
+
+  for (iteration = 0; iteration < ITERATIONS; iteration++) {
+    current = &data[element];
+    if ((iteration % self->interval) == 0) {
+      if (self->seqlock)
+        status = seql_writelock(&current->seqlock);
+      else
+        status = rwl_writelock(&current->rwlock);
+      if (status != 0)
+        err_abort(status, "Write lock");
+      atomic_store_explicit(
+          &current->data, self->thread_num, memory_order_relaxed);
+      current->updates++;
+      self->updates++;
+      if (self->seqlock)
+        status = seql_writeunlock(&current->seqlock);
+      else
+        status = rwl_writeunlock(&current->rwlock);
+      if (status != 0)
+        err_abort(status, "Write unlock");
+    }
+    else {
+      if (self->seqlock) {
+        if (read_seqlock(current, self) == self->thread_num)
+          repeats++;
+      }
+      else if (read_rwlock(current) == self->thread_num)
+        repeats++;
+      self->reads++;
+    }
+    element++;
+    if (element >= DATASIZE)
+      element = 0;
+  }
+  return (void*) (long) repeats;
+}
+
+/*
+ * Run the workload with one kind of lock, and report.
+ */
+void
+run(const char* name, int seqlock)
+{
+  struct timespec start, end;
+  unsigned int seed  = 1;
+  int thread_updates = 0;
+  long reads = 0, retries = 0;
+  int count, data_count, status;
+
+  for (data_count = 0; data_count < DATASIZE; data_count++) {
+    atomic_init(&data[data_count].data, 0);
+    data[data_count].updates = 0;
+    status                   = rwl_init(&data[data_count].rwlock);
+    if (status != 0)
+      err_abort(status, "Init rw lock");
+    status = seql_init(&data[data_count].seqlock);
+    if (status != 0)
+      err_abort(status, "Init sequence lock");
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (count = 0; count < THREADS; count++) {
+    threads[count].thread_num = count;
+    threads[count].updates    = 0;
+    threads[count].reads      = 0;
+    threads[count].retries    = 0;
+    threads[count].interval   = rand_r(&seed) % 71;
+    threads[count].seqlock    = seqlock;
+    status                    = pthread_create(&threads[count].thread_id,
+                            NULL,
+                            thread_routine,
+                            (void*) &threads[count]);
+    if (status != 0)
+      err_abort(status, "Create thread");
+  }
+  for (count = 0; count < THREADS; count++) {
+    status = pthread_join(threads[count].thread_id, NULL);
+    if (status != 0)
+      err_abort(status, "Join thread");
+    thread_updates += threads[count].updates;
+    reads += threads[count].reads;
+    retries += threads[count].retries;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (data_count = 0; data_count < DATASIZE; data_count++) {
+    thread_updates -= data[data_count].updates;
+    rwl_destroy(&data[data_count].rwlock);
+    seql_destroy(&data[data_count].seqlock);
+  }
+  printf("%-8s %8.1f msec  %9ld reads  %7ld retries  %s\n",
+         name,
+         (end.tv_sec - start.tv_sec) * 1000.0
+             + (end.tv_nsec - start.tv_nsec) / 1000000.0,
+         reads,
+         retries,
+         thread_updates == 0 ? "updates match" : "UPDATES LOST");
+}
+
+int
+main(int argc, char* argv[])
+{
+  run("rwlock", 0);
+  run("seqlock", 1);
+  return 0;
+}
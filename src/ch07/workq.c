@@ -19,290 +19,4578 @@
  * processing engine until the queue is empty; at that point,
  * processing threads will begin to shut down. (They will be
  * restarted when work appears.)
+ *
+ * In WORKQ_STEAL mode each server owns a Chase-Lev deque (see
+ * "Dynamic Circular Work-Stealing Deque", Chase & Lev, SPAA
+ * 2005, and the C11 formulation by Le et al., PPoPP 2013). The
+ * owner pushes and pops at the bottom without locking, and
+ * other servers steal from the top with a single
+ * compare-and-swap. The workq_t mutex then protects only the
+ * shared "injection" queue used by non-server threads, and the
+ * idle bookkeeping.
+ *
+ * Queue elements come from a per-queue pool rather than from
+ * malloc. Elements are carved out of slabs, which are only freed
+ * when the work queue is destroyed. Each server keeps a private
+ * cache of elements: those it frees after calling the engine go
+ * there, and it hands the surplus back in batches through a
+ * lock-free "returned" list. Threads that aren't servers
+ * allocate from a freelist protected by the workq_t mutex, which
+ * workq_add holds anyway, refilling it from the returned list.
+ *
+ * Idle servers wait for new work for an "idle timeout" before
+ * shutting down, unless there are no more than the minimum
+ * number of resident servers. The timeout may adapt to the
+ * traffic: workq_add keeps a running average of the lulls
+ * (gaps between requests longer than WORKQ_LULL), and servers
+ * wait for twice that, within the configured bounds, so that
+ * they survive the usual pause between bursts of work.
+ *
+ * A server that runs out of work polls for more for a little
+ * while (WORKQ_IDLE_SPINS times, yielding the CPU now and then
+ * so that a producer sharing it can run), and then sleeps on an
+ * "eventcount": it counts itself in "idle", notes the current
+ * "epoch", looks for work one last time, and sleeps (with a
+ * futex on Linux, or on "cv") only if the epoch hasn't moved on.
+ * To wake servers, a thread advances the epoch, and only makes
+ * a system call if one of them is actually asleep. The servers
+ * it wakes stop counting as idle at once, so that the requests
+ * that follow don't wake them again, or create new servers
+ * needlessly, before they're up.
+ *
+ * In WORKQ_RING mode requests are copied into the cells of a
+ * bounded multi-producer, multi-consumer ring (after Dmitry
+ * Vyukov's "bounded MPMC queue"). Each cell has a sequence
+ * number saying whether it's ready to be filled or emptied in
+ * the current lap of the ring, so producers and servers need
+ * only claim a position, with a compare-and-swap on the ring's
+ * head or tail, and then wait for nothing but the cell itself.
+ * Head and tail are kept on separate cache lines. The mutex
+ * and "cv" are only used to park idle servers, and the "space"
+ * condition variable to park producers waiting for room.
+ *
+ * In WORKQ_SHARD mode the shared queue is split into shards,
+ * each a FIFO list with its own mutex, and each with its own
+ * pool of elements for threads that aren't servers, so that
+ * workq_add needn't touch the workq_t mutex unless there's a
+ * server to wake. A request goes to the shorter of two shards
+ * chosen at random ("the power of two choices": see
+ * Mitzenmacher, "The Power of Two Choices in Randomized Load
+ * Balancing", 2001), which keeps the shards nearly even without
+ * looking at them all. Server N serves shard N first (modulo the
+ * number of shards) and then its neighbours, in turn, skipping
+ * empty shards without locking them. Idle servers park on the
+ * eventcount, as in the other modes, so a request on any shard
+ * can wake any of them.
+ *
+ * workq_submit queues a request with a completion handle, on
+ * which the caller can wait for the request's result. Handles
+ * are pooled like queue elements: each has its own mutex and
+ * condition variable, initialized once when its slab is
+ * allocated, and returns to the pool when both the caller and
+ * the server have released it.
+ *
+ * The shared queue is really one list per priority. Servers
+ * take from the highest priority with requests queued, unless
+ * the queue was created with an aging interval: then a request
+ * gains a priority level for every interval it waits, and
+ * servers take the request whose priority has grown the most.
+ * Only the oldest request of each priority needs checking,
+ * since they're queued in order.
+ *
+ * Server placement (Linux only) reads the CPU topology from
+ * sysfs when the work queue is created. WORKQ_AFFINITY_COMPACT
+ * and WORKQ_AFFINITY_SCATTER bind each server slot to one CPU,
+ * chosen in order of node, core and hardware thread -- or
+ * hardware thread, core and node, so that successive servers
+ * land on different nodes and cores. When the servers span more
+ * than one node, each request records the node of the thread
+ * that queued it: servers look a few requests into the shared
+ * queue for one from their own node, and steal from servers on
+ * their own node before the others.
+ *
+ * Statistics that change with every request are kept by the
+ * server slots, each writing only its own, and added up when
+ * they're read: the histograms of how long requests waited and
+ * ran, which the server updates around each call. Counters that
+ * change only when the workq_t mutex is held anyway (server
+ * creation, timeouts and wakeups) are kept in the workq_t. The
+ * deepest queue is the longest that the shared queue, a server's
+ * deque or the ring has been when a request was added; it's
+ * only written when it grows, so it's soon left alone.
+ *
+ * A task group counts the tasks spawned in it that haven't
+ * finished; each request carries a pointer to its group, and
+ * the server that runs (or drops) it counts it off. A server
+ * waiting on a group doesn't block while there's work queued:
+ * it takes requests just as its own loop would -- in
+ * WORKQ_STEAL mode, starting with the newest on its own deque,
+ * which are most likely the tasks it has just spawned -- and
+ * runs them. Only when there's nothing left to take does it
+ * sleep on the group, briefly, since the tasks running
+ * elsewhere may spawn more.
+ */
+#define _GNU_SOURCE /* CPU affinity */
+#include "workq.h"
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "errors.h"
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define WORKQ_CACHE_LINE 64
+#define WORKQ_DEQUE_SIZE 256   /* initial deque capacity (power of 2) */
+#define WORKQ_INJECT_BATCH 32  /* items moved from shared queue at once */
+#define WORKQ_SLAB_SIZE 64     /* elements allocated at once */
+#define WORKQ_CACHE_MAX 64     /* elements a server keeps for itself */
+#define WORKQ_LULL 1000        /* shortest gap (usec) counted as a lull */
+#define WORKQ_HANDLE_SLAB 32   /* handles allocated at once */
+#define WORKQ_NODE_WINDOW 8    /* requests searched for a local one */
+#define WORKQ_RING_SIZE 1024   /* default ring capacity */
+#define WORKQ_FULL_SPINS 1000  /* retries on a full ring before waiting */
+#define WORKQ_IDLE_SPINS 100   /* polls for work before sleeping */
+#define WORKQ_IDLE_YIELD 50    /* polls per yield of the CPU */
+#define WORKQ_GROUP_NAP 200    /* usec a group waiter sleeps between looks */
+
+#define WORKQ_SYSFS "/sys/devices/system"
+
+#define WORKQ_PENDING 0 /* handle states */
+#define WORKQ_RUNNING 1
+#define WORKQ_DONE 2
+#define WORKQ_CANCELED 3 /* cancelled, or expired */
+
+/*
+ * Completion handle for a request queued by workq_submit. It
+ * holds two references until it's complete: one for the caller,
+ * released by workq_release, and one for the server.
+ */
+struct workq_handle_tag {
+  struct workq_handle_tag* next; /* handle pool */
+  pthread_mutex_t mutex;
+  pthread_cond_t cv; /* wait for completion */
+  atomic_int state;  /* WORKQ_PENDING, WORKQ_DONE, etc. */
+  atomic_int refs;   /* references */
+  int waiters;       /* threads waiting on cv */
+  void* result;      /* result of routine */
+  workq_t* wq;       /* owning work queue */
+};
+
+/*
+ * A block of completion handles.
+ */
+typedef struct workq_hslab_tag {
+  struct workq_hslab_tag* next; /* all handle slabs of a work queue */
+  workq_handle_t handle[WORKQ_HANDLE_SLAB];
+} workq_hslab_t;
+
+/*
+ * Circular array holding the contents of a deque. When a deque
+ * grows, the old array is kept (linked through "prev") until the
+ * work queue is destroyed, since a thief may still be reading
+ * from it.
+ */
+typedef struct workq_array_tag {
+  struct workq_array_tag* prev; /* retired smaller array */
+  long size;                    /* number of slots (power of 2) */
+  _Atomic(workq_ele_t*) slot[]; /* queued elements */
+} workq_array_t;
+
+/*
+ * Chase-Lev work-stealing deque. "top" is only advanced (by
+ * thieves, or by the owner taking the last element); "bottom" is
+ * only written by the owner. Keep them on separate cache lines.
+ */
+typedef struct workq_deque_tag {
+  _Alignas(WORKQ_CACHE_LINE) atomic_long top;
+  _Alignas(WORKQ_CACHE_LINE) atomic_long bottom;
+  _Atomic(workq_array_t*) array;
+} workq_deque_t;
+
+/*
+ * A cell of a request ring. When "seq" equals a position on the
+ * ring, the cell is free for the producer that claims that
+ * position; when it's one more, the cell holds a request for
+ * the server that claims the position.
+ */
+typedef struct workq_cell_tag {
+  atomic_size_t seq;
+  workq_ele_t request; /* "next" and "node" aren't used */
+} workq_cell_t;
+
+/*
+ * Bounded request ring (WORKQ_RING). Producers claim positions
+ * at the head, and servers at the tail.
+ */
+typedef struct workq_ring_tag {
+  _Alignas(WORKQ_CACHE_LINE) atomic_size_t head;
+  _Alignas(WORKQ_CACHE_LINE) atomic_size_t tail;
+  _Alignas(WORKQ_CACHE_LINE) size_t mask; /* size - 1 */
+  workq_cell_t* cells;
+} workq_ring_t;
+
+/*
+ * A shard of a WORKQ_SHARD work queue: a list of requests, and
+ * a pool of elements for threads that aren't servers, protected
+ * by the shard's mutex. "length" may be read without the mutex,
+ * to choose between shards and to pass over empty ones. Each
+ * shard starts on a cache line of its own.
+ */
+typedef struct workq_shard_tag {
+  _Alignas(WORKQ_CACHE_LINE) pthread_mutex_t mutex;
+  workq_ele_t* first;        /* requests, oldest first */
+  workq_ele_t* last;
+  atomic_long length;        /* requests queued */
+  workq_ele_t* free;         /* element pool */
+  unsigned long pool_hits;   /* pool allocations */
+  unsigned long pool_misses; /* slab allocations */
+} workq_shard_t;
+
+/*
+ * A block of queue elements.
+ */
+typedef struct workq_slab_tag {
+  struct workq_slab_tag* next; /* all slabs of a work queue */
+  workq_ele_t ele[WORKQ_SLAB_SIZE];
+} workq_slab_t;
+
+/*
+ * Statistics kept by a server slot, if the work queue keeps
+ * statistics. Only the slot's server writes them, with relaxed
+ * atomic stores, so that they can be read at any time.
+ */
+typedef struct workq_wstats_tag {
+  atomic_ulong executed;                 /* requests run */
+  atomic_ulong wait[WORKQ_HIST_BUCKETS]; /* time queued (nsec) */
+  atomic_ulong run[WORKQ_HIST_BUCKETS];  /* time running (nsec) */
+} workq_wstats_t;
+
+/*
+ * Per-server state. A slot is claimed (under the workq_t mutex)
+ * when a server thread is created, and released when it exits.
+ * The element cache belongs to the slot, so a new server
+ * inherits the elements cached by the one before it.
+ */
+typedef struct workq_worker_tag {
+  workq_deque_t deque;       /* this server's work (WORKQ_STEAL) */
+  workq_t* wq;               /* owning work queue */
+  int index;                 /* slot number */
+  int active;                /* slot owned by a running server */
+  unsigned int seed;         /* victim selection */
+  workq_ele_t* cache;        /* private free elements */
+  int cached;                /* length of cache */
+  workq_handle_t* hcache;    /* private free handles */
+  int cpu;                   /* CPU the server is bound to, or -1 */
+  int node;                  /* NUMA node of that CPU, or -1 */
+  atomic_ulong pool_hits;    /* allocations from the cache */
+  atomic_ulong pool_misses;  /* allocations that needed a slab */
+  atomic_ulong expired;      /* requests dropped past deadline */
+  atomic_ulong cancelled;    /* requests dropped by workq_cancel */
+  workq_wstats_t* stats;     /* statistics, or NULL */
+  void* context;             /* the server's engine context */
+} workq_worker_t;
+
+/*
+ * The server slot of the calling thread, if it is a work queue
+ * server thread. Work queued by a server goes onto its own
+ * deque.
+ */
+static _Thread_local workq_worker_t* workq_self = NULL;
+
+/*
+ * Random number state of a thread that isn't a server, for
+ * choosing shards. (Servers use their slot's.)
+ */
+static _Thread_local unsigned int workq_seed = 0;
+
+/*
+ * Initialize a deque with an empty array.
+ */
+static int
+workq_deque_init(workq_deque_t* dq)
+{
+  workq_array_t* array;
+
+  array = (workq_array_t*) malloc(
+      sizeof(workq_array_t) + WORKQ_DEQUE_SIZE * sizeof(workq_ele_t*));
+  if (array == NULL)
+    return ENOMEM;
+  array->prev = NULL;
+  array->size = WORKQ_DEQUE_SIZE;
+  atomic_init(&dq->top, 0);
+  atomic_init(&dq->bottom, 0);
+  atomic_init(&dq->array, array);
+  return 0;
+}
+
+/*
+ * Free a deque's current and retired arrays. No thread may be
+ * using the deque.
+ */
+static void
+workq_deque_destroy(workq_deque_t* dq)
+{
+  workq_array_t *array, *prev;
+
+  array = atomic_load_explicit(&dq->array, memory_order_relaxed);
+  while (array != NULL) {
+    prev = array->prev;
+    free(array);
+    array = prev;
+  }
+}
+
+/*
+ * Double the size of a full deque (owner only). The elements
+ * between top and bottom are copied to the same logical
+ * positions, so concurrent thieves see consistent contents in
+ * either array.
+ */
+static workq_array_t*
+workq_deque_grow(workq_deque_t* dq, workq_array_t* old, long top, long bottom)
+{
+  workq_array_t* array;
+  long i;
+
+  array = (workq_array_t*) malloc(sizeof(workq_array_t)
+                                  + 2 * old->size * sizeof(workq_ele_t*));
+  if (array == NULL)
+    return NULL;
+  array->prev = old;
+  array->size = 2 * old->size;
+  for (i = top; i < bottom; i++)
+    atomic_store_explicit(
+        &array->slot[i & (array->size - 1)],
+        atomic_load_explicit(&old->slot[i & (old->size - 1)],
+                             memory_order_relaxed),
+        memory_order_relaxed);
+  atomic_store_explicit(&dq->array, array, memory_order_release);
+  return array;
+}
+
+/*
+ * Push an element onto the bottom of a deque (owner only).
+ */
+static int
+workq_deque_push(workq_deque_t* dq, workq_ele_t* we)
+{
+  workq_array_t* array;
+  long top, bottom;
+
+  bottom = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+  top    = atomic_load_explicit(&dq->top, memory_order_acquire);
+  array  = atomic_load_explicit(&dq->array, memory_order_relaxed);
+  if (bottom - top > array->size - 1) {
+    array = workq_deque_grow(dq, array, top, bottom);
+    if (array == NULL)
+      return ENOMEM;
+  }
+  atomic_store_explicit(
+      &array->slot[bottom & (array->size - 1)], we, memory_order_relaxed);
+  atomic_store_explicit(&dq->bottom, bottom + 1, memory_order_release);
+  return 0;
+}
+
+/*
+ * Number of elements that can be pushed without growing the
+ * deque (owner only).
+ */
+static long
+workq_deque_room(workq_deque_t* dq)
+{
+  workq_array_t* array;
+  long top, bottom;
+
+  bottom = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+  top    = atomic_load_explicit(&dq->top, memory_order_acquire);
+  array  = atomic_load_explicit(&dq->array, memory_order_relaxed);
+  return array->size - (bottom - top);
+}
+
+/*
+ * Number of elements on a deque (owner only).
+ */
+static long
+workq_deque_size(workq_deque_t* dq)
+{
+  return atomic_load_explicit(&dq->bottom, memory_order_relaxed)
+         - atomic_load_explicit(&dq->top, memory_order_relaxed);
+}
+
+/*
+ * Take the most recently pushed element from the bottom of a
+ * deque (owner only). Returns NULL if the deque is empty, or if
+ * a thief won the race for the last element.
+ */
+static workq_ele_t*
+workq_deque_take(workq_deque_t* dq)
+{
+  workq_array_t* array;
+  workq_ele_t* we;
+  long top, bottom;
+
+  bottom = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+  array  = atomic_load_explicit(&dq->array, memory_order_relaxed);
+  atomic_store_explicit(&dq->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  top = atomic_load_explicit(&dq->top, memory_order_relaxed);
+  if (top > bottom) {
+    /* Empty */
+    atomic_store_explicit(&dq->bottom, bottom + 1, memory_order_relaxed);
+    return NULL;
+  }
+  we = atomic_load_explicit(&array->slot[bottom & (array->size - 1)],
+                            memory_order_relaxed);
+  if (top == bottom) {
+    /*
+     * This is the last element: race any thieves for it by
+     * advancing top, as they do.
+     */
+    if (!atomic_compare_exchange_strong_explicit(&dq->top,
+                                                 &top,
+                                                 top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+      we = NULL;
+    atomic_store_explicit(&dq->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return we;
+}
+
+/*
+ * Steal the oldest element from the top of another server's
+ * deque. Returns NULL if the deque is empty.
+ */
+static workq_ele_t*
+workq_deque_steal(workq_deque_t* dq)
+{
+  workq_array_t* array;
+  workq_ele_t* we;
+  long top, bottom;
+
+  /*
+   * Losing the race means another thread took the element at
+   * top; try again for the next one unless the deque is empty.
+   * A failed compare-and-swap reloads top, and means that some
+   * other thread succeeded, so the thieves as a whole always make
+   * progress.
+   */
+  top = atomic_load_explicit(&dq->top, memory_order_acquire);
+  do {
+    atomic_thread_fence(memory_order_seq_cst);
+    bottom = atomic_load_explicit(&dq->bottom, memory_order_acquire);
+    if (top >= bottom)
+      return NULL;
+    array = atomic_load_explicit(&dq->array, memory_order_acquire);
+    we    = atomic_load_explicit(&array->slot[top & (array->size - 1)],
+                              memory_order_relaxed);
+  } while (!atomic_compare_exchange_strong_explicit(&dq->top,
+                                                    &top,
+                                                    top + 1,
+                                                    memory_order_seq_cst,
+                                                    memory_order_acquire));
+  return we;
+}
+
+/*
+ * Allocate a request ring of "size" cells (a power of 2).
+ */
+static workq_ring_t*
+workq_ring_init(size_t size)
+{
+  workq_ring_t* ring;
+  size_t pos;
+
+  if (posix_memalign((void**) &ring, WORKQ_CACHE_LINE, sizeof(*ring)) != 0)
+    return NULL;
+  ring->cells = (workq_cell_t*) malloc(size * sizeof(workq_cell_t));
+  if (ring->cells == NULL) {
+    free(ring);
+    return NULL;
+  }
+  for (pos = 0; pos < size; pos++) atomic_init(&ring->cells[pos].seq, pos);
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->mask = size - 1;
+  return ring;
+}
+
+/*
+ * Free a request ring.
+ */
+static void
+workq_ring_destroy(workq_ring_t* ring)
+{
+  free(ring->cells);
+  free(ring);
+}
+
+/*
+ * Put "count" requests on a ring, in consecutive cells, or
+ * return EAGAIN if there isn't room for them all. The cells are
+ * all checked before the head is moved past them: only the
+ * thread that moves the head can fill them, so they can't be
+ * taken in the meantime. Apart from their data, the requests
+ * are copies of "request".
+ */
+static int
+workq_ring_put(workq_ring_t* ring,
+               void** data,
+               size_t count,
+               const workq_ele_t* request)
+{
+  workq_cell_t* cell;
+  size_t pos, index;
+  intptr_t dif = 0;
+
+  pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  while (1) {
+    for (index = 0; index < count; index++) {
+      cell = &ring->cells[(pos + index) & ring->mask];
+      dif  = (intptr_t) atomic_load_explicit(&cell->seq, memory_order_acquire)
+            - (intptr_t) (pos + index);
+      if (dif != 0)
+        break;
+    }
+    if (index == count) {
+      if (atomic_compare_exchange_weak_explicit(&ring->head,
+                                                &pos,
+                                                pos + count,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    }
+    else if (dif < 0)
+      return EAGAIN; /* cell not yet emptied: full */
+    else
+      pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  }
+
+  for (index = 0; index < count; index++) {
+    cell               = &ring->cells[(pos + index) & ring->mask];
+    cell->request      = *request;
+    cell->request.data = data[index];
+    atomic_store_explicit(&cell->seq, pos + index + 1, memory_order_release);
+  }
+  return 0;
+}
+
+/*
+ * Take the oldest request from a ring, filling in "we". Returns
+ * 0 if the ring is empty.
+ */
+static int
+workq_ring_get(workq_ring_t* ring, workq_ele_t* we)
+{
+  workq_cell_t* cell;
+  size_t pos;
+  intptr_t dif;
+
+  pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while (1) {
+    cell = &ring->cells[pos & ring->mask];
+    dif  = (intptr_t) atomic_load_explicit(&cell->seq, memory_order_acquire)
+          - (intptr_t) (pos + 1);
+    if (dif == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->tail,
+                                                &pos,
+                                                pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    }
+    else if (dif < 0)
+      return 0; /* cell not yet filled: empty */
+    else
+      pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  }
+
+  *we       = cell->request;
+  we->next  = NULL;
+  we->node  = -1;
+  atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+  return 1;
+}
+
+/*
+ * Return the number of requests on a ring. It may be off while
+ * requests are being added or taken.
+ */
+static long
+workq_ring_depth(workq_ring_t* ring)
+{
+  size_t head, tail;
+
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  return (long) (head - tail);
+}
+
+/*
+ * Allocate and initialize "count" empty shards.
+ */
+static workq_shard_t*
+workq_shards_init(int count)
+{
+  workq_shard_t* shards;
+  int index, status;
+
+  if (posix_memalign(
+          (void**) &shards, WORKQ_CACHE_LINE, count * sizeof(*shards))
+      != 0)
+    return NULL;
+  for (index = 0; index < count; index++) {
+    status = pthread_mutex_init(&shards[index].mutex, NULL);
+    if (status != 0) {
+      while (--index >= 0) pthread_mutex_destroy(&shards[index].mutex);
+      free(shards);
+      return NULL;
+    }
+    shards[index].first = shards[index].last = NULL;
+    atomic_init(&shards[index].length, 0);
+    shards[index].free        = NULL;
+    shards[index].pool_hits   = 0;
+    shards[index].pool_misses = 0;
+  }
+  return shards;
+}
+
+/*
+ * Free a work queue's shards. (Their elements belong to the
+ * work queue's slabs.)
+ */
+static void
+workq_shards_destroy(workq_shard_t* shards, int count)
+{
+  int index;
+
+  for (index = 0; index < count; index++)
+    pthread_mutex_destroy(&shards[index].mutex);
+  free(shards);
+}
+
+/*
+ * Check whether a ring is too full to take "count" more
+ * requests.
+ */
+static int
+workq_ring_full(workq_ring_t* ring, size_t count)
+{
+  workq_cell_t* cell;
+  size_t pos;
+
+  pos  = atomic_load_explicit(&ring->head, memory_order_relaxed) + count - 1;
+  cell = &ring->cells[pos & ring->mask];
+  return (intptr_t) atomic_load_explicit(&cell->seq, memory_order_acquire)
+             - (intptr_t) pos
+         < 0;
+}
+
+/*
+ * Return the calling thread's server slot if it is a server of
+ * the work queue, otherwise NULL.
+ */
+static workq_worker_t*
+workq_local(workq_t* wq)
+{
+  workq_worker_t* self = workq_self;
+
+  return (self != NULL && self->wq == wq ? self : NULL);
+}
+
+/*
+ * Return the next number from a xorshift generator, which must
+ * be seeded with a non-zero value.
+ */
+static unsigned int
+workq_random(unsigned int* seed)
+{
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return *seed;
+}
+
+/*
+ * Allocate a new slab, and return its elements as a chain.
+ */
+static workq_ele_t*
+workq_slab_alloc(workq_t* wq)
+{
+  workq_slab_t* slab;
+  int count;
+
+  slab = (workq_slab_t*) malloc(sizeof(workq_slab_t));
+  if (slab == NULL)
+    return NULL;
+  for (count = 0; count < WORKQ_SLAB_SIZE - 1; count++)
+    slab->ele[count].next = &slab->ele[count + 1];
+  slab->ele[WORKQ_SLAB_SIZE - 1].next = NULL;
+  slab->next = atomic_load_explicit(&wq->slabs, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&wq->slabs,
+                                                &slab->next,
+                                                slab,
+                                                memory_order_release,
+                                                memory_order_relaxed))
+    ;
+  return &slab->ele[0];
+}
+
+/*
+ * Hand a chain of free elements back for other threads to
+ * allocate. Pushes never suffer from ABA, because the list is
+ * only ever emptied as a whole (by atomic exchange).
+ */
+static void
+workq_pool_return(workq_t* wq, workq_ele_t* first, workq_ele_t* last)
+{
+  workq_ele_t* head;
+
+  head = atomic_load_explicit(&wq->returned, memory_order_relaxed);
+  do {
+    last->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&wq->returned,
+                                                  &head,
+                                                  first,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+}
+
+/*
+ * Take a queue element from the freelist "list", which the
+ * caller must own, refilling it from the returned list or a new
+ * slab when it's empty. Sets *hit to 0 if a slab was needed.
+ */
+static workq_ele_t*
+workq_ele_take(workq_t* wq, workq_ele_t** list, int* hit)
+{
+  workq_ele_t* we;
+
+  *hit = 1;
+  we   = *list;
+  if (we == NULL)
+    we = atomic_exchange_explicit(&wq->returned, NULL, memory_order_acquire);
+  if (we == NULL) {
+    we = workq_slab_alloc(wq);
+    if (we == NULL)
+      return NULL;
+    *hit = 0;
+  }
+  *list                = we->next;
+  we->routine          = NULL;
+  we->handle           = NULL;
+  we->node             = -1;
+  we->group            = NULL;
+  we->deadline.tv_sec  = 0;
+  we->deadline.tv_nsec = 0;
+  return we;
+}
+
+/*
+ * Allocate a queue element. If "self" is non-NULL, it is the
+ * caller's server slot and the element comes from the slot's
+ * cache; otherwise the caller must hold the workq_t mutex and
+ * the element comes from the shared freelist.
+ */
+static workq_ele_t*
+workq_ele_alloc(workq_t* wq, workq_worker_t* self)
+{
+  workq_ele_t* we;
+  int hit;
+
+  we = workq_ele_take(wq, (self != NULL ? &self->cache : &wq->free), &hit);
+  if (we == NULL)
+    return NULL;
+
+  if (self != NULL) {
+    /*
+     * Count whatever we picked up from the returned list, so
+     * that workq_ele_free knows when to give some back.
+     */
+    if (self->cached > 0)
+      self->cached--;
+    else {
+      workq_ele_t* next;
+
+      for (next = self->cache; next != NULL; next = next->next)
+        self->cached++;
+    }
+    if (hit)
+      atomic_store_explicit(
+          &self->pool_hits,
+          atomic_load_explicit(&self->pool_hits, memory_order_relaxed) + 1,
+          memory_order_relaxed);
+    else
+      atomic_store_explicit(
+          &self->pool_misses,
+          atomic_load_explicit(&self->pool_misses, memory_order_relaxed) + 1,
+          memory_order_relaxed);
+  }
+  else if (hit)
+    wq->pool_hits++;
+  else
+    wq->pool_misses++;
+  return we;
+}
+
+/*
+ * Free a queue element into the caller's server cache. When
+ * the cache overflows, the older half goes back to the pool.
+ */
+static void
+workq_ele_free(workq_worker_t* self, workq_ele_t* we)
+{
+  workq_ele_t *first, *last;
+  int count;
+
+  we->next    = self->cache;
+  self->cache = we;
+  if (++self->cached <= WORKQ_CACHE_MAX)
+    return;
+  last = self->cache;
+  for (count = 1; count < WORKQ_CACHE_MAX / 2; count++) last = last->next;
+  first      = last->next;
+  last->next = NULL;
+  for (last = first; last->next != NULL; last = last->next)
+    ;
+  workq_pool_return(self->wq, first, last);
+  self->cached = WORKQ_CACHE_MAX / 2;
+}
+
+/*
+ * Note the current time as the time a request was queued, if
+ * the work queue keeps statistics.
+ */
+static void
+workq_stamp(workq_t* wq, struct timespec* queued)
+{
+  if (wq->stats)
+    clock_gettime(CLOCK_MONOTONIC, queued);
+}
+
+/*
+ * Return the nanoseconds from "start" to "end".
+ */
+static long
+workq_nsec(const struct timespec* start, const struct timespec* end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000000000L
+         + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Add one to a counter that only the calling thread writes.
+ */
+static void
+workq_count(atomic_ulong* counter)
+{
+  atomic_store_explicit(
+      counter,
+      atomic_load_explicit(counter, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+/*
+ * Return the histogram bucket for "nsec". Values below
+ * WORKQ_HIST_SUB have a bucket each; above that, each power of 2
+ * is split into WORKQ_HIST_SUB buckets by the bits that follow
+ * the highest set bit.
+ */
+static int
+workq_hist_bucket(long nsec)
+{
+  unsigned long value = (nsec > 0 ? nsec : 0);
+  int msb = 0, shift, bucket;
+
+  for (shift = 32; shift > 0; shift >>= 1) {
+    if (value >> (msb + shift) != 0)
+      msb += shift;
+  }
+  if (msb < WORKQ_HIST_SUB_BITS)
+    return (int) value;
+  bucket = (msb - WORKQ_HIST_SUB_BITS + 1) * WORKQ_HIST_SUB
+           + (int) ((value >> (msb - WORKQ_HIST_SUB_BITS))
+                    & (WORKQ_HIST_SUB - 1));
+  return (bucket < WORKQ_HIST_BUCKETS ? bucket : WORKQ_HIST_BUCKETS - 1);
+}
+
+/*
+ * Count "nsec" in a server's histogram.
+ */
+static void
+workq_hist_add(atomic_ulong* hist, long nsec)
+{
+  workq_count(&hist[workq_hist_bucket(nsec)]);
+}
+
+/*
+ * Note that a queue has grown to "depth" requests.
+ */
+static void
+workq_depth(workq_t* wq, long depth)
+{
+  long max = atomic_load_explicit(&wq->depth_max, memory_order_relaxed);
+
+  while (depth > max
+         && !atomic_compare_exchange_weak_explicit(&wq->depth_max,
+                                                   &max,
+                                                   depth,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed))
+    ;
+}
+
+/*
+ * Return the NUMA node on which the caller is running, if the
+ * servers span more than one node (otherwise -1). A server
+ * bound to a CPU knows its node already.
+ */
+static int
+workq_node(workq_t* wq, workq_worker_t* self)
+{
+#ifdef __linux__
+  int cpu;
+
+  if (wq->nodes <= 1)
+    return -1;
+  if (self != NULL && self->node >= 0)
+    return self->node;
+  cpu = sched_getcpu();
+  if (cpu < 0 || cpu >= wq->cpu_max)
+    return -1;
+  return wq->cpu_node[cpu];
+#else
+  return -1;
+#endif
+}
+
+/*
+ * Allocate a chain of request structures for workq_add_batch,
+ * one for each of the "count" data pointers. Like
+ * workq_ele_alloc, a server allocates from its cache and other
+ * threads must hold the workq_t mutex. Returns the first
+ * element and sets *lastp to the last, or returns NULL if
+ * memory runs out.
+ */
+static workq_ele_t*
+workq_chain_alloc(workq_t* wq,
+                  workq_worker_t* self,
+                  void** elements,
+                  size_t count,
+                  workq_ele_t** lastp)
+{
+  workq_ele_t *first = NULL, *last = NULL, *we;
+  struct timespec now;
+  size_t index;
+  int node = workq_node(wq, self);
+
+  workq_stamp(wq, &now);
+  for (index = 0; index < count; index++) {
+    we = workq_ele_alloc(wq, self);
+    if (we == NULL) {
+      if (first != NULL)
+        workq_pool_return(wq, first, last);
+      return NULL;
+    }
+    we->data   = elements[index];
+    we->node   = node;
+    we->queued = now;
+    if (first == NULL)
+      first = we;
+    else
+      last->next = we;
+    last = we;
+  }
+  last->next = NULL;
+  *lastp     = last;
+  return first;
+}
+
+/*
+ * Allocate a new slab of handles, and return them as a chain.
+ */
+static workq_handle_t*
+workq_hslab_alloc(workq_t* wq)
+{
+  workq_hslab_t* slab;
+  int count, status;
+
+  slab = (workq_hslab_t*) malloc(sizeof(workq_hslab_t));
+  if (slab == NULL)
+    return NULL;
+  for (count = 0; count < WORKQ_HANDLE_SLAB; count++) {
+    status = pthread_mutex_init(&slab->handle[count].mutex, NULL);
+    if (status == 0) {
+      status = pthread_cond_init(&slab->handle[count].cv, NULL);
+      if (status != 0)
+        pthread_mutex_destroy(&slab->handle[count].mutex);
+    }
+    if (status != 0) {
+      while (--count >= 0) {
+        pthread_cond_destroy(&slab->handle[count].cv);
+        pthread_mutex_destroy(&slab->handle[count].mutex);
+      }
+      free(slab);
+      return NULL;
+    }
+    slab->handle[count].next =
+        (count < WORKQ_HANDLE_SLAB - 1 ? &slab->handle[count + 1] : NULL);
+  }
+  slab->next = atomic_load_explicit(&wq->hslabs, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&wq->hslabs,
+                                                &slab->next,
+                                                slab,
+                                                memory_order_release,
+                                                memory_order_relaxed))
+    ;
+  return &slab->handle[0];
+}
+
+/*
+ * Allocate a completion handle, holding references for the
+ * caller and for the server. As with workq_ele_alloc, a server
+ * allocates from its cache, and other threads must hold the
+ * workq_t mutex.
+ */
+static workq_handle_t*
+workq_handle_alloc(workq_t* wq, workq_worker_t* self)
+{
+  workq_handle_t** list = (self != NULL ? &self->hcache : &wq->hfree);
+  workq_handle_t* handle;
+
+  handle = *list;
+  if (handle == NULL)
+    handle =
+        atomic_exchange_explicit(&wq->hreturned, NULL, memory_order_acquire);
+  if (handle == NULL)
+    handle = workq_hslab_alloc(wq);
+  if (handle == NULL)
+    return NULL;
+  *list           = handle->next;
+  handle->wq      = wq;
+  handle->waiters = 0;
+  handle->result  = NULL;
+  atomic_store_explicit(&handle->state, WORKQ_PENDING, memory_order_relaxed);
+  atomic_store_explicit(&handle->refs, 2, memory_order_relaxed);
+  return handle;
+}
+
+/*
+ * Drop a reference to a completion handle, returning it to the
+ * pool when the last reference is gone. Like returned elements,
+ * handles are pushed singly and taken as a whole list, so there
+ * is no ABA problem.
+ */
+static void
+workq_handle_unref(workq_handle_t* handle)
+{
+  workq_t* wq = handle->wq;
+
+  if (atomic_fetch_sub_explicit(&handle->refs, 1, memory_order_acq_rel) != 1)
+    return;
+  handle->next = atomic_load_explicit(&wq->hreturned, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&wq->hreturned,
+                                                &handle->next,
+                                                handle,
+                                                memory_order_release,
+                                                memory_order_relaxed))
+    ;
+}
+
+/*
+ * Record the result of a request, and wake any threads waiting
+ * for it.
+ */
+static void
+workq_complete(workq_handle_t* handle, void* result)
+{
+  pthread_mutex_lock(&handle->mutex);
+  handle->result = result;
+  atomic_store_explicit(&handle->state, WORKQ_DONE, memory_order_release);
+  if (handle->waiters > 0)
+    pthread_cond_broadcast(&handle->cv);
+  pthread_mutex_unlock(&handle->mutex);
+  workq_handle_unref(handle);
+}
+
+/*
+ * Mark a request that won't be run as cancelled, waking any
+ * threads waiting for it. Returns 0, or EBUSY if it has already
+ * started (or been cancelled).
+ */
+static int
+workq_handle_cancel(workq_handle_t* handle)
+{
+  int state = WORKQ_PENDING;
+
+  if (!atomic_compare_exchange_strong_explicit(&handle->state,
+                                               &state,
+                                               WORKQ_CANCELED,
+                                               memory_order_acq_rel,
+                                               memory_order_acquire))
+    return EBUSY;
+  pthread_mutex_lock(&handle->mutex);
+  if (handle->waiters > 0)
+    pthread_cond_broadcast(&handle->cv);
+  pthread_mutex_unlock(&handle->mutex);
+  return 0;
+}
+
+/*
+ * Note that one of a group's tasks has finished (or been
+ * dropped), waking the group's waiters if it was the last. The
+ * count drops with the group's mutex held, so that a waiter
+ * can't see it reach zero, and destroy the group, before we're
+ * done with it.
+ */
+static void
+workq_group_done(workq_group_t* group)
+{
+  pthread_mutex_lock(&group->mutex);
+  if (atomic_fetch_sub_explicit(&group->pending, 1, memory_order_acq_rel) == 1
+      && group->waiters > 0)
+    pthread_cond_broadcast(&group->cv);
+  pthread_mutex_unlock(&group->mutex);
+}
+
+/*
+ * Decide whether a server should run a request: returns 0 if
+ * the request's deadline has passed or it was cancelled while
+ * queued, counting it and dropping the server's reference to
+ * its handle. Once workq_shutdown abandons the queue, no
+ * request is run; each is handed to the "abandoned" routine
+ * instead.
+ */
+static int
+workq_admit(workq_t* wq, workq_worker_t* self, workq_ele_t* we)
+{
+  struct timespec now;
+  int state = WORKQ_PENDING;
+
+  if (atomic_load_explicit(&wq->abandon, memory_order_acquire)) {
+    if ((we->handle == NULL || workq_handle_cancel(we->handle) == 0)
+        && wq->abandoned != NULL)
+      wq->abandoned(we->data, wq->abandoned_arg);
+    if (we->handle != NULL)
+      workq_handle_unref(we->handle);
+    return 0;
+  }
+  if (we->deadline.tv_sec != 0 || we->deadline.tv_nsec != 0) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec > we->deadline.tv_sec
+        || (now.tv_sec == we->deadline.tv_sec
+            && now.tv_nsec >= we->deadline.tv_nsec)) {
+      if (we->handle == NULL || workq_handle_cancel(we->handle) == 0)
+        workq_count(&self->expired);
+      else
+        workq_count(&self->cancelled);
+      if (we->handle != NULL)
+        workq_handle_unref(we->handle);
+      return 0;
+    }
+  }
+  if (we->handle != NULL
+      && !atomic_compare_exchange_strong_explicit(&we->handle->state,
+                                                  &state,
+                                                  WORKQ_RUNNING,
+                                                  memory_order_acq_rel,
+                                                  memory_order_acquire)) {
+    workq_count(&self->cancelled);
+    workq_handle_unref(we->handle);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Run a request. Requests queued by workq_submit carry their
+ * own routine and maybe a completion handle; others are passed
+ * to the queue's engine (with the server's context, if it takes
+ * one). Requests that have expired, or been cancelled, are
+ * dropped instead; either way, a task spawned in a group counts
+ * as finished. If the work queue keeps
+ * statistics, count the time the request waited and ran in the
+ * server's histograms.
+ */
+static void
+workq_call(workq_t* wq, workq_worker_t* self, workq_ele_t* we)
+{
+  struct timespec start, end;
+  void* result = NULL;
+
+  if (!workq_admit(wq, self, we)) {
+    if (we->group != NULL)
+      workq_group_done(we->group);
+    return;
+  }
+  if (self->stats != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    workq_hist_add(self->stats->wait, workq_nsec(&we->queued, &start));
+  }
+  if (we->routine != NULL)
+    result = we->routine(we->data);
+  else if (wq->engine_ctx != NULL)
+    wq->engine_ctx(self->context, we->data);
+  else
+    wq->engine(we->data);
+  if (self->stats != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    workq_hist_add(self->stats->run, workq_nsec(&start, &end));
+    workq_count(&self->stats->executed);
+  }
+  if (we->handle != NULL)
+    workq_complete(we->handle, result);
+  if (we->group != NULL)
+    workq_group_done(we->group);
+}
+
+/*
+ * Run a request, and free its element.
+ */
+static void
+workq_run(workq_t* wq, workq_worker_t* self, workq_ele_t* we)
+{
+  workq_call(wq, self, we);
+  workq_ele_free(self, we);
+}
+
+/*
+ * Note the arrival of new work, to learn the length of lulls
+ * for the adaptive idle timeout. The lock-free modes call it
+ * without the workq_t mutex, so the time and the average are
+ * atomic; of arrivals at the same time, only one sees the gap.
+ */
+static void
+workq_arrival(workq_t* wq)
+{
+  struct timespec ts;
+  long now, gap, lull;
+
+  if (wq->idle_min == wq->idle_max)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+  gap = now
+        - atomic_exchange_explicit(&wq->arrival, now, memory_order_relaxed);
+  if (gap <= WORKQ_LULL)
+    return;
+  lull = atomic_load_explicit(&wq->lull, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&wq->lull,
+                                                &lull,
+                                                lull + (gap - lull) / 4,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+    continue;
+}
+
+/*
+ * Compute the absolute time at which an idle server should
+ * give up waiting for work. Called with the workq_t mutex
+ * locked.
+ */
+static void
+workq_idle_deadline(workq_t* wq, struct timespec* deadline)
+{
+  long msec;
+
+  /* twice the average lull */
+  msec = atomic_load_explicit(&wq->lull, memory_order_relaxed) / 500;
+  if (msec < wq->idle_min)
+    msec = wq->idle_min;
+  else if (msec > wq->idle_max)
+    msec = wq->idle_max;
+  wq->idle_timeout = msec;
+
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += msec / 1000;
+  deadline->tv_nsec += (msec % 1000) * 1000000;
+  if (deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+/*
+ * Return the set of priorities (one bit each) with requests on
+ * the shared queue. Servers in WORKQ_STEAL mode may look
+ * without holding the workq_t mutex.
+ */
+static unsigned
+workq_ready(workq_t* wq)
+{
+  return atomic_load_explicit(&wq->ready, memory_order_relaxed);
+}
+
+/*
+ * Add a chain of requests to the end of the shared queue for
+ * "priority". Called with the workq_t mutex locked.
+ */
+static void
+workq_append(workq_t* wq, workq_ele_t* first, workq_ele_t* last, int priority)
+{
+  struct timespec now;
+  workq_ele_t* item;
+
+  if (wq->aging > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (item = first; item != NULL; item = item->next) item->queued = now;
+  }
+  if (wq->first[priority] == NULL)
+    wq->first[priority] = first;
+  else
+    wq->last[priority]->next = first;
+  wq->last[priority] = last;
+  atomic_fetch_or_explicit(&wq->ready, 1u << priority, memory_order_relaxed);
+  if (wq->stats) {
+    for (item = first; item != NULL; item = item->next) wq->depth++;
+    workq_depth(wq, wq->depth);
+  }
+}
+
+/*
+ * Choose the priority from which to take the next request, or
+ * return -1 if the shared queue is empty. Without aging, that's
+ * the highest priority with requests queued. With aging, it's
+ * the one whose oldest request has the highest priority plus
+ * the number of aging intervals it has waited (the higher
+ * priority wins a tie). Called with the workq_t mutex locked.
+ */
+static int
+workq_level(workq_t* wq)
+{
+  struct timespec now;
+  workq_ele_t* we;
+  unsigned ready;
+  long waited, rank, best;
+  int level, priority;
+
+  ready = workq_ready(wq);
+  if (ready == 0)
+    return -1;
+  for (level = WORKQ_PRIORITIES - 1; !(ready & (1u << level)); level--)
+    ;
+  if (wq->aging == 0 || ready == 1u << level)
+    return level;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  best = -1;
+  for (priority = level; priority >= 0; priority--) {
+    we = wq->first[priority];
+    if (we == NULL)
+      continue;
+    waited = (now.tv_sec - we->queued.tv_sec) * 1000
+             + (now.tv_nsec - we->queued.tv_nsec) / 1000000;
+    rank = priority + waited / wq->aging;
+    if (rank > best) {
+      best  = rank;
+      level = priority;
+    }
+  }
+  return level;
+}
+
+/*
+ * Remove a request of "level" from the shared queue, which must
+ * not be empty: the first one, unless "node" isn't -1 and one
+ * of the first WORKQ_NODE_WINDOW was queued from that node.
+ * Called with the workq_t mutex locked.
+ */
+static workq_ele_t*
+workq_dequeue(workq_t* wq, int level, int node)
+{
+  workq_ele_t *we = wq->first[level], *prev = NULL;
+  int count;
+
+  if (node >= 0) {
+    for (count = 0; we != NULL && count < WORKQ_NODE_WINDOW; count++) {
+      if (we->node == node)
+        break;
+      prev = we;
+      we   = we->next;
+    }
+    if (we == NULL || count == WORKQ_NODE_WINDOW) {
+      we   = wq->first[level];
+      prev = NULL;
+    }
+  }
+
+  if (prev == NULL)
+    wq->first[level] = we->next;
+  else
+    prev->next = we->next;
+  if (wq->last[level] == we)
+    wq->last[level] = prev;
+  if (wq->first[level] == NULL) {
+    atomic_fetch_and_explicit(
+        &wq->ready, ~(1u << level), memory_order_relaxed);
+  }
+  if (wq->stats)
+    wq->depth--;
+  return we;
+}
+
+/*
+ * Choose a shard for new requests: the shorter of two chosen at
+ * random.
+ */
+static workq_shard_t*
+workq_shard_pick(workq_t* wq, workq_worker_t* self)
+{
+  unsigned int* seed = (self != NULL ? &self->seed : &workq_seed);
+  unsigned int random;
+  int first, second;
+
+  if (wq->nshards == 1)
+    return &wq->shards[0];
+  if (*seed == 0)
+    *seed = (unsigned int) (size_t) seed | 1; /* differs by thread */
+  random = workq_random(seed);
+  first  = random % wq->nshards;
+  second = (first + 1 + (random >> 16) % (wq->nshards - 1)) % wq->nshards;
+  if (atomic_load_explicit(&wq->shards[second].length, memory_order_relaxed)
+      < atomic_load_explicit(&wq->shards[first].length, memory_order_relaxed))
+    return &wq->shards[second];
+  return &wq->shards[first];
+}
+
+/*
+ * Append a chain of "count" requests to a shard. Called with
+ * the shard's mutex locked.
+ */
+static void
+workq_shard_append(workq_t* wq,
+                   workq_shard_t* shard,
+                   workq_ele_t* first,
+                   workq_ele_t* last,
+                   long count)
+{
+  long length;
+
+  last->next = NULL;
+  if (shard->last == NULL)
+    shard->first = first;
+  else
+    shard->last->next = first;
+  shard->last = last;
+  length = atomic_load_explicit(&shard->length, memory_order_relaxed) + count;
+  atomic_store_explicit(&shard->length, length, memory_order_relaxed);
+  if (wq->stats)
+    workq_depth(wq, length);
+}
+
+/*
+ * Remove the oldest request from a shard, or return NULL if it's
+ * empty. An empty shard isn't locked.
+ */
+static workq_ele_t*
+workq_shard_take(workq_shard_t* shard)
+{
+  workq_ele_t* we;
+  long length;
+
+  if (atomic_load_explicit(&shard->length, memory_order_relaxed) == 0)
+    return NULL;
+  if (pthread_mutex_lock(&shard->mutex) != 0)
+    return NULL;
+  we = shard->first;
+  if (we != NULL) {
+    shard->first = we->next;
+    if (shard->first == NULL)
+      shard->last = NULL;
+    length = atomic_load_explicit(&shard->length, memory_order_relaxed);
+    atomic_store_explicit(&shard->length, length - 1, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  return we;
+}
+
+/*
+ * Find a request for a server: on its own shard, if there's one
+ * there, or else on the nearest shard after it that has one.
+ */
+static workq_ele_t*
+workq_shard_get(workq_t* wq, workq_worker_t* self)
+{
+  workq_ele_t* we;
+  int count, shard = self->index % wq->nshards;
+
+  for (count = 0; count < wq->nshards; count++) {
+    we = workq_shard_take(&wq->shards[shard]);
+    if (we != NULL)
+      return we;
+    if (++shard == wq->nshards)
+      shard = 0;
+  }
+  return NULL;
+}
+
+/*
+ * Return the number of requests on the shards, if any.
+ */
+static long
+workq_shard_depth(workq_t* wq)
+{
+  long depth = 0;
+  int index;
+
+  for (index = 0; index < wq->nshards; index++)
+    depth +=
+        atomic_load_explicit(&wq->shards[index].length, memory_order_relaxed);
+  return depth;
+}
+
+/*
+ * Pause briefly between polls for work. Every WORKQ_IDLE_YIELD
+ * polls, yield the CPU instead, in case the thread that will
+ * queue more work is waiting for it.
+ */
+static void
+workq_relax(int spins)
+{
+  if (spins % WORKQ_IDLE_YIELD == WORKQ_IDLE_YIELD - 1) {
+    sched_yield();
+    return;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * Count the calling server as idle, and return the current
+ * epoch of the eventcount. The server must then look for work
+ * once more before it parks: any thread that queues work after
+ * that either sees the server counted in "idle", and advances
+ * the epoch, or has queued work that the server will find.
+ * Called with the workq_t mutex locked.
+ */
+static unsigned
+workq_idle_enter(workq_t* wq)
+{
+  atomic_fetch_add(&wq->idle, 1);
+  return atomic_load(&wq->epoch);
+}
+
+/*
+ * Stop counting the calling server as idle. If servers have
+ * been woken, and have yet to get here, this server stands in
+ * for one of them, since it's no longer idle either. Returns 1
+ * in that case. Called with the workq_t mutex locked.
+ */
+static int
+workq_idle_leave(workq_t* wq)
+{
+  if (wq->wakeups > 0) {
+    wq->wakeups--;
+    return 1;
+  }
+  atomic_fetch_sub(&wq->idle, 1);
+  return 0;
+}
+
+/*
+ * Return non-zero if the work queue has run out of work: every
+ * server is idle, and nothing is queued. (A server's deque can't
+ * hold work while it's idle.) Called with the workq_t mutex
+ * locked.
+ */
+static int
+workq_quiet(workq_t* wq)
+{
+  return atomic_load(&wq->idle) == wq->counter && workq_ready(wq) == 0
+         && (wq->ring == NULL || workq_ring_depth(wq->ring) == 0)
+         && workq_shard_depth(wq) == 0;
+}
+
+/*
+ * Wake threads waiting in workq_quiesce, if the work queue has
+ * run out of work. Called with the workq_t mutex locked, when a
+ * server is about to sleep or shut down.
+ */
+static void
+workq_quiet_check(workq_t* wq)
+{
+  if (wq->quiescers > 0 && workq_quiet(wq))
+    pthread_cond_broadcast(&wq->quiet);
+}
+
+/*
+ * Sleep until the epoch moves on from "key", or until "deadline"
+ * (on the CLOCK_REALTIME clock) passes. Called with the workq_t
+ * mutex locked, by a server counted in "idle"; returns with it
+ * locked, 0 or ETIMEDOUT. (Wakeups may be spurious.) With
+ * WORKQ_WAKE_SIGNAL, wait on "cv" once, whatever the epoch.
+ */
+static int
+workq_park(workq_t* wq, unsigned key, const struct timespec* deadline)
+{
+  int status = 0;
+
+  wq->parks++;
+  workq_quiet_check(wq);
+  if (wq->wakeup == WORKQ_WAKE_SIGNAL)
+    return pthread_cond_timedwait(&wq->cv, &wq->mutex, deadline);
+#ifdef __linux__
+  pthread_mutex_unlock(&wq->mutex);
+  atomic_fetch_add(&wq->sleepers, 1);
+  if (syscall(SYS_futex,
+              (unsigned*) &wq->epoch,
+              FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+              key,
+              deadline,
+              NULL,
+              FUTEX_BITSET_MATCH_ANY)
+          != 0
+      && errno == ETIMEDOUT)
+    status = ETIMEDOUT;
+  atomic_fetch_sub(&wq->sleepers, 1);
+  pthread_mutex_lock(&wq->mutex);
+#else
+  while (atomic_load(&wq->epoch) == key && status == 0)
+    status = pthread_cond_timedwait(&wq->cv, &wq->mutex, deadline);
+#endif
+  return status;
+}
+
+/*
+ * Wake "count" idle servers (no more than "idle"), which stop
+ * counting as idle. Advancing the epoch is enough to stop a
+ * server that's about to sleep; only if one is asleep do we
+ * need a system call. (A server counts itself in "sleepers"
+ * before the futex compares the epoch with its key, so either
+ * we see it here or it sees the new epoch.) Called with the
+ * workq_t mutex locked.
+ *
+ * With WORKQ_WAKE_SIGNAL, signal "cv" once per server, or
+ * broadcast if that's all of them, and leave the servers to
+ * stop counting as idle when they wake, so that requests queued
+ * meanwhile signal them again.
+ */
+static int
+workq_unpark(workq_t* wq, int count)
+{
+  int status;
+
+  if (count <= 0)
+    return 0;
+  if (wq->wakeup == WORKQ_WAKE_SIGNAL) {
+    wq->wake_idle += count;
+    if (count >= atomic_load(&wq->idle)) {
+      wq->unparks++;
+      return pthread_cond_broadcast(&wq->cv);
+    }
+    for (; count > 0; count--) {
+      wq->unparks++;
+      status = pthread_cond_signal(&wq->cv);
+      if (status != 0)
+        return status;
+    }
+    return 0;
+  }
+  atomic_fetch_sub(&wq->idle, count);
+  wq->wakeups += count;
+  wq->wake_idle += count;
+  atomic_fetch_add(&wq->epoch, 1);
+#ifdef __linux__
+  if (atomic_load(&wq->sleepers) == 0)
+    return 0;
+  wq->unparks++;
+  if (syscall(SYS_futex,
+              (unsigned*) &wq->epoch,
+              FUTEX_WAKE_PRIVATE,
+              count,
+              NULL,
+              NULL,
+              0)
+      < 0)
+    return errno;
+  return 0;
+#else
+  wq->unparks++;
+  return pthread_cond_broadcast(&wq->cv);
+#endif
+}
+
+/*
+ * Release a server's slot as the server shuts down, after
+ * waiting for work for its idle timeout if "timedout" is set.
+ * Called with the workq_t mutex locked.
+ */
+static void
+workq_retire(workq_t* wq, workq_worker_t* self, int timedout)
+{
+  self->active = 0;
+  wq->counter--;
+  wq->thread_exits++;
+  if (timedout)
+    wq->thread_timeouts++;
+  workq_quiet_check(wq);
+}
+
+/*
+ * Thread start routine to serve the work queue.
+ */
+static void*
+workq_server(void* arg)
+{
+  struct timespec timeout;
+  workq_worker_t* self = (workq_worker_t*) arg;
+  workq_t* wq          = self->wq;
+  workq_ele_t* we;
+  unsigned key;
+  int status, timedout = 0, level, spins;
+
+  /*
+   * We don't need to validate the workq_t here... we don't
+   * create server threads until requests are queued (the
+   * queue has been initialized by then!) and we wait for all
+   * server threads to terminate before destroying a work
+   * queue.
+   */
+  DPRINTF(("A worker is starting\n"));
+  workq_self = self;
+  status     = pthread_mutex_lock(&wq->mutex);
+  if (status != 0)
+    return NULL;
+
+  while (1) {
+    DPRINTF(("Work queue: %#x, quit: %d\n", workq_ready(wq), wq->quit));
+    level = workq_level(wq);
+
+    if (level >= 0) {
+      timedout = 0;
+      we       = workq_dequeue(wq, level, workq_node(wq, self));
+      status   = pthread_mutex_unlock(&wq->mutex);
+      if (status != 0)
+        return NULL;
+      DPRINTF(("Worker calling engine\n"));
+      workq_run(wq, self, we);
+      status = pthread_mutex_lock(&wq->mutex);
+      if (status != 0)
+        return NULL;
+      continue;
+    }
+
+    /*
+     * If there are no more work requests, and the servers
+     * have been asked to quit, then shut down.
+     */
+    if (wq->quit) {
+      DPRINTF(("Worker shutting down\n"));
+      workq_retire(wq, self, 0);
+
+      /*
+       * NOTE: Just to prove that every rule has an
+       * exception, I'm using the "cv" condition for two
+       * separate predicates here.  That's OK, since the
+       * case used here applies only once during the life
+       * of a work queue -- during rundown. The overhead
+       * is minimal and it's not worth creating a separate
+       * condition variable that would be waited and
+       * signaled exactly once!
+       */
+      if (wq->counter == 0)
+        pthread_cond_broadcast(&wq->cv);
+      pthread_mutex_unlock(&wq->mutex);
+      workq_self = NULL;
+      return NULL;
+    }
+
+    /*
+     * If there's no more work, and we waited for as long as
+     * we're allowed, then terminate this server thread.
+     */
+    if (timedout) {
+      DPRINTF(("engine terminating due to timeout.\n"));
+      workq_retire(wq, self, 1);
+      break;
+    }
+
+    /*
+     * Poll for a while, in case more work is on its way, before
+     * going to sleep.
+     */
+    pthread_mutex_unlock(&wq->mutex);
+    for (spins = 0; spins < wq->idle_spins && workq_ready(wq) == 0; spins++)
+      workq_relax(spins);
+    status = pthread_mutex_lock(&wq->mutex);
+    if (status != 0)
+      return NULL;
+    if (workq_ready(wq) != 0 || wq->quit)
+      continue;
+
+    /*
+     * Server threads time out after spending the idle timeout
+     * waiting for new work, and exit -- unless they're needed
+     * to keep the minimum number of resident servers, in which
+     * case they keep waiting. Since requests are queued with
+     * the mutex locked, there's no need to look for work again
+     * between counting ourselves idle and sleeping.
+     */
+    DPRINTF(("Worker waiting for work\n"));
+    key = workq_idle_enter(wq);
+    workq_idle_deadline(wq, &timeout);
+    status = workq_park(wq, key, &timeout);
+    if (!workq_idle_leave(wq) && status == ETIMEDOUT) {
+      if (wq->counter > wq->min_threads) {
+        DPRINTF(("Worker wait timed out\n"));
+        timedout = 1;
+      }
+    }
+    else if (status != 0 && status != ETIMEDOUT) {
+      /*
+       * This shouldn't happen, so the work queue
+       * package should fail. Because the work queue
+       * API is asynchronous, that would add
+       * complication. Because the chances of failure
+       * are slim, I choose to avoid that
+       * complication. The server thread will return,
+       * and allow another server thread to pick up
+       * the work later. Note that, if this was the
+       * only server thread, the queue won't be
+       * serviced until a new work item is
+       * queued. That could be fixed by creating a new
+       * server here.
+       */
+      DPRINTF(("Worker wait failed, %d (%s)\n", status, strerror(status)));
+      workq_retire(wq, self, 0);
+      pthread_mutex_unlock(&wq->mutex);
+      workq_self = NULL;
+      return NULL;
+    }
+  }
+
+  pthread_mutex_unlock(&wq->mutex);
+  workq_self = NULL;
+  DPRINTF(("Worker exiting\n"));
+  return NULL;
+}
+
+/*
+ * Look for work on the other servers' deques, starting with a
+ * randomly chosen victim so that thieves spread out. A server
+ * bound to a node tries the servers on its own node first.
+ */
+static workq_ele_t*
+workq_steal(workq_t* wq, workq_worker_t* self)
+{
+  workq_ele_t* we;
+  int count, victim, node, pass;
+
+  workq_random(&self->seed);
+  node = (wq->nodes > 1 ? self->node : -1);
+  for (pass = (node >= 0 ? 0 : 1); pass < 2; pass++) {
+    victim = self->seed % wq->parallelism;
+    for (count = 0; count < wq->parallelism; count++) {
+      if (victim != self->index
+          && (pass == 1 || wq->workers[victim].node == node)) {
+        we = workq_deque_steal(&wq->workers[victim].deque);
+        if (we != NULL)
+          return we;
+      }
+      if (++victim == wq->parallelism)
+        victim = 0;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Take work from the shared queue, which holds requests queued
+ * by threads that aren't servers. Called with the workq_t mutex
+ * locked. To avoid coming back for the mutex on every request,
+ * move a batch of requests of the chosen priority onto the
+ * caller's deque, where the other servers can steal them, and
+ * return the first. Requests of more than the default priority
+ * are taken one at a time, though, so that they're spread over
+ * the servers rather than run in turn by one of them.
+ */
+static workq_ele_t*
+workq_inject_take(workq_t* wq, workq_worker_t* self)
+{
+  workq_ele_t* batch[WORKQ_INJECT_BATCH];
+  long room;
+  int count = 0, level, node;
+
+  level = workq_level(wq);
+  if (level < 0)
+    return NULL;
+  node = workq_node(wq, self);
+  room = workq_deque_room(&self->deque) + 1;
+  if (room > WORKQ_INJECT_BATCH)
+    room = WORKQ_INJECT_BATCH;
+  if (level > WORKQ_PRIO_DEFAULT)
+    room = 1;
+  while (wq->first[level] != NULL && count < room)
+    batch[count++] = workq_dequeue(wq, level, node);
+
+  /*
+   * Push in reverse, so that the owner takes them in the order
+   * they were queued.
+   */
+  while (--count > 0) workq_deque_push(&self->deque, batch[count]);
+  return batch[0];
+}
+
+/*
+ * Thread start routine to serve a WORKQ_STEAL work queue.
+ */
+static void*
+workq_steal_server(void* arg)
+{
+  struct timespec timeout;
+  workq_worker_t* self = (workq_worker_t*) arg;
+  workq_t* wq          = self->wq;
+  workq_ele_t* we;
+  unsigned key;
+  int status, timedout, spins;
+
+  DPRINTF(("A stealing worker is starting\n"));
+  workq_self = self;
+
+  while (1) {
+    /*
+     * Requests of more than the default priority on the shared
+     * queue come first. Otherwise, our own deque first, then
+     * the other servers', and only then the shared queue, which
+     * requires the mutex.
+     */
+    we = NULL;
+    if (workq_ready(wq) >> (WORKQ_PRIO_DEFAULT + 1) != 0) {
+      status = pthread_mutex_lock(&wq->mutex);
+      if (status != 0)
+        return NULL;
+      we = workq_inject_take(wq, self);
+      status = pthread_mutex_unlock(&wq->mutex);
+      if (status != 0)
+        return NULL;
+    }
+    if (we == NULL)
+      we = workq_deque_take(&self->deque);
+    if (we == NULL)
+      we = workq_steal(wq, self);
+    for (spins = 0; we == NULL && spins < wq->idle_spins
+                    && workq_ready(wq) == 0;
+         spins++) {
+      workq_relax(spins);
+      we = workq_steal(wq, self);
+    }
+    if (we == NULL) {
+      status = pthread_mutex_lock(&wq->mutex);
+      if (status != 0)
+        return NULL;
+      we = workq_inject_take(wq, self);
+      if (we == NULL) {
+        /*
+         * Declare ourselves idle before looking one last
+         * time. A server that pushes onto its own deque
+         * checks "idle" after the push, so either we see its
+         * request here or it sees us and wakes us.
+         */
+        timedout = 0;
+        while (1) {
+          key = workq_idle_enter(wq);
+          we  = workq_inject_take(wq, self);
+          if (we == NULL)
+            we = workq_steal(wq, self);
+          if (we != NULL || wq->quit || timedout) {
+            workq_idle_leave(wq);
+            break;
+          }
+          DPRINTF(("Stealing worker waiting for work\n"));
+          workq_idle_deadline(wq, &timeout);
+          status = workq_park(wq, key, &timeout);
+          if (!workq_idle_leave(wq) && status == ETIMEDOUT) {
+            if (wq->counter > wq->min_threads)
+              timedout = 1;
+          }
+          else if (status != 0 && status != ETIMEDOUT)
+            break;
+        }
+
+        if (we == NULL) {
+          /*
+           * Nothing left anywhere, and we've either timed out
+           * or been asked to quit (or the wait failed). Our
+           * deque is empty, since only we push onto it, so
+           * release the slot and shut down.
+           */
+          DPRINTF(("Stealing worker shutting down\n"));
+          workq_retire(wq, self, timedout);
+          if (wq->quit && wq->counter == 0)
+            pthread_cond_broadcast(&wq->cv);
+          pthread_mutex_unlock(&wq->mutex);
+          workq_self = NULL;
+          return NULL;
+        }
+      }
+      status = pthread_mutex_unlock(&wq->mutex);
+      if (status != 0)
+        return NULL;
+    }
+
+    DPRINTF(("Stealing worker calling engine\n"));
+    workq_run(wq, self, we);
+  }
+}
+
+/*
+ * Let producers waiting for room on the ring know that a
+ * server has taken a request. The fence pairs with the one a
+ * producer makes after counting itself as a waiter.
+ */
+static void
+workq_ring_taken(workq_t* wq)
+{
+  if (wq->full == WORKQ_FULL_FAIL)
+    return;
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&wq->full_waiters, memory_order_relaxed) > 0) {
+    pthread_mutex_lock(&wq->mutex);
+    pthread_cond_broadcast(&wq->space);
+    pthread_mutex_unlock(&wq->mutex);
+  }
+}
+
+/*
+ * Thread start routine to serve a WORKQ_RING work queue.
+ */
+static void*
+workq_ring_server(void* arg)
+{
+  struct timespec timeout;
+  workq_worker_t* self = (workq_worker_t*) arg;
+  workq_t* wq          = self->wq;
+  workq_ele_t item;
+  unsigned key;
+  int status, timedout, found, spins;
+
+  DPRINTF(("A ring worker is starting\n"));
+  workq_self = self;
+
+  while (1) {
+    found = workq_ring_get(wq->ring, &item);
+    for (spins = 0; !found && spins < wq->idle_spins; spins++) {
+      workq_relax(spins);
+      found = workq_ring_get(wq->ring, &item);
+    }
+    if (found) {
+      workq_ring_taken(wq);
+      workq_call(wq, self, &item);
+      continue;
+    }
+
+    status = pthread_mutex_lock(&wq->mutex);
+    if (status != 0)
+      return NULL;
+
+    /*
+     * Declare ourselves idle before looking one last time.
+     * A producer checks "idle" after filling a cell, so either
+     * we see its request here or it sees us and wakes us.
+     */
+    timedout = 0;
+    while (1) {
+      key   = workq_idle_enter(wq);
+      found = workq_ring_get(wq->ring, &item);
+      if (found || wq->quit || timedout) {
+        workq_idle_leave(wq);
+        break;
+      }
+      DPRINTF(("Ring worker waiting for work\n"));
+      workq_idle_deadline(wq, &timeout);
+      status = workq_park(wq, key, &timeout);
+      if (!workq_idle_leave(wq) && status == ETIMEDOUT) {
+        if (wq->counter > wq->min_threads)
+          timedout = 1;
+      }
+      else if (status != 0 && status != ETIMEDOUT)
+        break;
+    }
+
+    if (!found) {
+      DPRINTF(("Ring worker shutting down\n"));
+      workq_retire(wq, self, timedout);
+      if (wq->quit && wq->counter == 0)
+        pthread_cond_broadcast(&wq->cv);
+      pthread_mutex_unlock(&wq->mutex);
+      workq_self = NULL;
+      return NULL;
+    }
+    if (atomic_load_explicit(&wq->full_waiters, memory_order_relaxed) > 0)
+      pthread_cond_broadcast(&wq->space);
+    status = pthread_mutex_unlock(&wq->mutex);
+    if (status != 0)
+      return NULL;
+    workq_call(wq, self, &item);
+  }
+}
+
+/*
+ * Thread start routine to serve a WORKQ_SHARD work queue.
+ */
+static void*
+workq_shard_server(void* arg)
+{
+  struct timespec timeout;
+  workq_worker_t* self = (workq_worker_t*) arg;
+  workq_t* wq          = self->wq;
+  workq_ele_t* we;
+  unsigned key;
+  int status, timedout, spins;
+
+  DPRINTF(("A shard worker is starting\n"));
+  workq_self = self;
+
+  while (1) {
+    we = workq_shard_get(wq, self);
+    for (spins = 0; we == NULL && spins < wq->idle_spins; spins++) {
+      workq_relax(spins);
+      we = workq_shard_get(wq, self);
+    }
+    if (we != NULL) {
+      workq_run(wq, self, we);
+      continue;
+    }
+
+    status = pthread_mutex_lock(&wq->mutex);
+    if (status != 0)
+      return NULL;
+
+    /*
+     * Declare ourselves idle before looking one last time.
+     * A producer checks "idle" after queueing on a shard, so
+     * either we see its request here or it sees us and wakes
+     * us.
+     */
+    timedout = 0;
+    while (1) {
+      key = workq_idle_enter(wq);
+      we  = workq_shard_get(wq, self);
+      if (we != NULL || wq->quit || timedout) {
+        workq_idle_leave(wq);
+        break;
+      }
+      DPRINTF(("Shard worker waiting for work\n"));
+      workq_idle_deadline(wq, &timeout);
+      status = workq_park(wq, key, &timeout);
+      if (!workq_idle_leave(wq) && status == ETIMEDOUT) {
+        if (wq->counter > wq->min_threads)
+          timedout = 1;
+      }
+      else if (status != 0 && status != ETIMEDOUT)
+        break;
+    }
+
+    if (we == NULL) {
+      DPRINTF(("Shard worker shutting down\n"));
+      workq_retire(wq, self, timedout);
+      if (wq->quit && wq->counter == 0)
+        pthread_cond_broadcast(&wq->cv);
+      pthread_mutex_unlock(&wq->mutex);
+      workq_self = NULL;
+      return NULL;
+    }
+    status = pthread_mutex_unlock(&wq->mutex);
+    if (status != 0)
+      return NULL;
+    workq_run(wq, self, we);
+  }
+}
+
+/*
+ * Thread start routine for all servers: set up the server's
+ * engine context, serve the work queue as its mode says, and
+ * then finish with the context. The server has given up its
+ * slot by then, but still counts in "alive", so the work queue
+ * can't be destroyed under it.
+ */
+static void*
+workq_thread(void* arg)
+{
+  workq_worker_t* self = (workq_worker_t*) arg;
+  workq_t* wq          = self->wq;
+  void* context        = NULL;
+
+  if (wq->context_init != NULL)
+    context = wq->context_init(wq->context_arg);
+  self->context = context;
+  if (wq->mode == WORKQ_STEAL)
+    workq_steal_server(self);
+  else if (wq->mode == WORKQ_RING)
+    workq_ring_server(self);
+  else if (wq->mode == WORKQ_SHARD)
+    workq_shard_server(self);
+  else
+    workq_server(self);
+  if (wq->context_fini != NULL)
+    wq->context_fini(context, wq->context_arg);
+
+  pthread_mutex_lock(&wq->mutex);
+  wq->alive--;
+  if (wq->quit && wq->alive == 0)
+    pthread_cond_broadcast(&wq->cv);
+  pthread_mutex_unlock(&wq->mutex);
+  return NULL;
+}
+
+/*
+ * Set the CPU affinity with which the server for a slot will
+ * be created. Called with the workq_t mutex locked.
+ */
+static int
+workq_place(workq_t* wq, workq_worker_t* worker)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  int count;
+
+  if (wq->affinity == WORKQ_AFFINITY_NONE)
+    return 0;
+  CPU_ZERO(&set);
+  if (worker->cpu >= 0)
+    CPU_SET(worker->cpu, &set);
+  else {
+    for (count = 0; count < wq->ncpus; count++) CPU_SET(wq->cpus[count], &set);
+  }
+  return pthread_attr_setaffinity_np(&wq->attr, sizeof(set), &set);
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Start a new server thread. Called with the workq_t mutex
+ * locked, and only when counter < parallelism, so there's
+ * always a free server slot.
+ */
+static int
+workq_start(workq_t* wq)
+{
+  workq_worker_t* worker;
+  pthread_t id;
+  int count, status;
+
+  for (count = 0; wq->workers[count].active; count++)
+    ;
+  worker = &wq->workers[count];
+  status = workq_place(wq, worker);
+  if (status != 0)
+    return status;
+  worker->active = 1;
+  DPRINTF(("Creating new worker\n"));
+  status = pthread_create(&id, &wq->attr, workq_thread, (void*) worker);
+  if (status != 0) {
+    worker->active = 0;
+    return status;
+  }
+  wq->counter++;
+  wq->alive++;
+  wq->thread_creates++;
+  return 0;
+}
+
+/*
+ * Make servers available for "count" new requests: wake idle
+ * servers, up to one per request, and then create new servers
+ * for the remainder while we're allowed to. Called with the
+ * workq_t mutex locked.
+ */
+static int
+workq_wake(workq_t* wq, size_t count)
+{
+  size_t idle;
+  int status = 0;
+
+  /*
+   * If any threads are idling, wake them.
+   */
+  idle = atomic_load(&wq->idle);
+  if (idle > count)
+    idle = count;
+  if (idle > 0) {
+    status = workq_unpark(wq, (int) idle);
+    count -= idle;
+  }
+
+  /*
+   * If there were not enough idling threads, and we're allowed
+   * to create new threads, do so.
+   */
+  while (count > 0 && status == 0 && wq->counter < wq->parallelism) {
+    status = workq_start(wq);
+    count--;
+    if (status == 0)
+      wq->wake_create++;
+  }
+  return status;
+}
+
+/*
+ * Initialize work queue attributes.
+ */
+int
+workq_attr_init(workq_attr_t* attr)
+{
+  attr->mode        = WORKQ_LIST;
+  attr->capacity    = WORKQ_RING_SIZE;
+  attr->full        = WORKQ_FULL_BLOCK;
+  attr->wakeup      = WORKQ_WAKE_EVENT;
+  attr->shards      = 0;
+  attr->min_threads = 0;
+  attr->idle_min    = 2000;
+  attr->idle_max    = 2000;
+  attr->aging       = 0;
+  attr->affinity    = WORKQ_AFFINITY_NONE;
+  attr->ncpus       = 0;
+  memset(attr->cpus, 0, sizeof(attr->cpus));
+  attr->stats        = 0;
+  attr->context_init = NULL;
+  attr->context_fini = NULL;
+  attr->context_arg  = NULL;
+  attr->valid        = WORKQ_ATTR_VALID;
+  return 0;
+}
+
+/*
+ * Destroy work queue attributes.
+ */
+int
+workq_attr_destroy(workq_attr_t* attr)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  attr->valid = 0;
+  return 0;
+}
+
+/*
+ * Select the queueing mode: WORKQ_LIST, WORKQ_STEAL, WORKQ_RING
+ * or WORKQ_SHARD.
+ */
+int
+workq_attr_setmode(workq_attr_t* attr, int mode)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  if (mode != WORKQ_LIST && mode != WORKQ_STEAL && mode != WORKQ_RING
+      && mode != WORKQ_SHARD)
+    return EINVAL;
+  attr->mode = mode;
+  return 0;
+}
+
+int
+workq_attr_getmode(const workq_attr_t* attr, int* mode)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  *mode = attr->mode;
+  return 0;
+}
+
+/*
+ * Set the number of requests a WORKQ_RING work queue can hold.
+ * It's rounded up to a power of 2.
+ */
+int
+workq_attr_setcapacity(workq_attr_t* attr, int size)
+{
+  int capacity = 2;
+
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  if (size <= 0 || size > (1 << 30))
+    return EINVAL;
+  while (capacity < size) capacity <<= 1;
+  attr->capacity = capacity;
+  return 0;
+}
+
+int
+workq_attr_getcapacity(const workq_attr_t* attr, int* size)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  *size = attr->capacity;
+  return 0;
+}
+
+/*
+ * Select what workq_add does when a WORKQ_RING work queue is
+ * full: WORKQ_FULL_BLOCK (the default) waits for room,
+ * WORKQ_FULL_FAIL returns EAGAIN, and WORKQ_FULL_SPIN retries
+ * for a while before waiting. A server of the queue never
+ * waits, since the servers might all end up waiting for each
+ * other: it gets EAGAIN instead.
+ */
+int
+workq_attr_setfullpolicy(workq_attr_t* attr, int policy)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  if (policy != WORKQ_FULL_BLOCK && policy != WORKQ_FULL_FAIL
+      && policy != WORKQ_FULL_SPIN)
+    return EINVAL;
+  attr->full = policy;
+  return 0;
+}
+
+int
+workq_attr_getfullpolicy(const workq_attr_t* attr, int* policy)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  *policy = attr->full;
+  return 0;
+}
+
+/*
+ * Select how idle servers sleep and are woken: WORKQ_WAKE_EVENT
+ * (the default) polls for work for a while, sleeps on the
+ * eventcount, and makes a system call to wake servers only when
+ * one is asleep. WORKQ_WAKE_SIGNAL sleeps on "cv" at once, and
+ * signals it under the mutex for each request while any server
+ * is idle (broadcasting if there are more requests than idle
+ * servers), as the work queue did before the eventcount. It's
+ * kept for comparison: see workq_wake_main.c.
+ */
+int
+workq_attr_setwakeup(workq_attr_t* attr, int wakeup)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  if (wakeup != WORKQ_WAKE_EVENT && wakeup != WORKQ_WAKE_SIGNAL)
+    return EINVAL;
+  attr->wakeup = wakeup;
+  return 0;
+}
+
+int
+workq_attr_getwakeup(const workq_attr_t* attr, int* wakeup)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  *wakeup = attr->wakeup;
+  return 0;
+}
+
+/*
+ * Set the number of shards of a WORKQ_SHARD work queue. The
+ * default, 0, gives it one per server.
+ */
+int
+workq_attr_setshards(workq_attr_t* attr, int shards)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  if (shards < 0)
+    return EINVAL;
+  attr->shards = shards;
+  return 0;
+}
+
+int
+workq_attr_getshards(const workq_attr_t* attr, int* shards)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  *shards = attr->shards;
+  return 0;
+}
+
+/*
+ * Set the number of servers that are started with the work
+ * queue and never time out. (It must not exceed the maximum
+ * parallelism given to workq_init_attr.)
+ */
+int
+workq_attr_setminthreads(workq_attr_t* attr, int threads)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  if (threads < 0)
+    return EINVAL;
+  attr->min_threads = threads;
+  return 0;
+}
+
+int
+workq_attr_getminthreads(const workq_attr_t* attr, int* threads)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  *threads = attr->min_threads;
+  return 0;
+}
+
+/*
+ * Set the bounds, in milliseconds, of the time an idle server
+ * waits for work before shutting down. If they differ, the
+ * timeout adapts to the observed lulls in traffic. The default
+ * is a fixed 2 seconds.
+ */
+int
+workq_attr_setidletimeout(workq_attr_t* attr, int min_msec, int max_msec)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  if (min_msec <= 0 || max_msec < min_msec)
+    return EINVAL;
+  attr->idle_min = min_msec;
+  attr->idle_max = max_msec;
+  return 0;
+}
+
+int
+workq_attr_getidletimeout(const workq_attr_t* attr,
+                          int* min_msec,
+                          int* max_msec)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  *min_msec = attr->idle_min;
+  *max_msec = attr->idle_max;
+  return 0;
+}
+
+/*
+ * Set the aging interval, in milliseconds: a queued request is
+ * treated as one priority higher for every interval it has
+ * waited. 0 (the default) turns aging off.
+ */
+int
+workq_attr_setaging(workq_attr_t* attr, int msec)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  if (msec < 0)
+    return EINVAL;
+  attr->aging = msec;
+  return 0;
+}
+
+int
+workq_attr_getaging(const workq_attr_t* attr, int* msec)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  *msec = attr->aging;
+  return 0;
+}
+
+/*
+ * Select how servers are placed on CPUs: WORKQ_AFFINITY_NONE
+ * (the default) leaves it to the system. Placement is only
+ * supported on Linux.
+ */
+int
+workq_attr_setaffinity(workq_attr_t* attr, int policy)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  if (policy < WORKQ_AFFINITY_NONE || policy > WORKQ_AFFINITY_CPUSET)
+    return EINVAL;
+#ifndef __linux__
+  if (policy != WORKQ_AFFINITY_NONE)
+    return ENOTSUP;
+#endif
+  attr->affinity = policy;
+  return 0;
+}
+
+int
+workq_attr_getaffinity(const workq_attr_t* attr, int* policy)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  *policy = attr->affinity;
+  return 0;
+}
+
+/*
+ * Select the CPUs on which servers may run, from those in
+ * "cpus", or all CPUs if "count" is 0.
+ */
+int
+workq_attr_setcpus(workq_attr_t* attr, const int* cpus, int count)
+{
+  int index;
+
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  if (count < 0)
+    return EINVAL;
+  for (index = 0; index < count; index++) {
+    if (cpus[index] < 0 || cpus[index] >= WORKQ_MAX_CPUS)
+      return EINVAL;
+  }
+  memset(attr->cpus, 0, sizeof(attr->cpus));
+  attr->ncpus = 0;
+  for (index = 0; index < count; index++) {
+    if (!(attr->cpus[cpus[index] / 8] & (1 << (cpus[index] % 8)))) {
+      attr->cpus[cpus[index] / 8] |= 1 << (cpus[index] % 8);
+      attr->ncpus++;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Return up to "size" of the selected CPUs in "cpus", and the
+ * number selected in "count".
+ */
+int
+workq_attr_getcpus(const workq_attr_t* attr, int* cpus, int size, int* count)
+{
+  int cpu, index = 0;
+
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  for (cpu = 0; cpu < WORKQ_MAX_CPUS && index < size; cpu++) {
+    if (attr->cpus[cpu / 8] & (1 << (cpu % 8)))
+      cpus[index++] = cpu;
+  }
+  *count = attr->ncpus;
+  return 0;
+}
+
+/*
+ * Turn statistics on (non-zero) or off (0, the default). With
+ * statistics on, servers time every request they run.
+ */
+int
+workq_attr_setstats(workq_attr_t* attr, int stats)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  attr->stats = (stats != 0);
+  return 0;
+}
+
+int
+workq_attr_getstats(const workq_attr_t* attr, int* stats)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  *stats = attr->stats;
+  return 0;
+}
+
+/*
+ * Set the routines with which each server thread of a work
+ * queue made by workq_init_context sets up its engine context,
+ * when it starts, and finishes with it, when it exits. Both are
+ * passed "arg"; either may be NULL.
+ */
+int
+workq_attr_setcontext(workq_attr_t* attr,
+                      void* (*init)(void* arg),
+                      void (*fini)(void* context, void* arg),
+                      void* arg)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  attr->context_init = init;
+  attr->context_fini = fini;
+  attr->context_arg  = arg;
+  return 0;
+}
+
+int
+workq_attr_getcontext(const workq_attr_t* attr,
+                      void* (**init)(void* arg),
+                      void (**fini)(void* context, void* arg),
+                      void** arg)
+{
+  if (attr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  *init = attr->context_init;
+  *fini = attr->context_fini;
+  *arg  = attr->context_arg;
+  return 0;
+}
+
+/*
+ * Initialize request attributes.
+ */
+int
+workq_reqattr_init(workq_reqattr_t* attr)
+{
+  attr->priority          = WORKQ_PRIO_DEFAULT;
+  attr->deadline.tv_sec  = 0;
+  attr->deadline.tv_nsec = 0;
+  attr->valid            = WORKQ_REQATTR_VALID;
+  return 0;
+}
+
+/*
+ * Destroy request attributes.
+ */
+int
+workq_reqattr_destroy(workq_reqattr_t* attr)
+{
+  if (attr->valid != WORKQ_REQATTR_VALID)
+    return EINVAL;
+  attr->valid = 0;
+  return 0;
+}
+
+/*
+ * Set the priority of a request, from WORKQ_PRIO_LOW (0) to
+ * WORKQ_PRIO_HIGH. The default is WORKQ_PRIO_DEFAULT.
+ */
+int
+workq_reqattr_setpriority(workq_reqattr_t* attr, int priority)
+{
+  if (attr->valid != WORKQ_REQATTR_VALID)
+    return EINVAL;
+  if (priority < 0 || priority >= WORKQ_PRIORITIES)
+    return EINVAL;
+  attr->priority = priority;
+  return 0;
+}
+
+int
+workq_reqattr_getpriority(const workq_reqattr_t* attr, int* priority)
+{
+  if (attr->valid != WORKQ_REQATTR_VALID)
+    return EINVAL;
+  *priority = attr->priority;
+  return 0;
+}
+
+/*
+ * Set the time (on the CLOCK_REALTIME clock) after which a
+ * request is dropped, rather than run, if no server has started
+ * it. NULL, or a zero time, means no deadline, the default.
+ */
+int
+workq_reqattr_setdeadline(workq_reqattr_t* attr,
+                          const struct timespec* abstime)
+{
+  if (attr->valid != WORKQ_REQATTR_VALID)
+    return EINVAL;
+  if (abstime == NULL) {
+    attr->deadline.tv_sec  = 0;
+    attr->deadline.tv_nsec = 0;
+  }
+  else if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000)
+    return EINVAL;
+  else
+    attr->deadline = *abstime;
+  return 0;
+}
+
+int
+workq_reqattr_getdeadline(const workq_reqattr_t* attr,
+                          struct timespec* abstime)
+{
+  if (attr->valid != WORKQ_REQATTR_VALID)
+    return EINVAL;
+  *abstime = attr->deadline;
+  return 0;
+}
+
+#ifdef __linux__
+/*
+ * Description of a CPU, for choosing server placement.
+ */
+typedef struct workq_cpu_tag {
+  int cpu;
+  int node;    /* NUMA node */
+  int package; /* physical package (socket) */
+  int core;    /* core within package */
+  int thread;  /* hardware thread within core */
+  int rank;    /* core within node */
+} workq_cpu_t;
+
+/*
+ * Read a (small) sysfs file into "buf".
+ */
+static int
+workq_sysfs_read(const char* path, char* buf, size_t size)
+{
+  FILE* file;
+  size_t len;
+
+  file = fopen(path, "r");
+  if (file == NULL)
+    return errno;
+  len = fread(buf, 1, size - 1, file);
+  fclose(file);
+  buf[len] = '\0';
+  return 0;
+}
+
+/*
+ * Read a number from a sysfs file, or return "value" if it
+ * can't be read.
+ */
+static int
+workq_sysfs_int(const char* path, int value)
+{
+  char buf[32];
+
+  if (workq_sysfs_read(path, buf, sizeof(buf)) != 0)
+    return value;
+  return atoi(buf);
+}
+
+/*
+ * Add the CPUs in a sysfs CPU list, such as "0-3,8,10-11", to
+ * a set.
+ */
+static void
+workq_cpulist(const char* list, unsigned char* set)
+{
+  char* end;
+  long cpu, last;
+
+  while (*list >= '0' && *list <= '9') {
+    cpu = last = strtol(list, &end, 10);
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    for (; cpu <= last && cpu < WORKQ_MAX_CPUS; cpu++)
+      set[cpu / 8] |= 1 << (cpu % 8);
+    list = (*end == ',' ? end + 1 : end);
+  }
+}
+
+/*
+ * Find the NUMA node of a CPU: its sysfs directory holds a
+ * "node<N>" link. Without one, there's just node 0.
+ */
+static int
+workq_cpu_node(int cpu)
+{
+  char path[64];
+  struct dirent* entry;
+  DIR* dir;
+  int node = 0;
+
+  snprintf(path, sizeof(path), WORKQ_SYSFS "/cpu/cpu%d", cpu);
+  dir = opendir(path);
+  if (dir == NULL)
+    return 0;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0'
+        && entry->d_name[4] <= '9') {
+      node = atoi(entry->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+/*
+ * Order CPUs for WORKQ_AFFINITY_COMPACT: the threads of a core
+ * together, then the cores of a package, then a node.
+ */
+static int
+workq_compact_order(const void* a, const void* b)
+{
+  const workq_cpu_t* x = (const workq_cpu_t*) a;
+  const workq_cpu_t* y = (const workq_cpu_t*) b;
+
+  if (x->node != y->node)
+    return x->node - y->node;
+  if (x->package != y->package)
+    return x->package - y->package;
+  if (x->core != y->core)
+    return x->core - y->core;
+  return x->thread - y->thread;
+}
+
+/*
+ * Order CPUs for WORKQ_AFFINITY_SCATTER: a core on each node in
+ * turn, and the second thread of a core only after the first
+ * thread of every core.
+ */
+static int
+workq_scatter_order(const void* a, const void* b)
+{
+  const workq_cpu_t* x = (const workq_cpu_t*) a;
+  const workq_cpu_t* y = (const workq_cpu_t*) b;
+
+  if (x->thread != y->thread)
+    return x->thread - y->thread;
+  if (x->rank != y->rank)
+    return x->rank - y->rank;
+  if (x->node != y->node)
+    return x->node - y->node;
+  return x->cpu - y->cpu;
+}
+
+/*
+ * Read the CPU topology, and build the list of CPUs for the
+ * servers (in placement order) and the map from CPU to node.
+ */
+static int
+workq_topology(workq_t* wq, const workq_attr_t* attr)
+{
+  unsigned char online[WORKQ_MAX_CPUS / 8];
+  char path[96], buf[1024];
+  workq_cpu_t *cpus, *info;
+  int cpu, count, other, status;
+
+  memset(online, 0, sizeof(online));
+  status = workq_sysfs_read(WORKQ_SYSFS "/cpu/online", buf, sizeof(buf));
+  if (status != 0)
+    return status;
+  workq_cpulist(buf, online);
+  for (cpu = 0; cpu < WORKQ_MAX_CPUS; cpu++) {
+    if (online[cpu / 8] & (1 << (cpu % 8)))
+      wq->cpu_max = cpu + 1;
+  }
+  cpus         = (workq_cpu_t*) malloc(wq->cpu_max * sizeof(workq_cpu_t));
+  wq->cpu_node = (int*) malloc(wq->cpu_max * sizeof(int));
+  if (cpus == NULL || wq->cpu_node == NULL) {
+    free(cpus);
+    free(wq->cpu_node);
+    wq->cpu_node = NULL;
+    return ENOMEM;
+  }
+
+  wq->ncpus = 0;
+  for (cpu = 0; cpu < wq->cpu_max; cpu++) {
+    wq->cpu_node[cpu] = -1;
+    if (!(online[cpu / 8] & (1 << (cpu % 8))))
+      continue;
+    wq->cpu_node[cpu] = workq_cpu_node(cpu);
+    if (attr->ncpus > 0 && !(attr->cpus[cpu / 8] & (1 << (cpu % 8))))
+      continue;
+    info       = &cpus[wq->ncpus++];
+    info->cpu  = cpu;
+    info->node = wq->cpu_node[cpu];
+    snprintf(path,
+             sizeof(path),
+             WORKQ_SYSFS "/cpu/cpu%d/topology/physical_package_id",
+             cpu);
+    info->package = workq_sysfs_int(path, 0);
+    snprintf(
+        path, sizeof(path), WORKQ_SYSFS "/cpu/cpu%d/topology/core_id", cpu);
+    info->core = workq_sysfs_int(path, cpu);
+  }
+  if (wq->ncpus == 0) {
+    free(cpus);
+    free(wq->cpu_node);
+    wq->cpu_node = NULL;
+    return EINVAL;
+  }
+
+  /*
+   * Number the threads of each core and the cores of each
+   * node, in CPU order, and count the nodes.
+   */
+  wq->nodes = 0;
+  for (count = 0; count < wq->ncpus; count++) {
+    info         = &cpus[count];
+    info->thread = 0;
+    info->rank   = 0;
+    for (other = 0; other < count; other++) {
+      if (cpus[other].package == info->package
+          && cpus[other].core == info->core) {
+        info->thread++;
+        info->rank = cpus[other].rank;
+      }
+    }
+    for (other = 0; other < count && info->thread == 0; other++) {
+      if (cpus[other].node == info->node && cpus[other].thread == 0)
+        info->rank++;
+    }
+    for (other = 0; other < count; other++) {
+      if (cpus[other].node == info->node)
+        break;
+    }
+    if (other == count)
+      wq->nodes++;
+  }
+
+  if (wq->affinity == WORKQ_AFFINITY_SCATTER)
+    qsort(cpus, wq->ncpus, sizeof(workq_cpu_t), workq_scatter_order);
+  else
+    qsort(cpus, wq->ncpus, sizeof(workq_cpu_t), workq_compact_order);
+  wq->cpus = (int*) malloc(wq->ncpus * sizeof(int));
+  if (wq->cpus == NULL) {
+    free(cpus);
+    free(wq->cpu_node);
+    wq->cpu_node = NULL;
+    return ENOMEM;
+  }
+  for (count = 0; count < wq->ncpus; count++) wq->cpus[count] = cpus[count].cpu;
+  free(cpus);
+  return 0;
+}
+#endif
+
+/*
+ * Allocate statistics for a server slot.
+ */
+static workq_wstats_t*
+workq_wstats_alloc(void)
+{
+  workq_wstats_t* stats;
+  int count;
+
+  if (posix_memalign((void**) &stats, WORKQ_CACHE_LINE, sizeof(*stats)) != 0)
+    return NULL;
+  atomic_init(&stats->executed, 0);
+  for (count = 0; count < WORKQ_HIST_BUCKETS; count++) {
+    atomic_init(&stats->wait[count], 0);
+    atomic_init(&stats->run[count], 0);
+  }
+  return stats;
+}
+
+/*
+ * Allocate the server slots for a work queue. Only WORKQ_STEAL
+ * servers need deques, and only a work queue that keeps
+ * statistics needs their statistics. Servers placed by
+ * WORKQ_AFFINITY_COMPACT or WORKQ_AFFINITY_SCATTER get a CPU
+ * each, in turn.
+ */
+static int
+workq_workers_init(workq_t* wq)
+{
+  workq_worker_t* workers;
+  int count, status;
+
+  status = posix_memalign(
+      (void**) &workers, WORKQ_CACHE_LINE, wq->parallelism * sizeof(*workers));
+  if (status != 0)
+    return status;
+  for (count = 0; count < wq->parallelism; count++) {
+    workers[count].stats = NULL;
+    if (wq->mode == WORKQ_STEAL)
+      status = workq_deque_init(&workers[count].deque);
+    if (status == 0 && wq->stats) {
+      workers[count].stats = workq_wstats_alloc();
+      if (workers[count].stats == NULL) {
+        if (wq->mode == WORKQ_STEAL)
+          workq_deque_destroy(&workers[count].deque);
+        status = ENOMEM;
+      }
+    }
+    if (status != 0) {
+      while (--count >= 0) {
+        if (wq->mode == WORKQ_STEAL)
+          workq_deque_destroy(&workers[count].deque);
+        free(workers[count].stats);
+      }
+      free(workers);
+      return status;
+    }
+    workers[count].wq      = wq;
+    workers[count].index   = count;
+    workers[count].active  = 0;
+    workers[count].seed    = count + 1;
+    workers[count].cache   = NULL;
+    workers[count].cached  = 0;
+    workers[count].hcache  = NULL;
+    workers[count].context = NULL;
+    workers[count].cpu     = -1;
+    workers[count].node    = -1;
+    if (wq->affinity == WORKQ_AFFINITY_COMPACT
+        || wq->affinity == WORKQ_AFFINITY_SCATTER) {
+      workers[count].cpu  = wq->cpus[count % wq->ncpus];
+      workers[count].node = wq->cpu_node[workers[count].cpu];
+    }
+    atomic_init(&workers[count].pool_hits, 0);
+    atomic_init(&workers[count].pool_misses, 0);
+    atomic_init(&workers[count].expired, 0);
+    atomic_init(&workers[count].cancelled, 0);
+  }
+  wq->workers = workers;
+  return 0;
+}
+
+/*
+ * Free the server slots of a work queue, and the element and
+ * handle slabs. All server threads must have exited, and all
+ * handles must have been released.
+ */
+static void
+workq_workers_destroy(workq_t* wq)
+{
+  workq_slab_t *slab, *next;
+  workq_hslab_t *hslab, *hnext;
+  int count;
+
+  for (count = 0; count < wq->parallelism; count++) {
+    if (wq->mode == WORKQ_STEAL)
+      workq_deque_destroy(&wq->workers[count].deque);
+    free(wq->workers[count].stats);
+  }
+  free(wq->workers);
+  wq->workers = NULL;
+  free(wq->cpus);
+  wq->cpus = NULL;
+  free(wq->cpu_node);
+  wq->cpu_node = NULL;
+  if (wq->ring != NULL)
+    workq_ring_destroy(wq->ring);
+  wq->ring = NULL;
+  if (wq->shards != NULL)
+    workq_shards_destroy(wq->shards, wq->nshards);
+  wq->shards  = NULL;
+  wq->nshards = 0;
+  slab        = atomic_load_explicit(&wq->slabs, memory_order_acquire);
+  while (slab != NULL) {
+    next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  atomic_store_explicit(&wq->slabs, NULL, memory_order_relaxed);
+  hslab = atomic_load_explicit(&wq->hslabs, memory_order_acquire);
+  while (hslab != NULL) {
+    hnext = hslab->next;
+    for (count = 0; count < WORKQ_HANDLE_SLAB; count++) {
+      pthread_cond_destroy(&hslab->handle[count].cv);
+      pthread_mutex_destroy(&hslab->handle[count].mutex);
+    }
+    free(hslab);
+    hslab = hnext;
+  }
+  atomic_store_explicit(&wq->hslabs, NULL, memory_order_relaxed);
+}
+
+/*
+ * Initialize a work queue with default attributes.
+ */
+int
+workq_init(workq_t* wq, int threads, void (*engine)(void* arg))
+{
+  return workq_init_attr(wq, NULL, threads, engine);
+}
+
+/*
+ * Initialize a work queue whose engine is either "engine" or
+ * "engine_ctx".
+ */
+static int
+workq_setup(workq_t* wq,
+            const workq_attr_t* wqattr,
+            int threads,
+            void (*engine)(void* arg),
+            void (*engine_ctx)(void* context, void* arg))
+{
+  struct timespec now;
+  int count, status;
+
+  if (wqattr != NULL && wqattr->valid != WORKQ_ATTR_VALID)
+    return EINVAL;
+  if (threads <= 0)
+    return EINVAL;
+  if (wqattr != NULL && wqattr->min_threads > threads)
+    return EINVAL;
+  wq->mode         = (wqattr != NULL ? wqattr->mode : WORKQ_LIST);
+  wq->parallelism  = threads;
+  wq->min_threads  = (wqattr != NULL ? wqattr->min_threads : 0);
+  wq->idle_min     = (wqattr != NULL ? wqattr->idle_min : 2000);
+  wq->idle_max     = (wqattr != NULL ? wqattr->idle_max : 2000);
+  wq->idle_timeout = wq->idle_min;
+  wq->aging        = (wqattr != NULL ? wqattr->aging : 0);
+  wq->affinity     = (wqattr != NULL ? wqattr->affinity : WORKQ_AFFINITY_NONE);
+  wq->full         = (wqattr != NULL ? wqattr->full : WORKQ_FULL_BLOCK);
+  wq->wakeup       = (wqattr != NULL ? wqattr->wakeup : WORKQ_WAKE_EVENT);
+  wq->idle_spins   = (wq->wakeup == WORKQ_WAKE_EVENT ? WORKQ_IDLE_SPINS : 0);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  atomic_init(&wq->lull, 0);
+  atomic_init(&wq->arrival, now.tv_sec * 1000000L + now.tv_nsec / 1000);
+  wq->thread_creates = wq->thread_exits = wq->thread_timeouts = 0;
+  wq->wake_idle = wq->wake_create = 0;
+  wq->parks = wq->unparks = 0;
+  wq->stats        = (wqattr != NULL ? wqattr->stats : 0);
+  wq->context_init = (wqattr != NULL ? wqattr->context_init : NULL);
+  wq->context_fini = (wqattr != NULL ? wqattr->context_fini : NULL);
+  wq->context_arg  = (wqattr != NULL ? wqattr->context_arg : NULL);
+  wq->depth        = 0;
+  atomic_init(&wq->depth_max, 0);
+
+  wq->free      = NULL; /* empty element pool */
+  wq->pool_hits = wq->pool_misses = 0;
+  atomic_init(&wq->returned, NULL);
+  atomic_init(&wq->slabs, NULL);
+  wq->hfree = NULL; /* empty handle pool */
+  atomic_init(&wq->hreturned, NULL);
+  atomic_init(&wq->hslabs, NULL);
+  wq->nodes    = 1; /* no placement */
+  wq->ncpus    = 0;
+  wq->cpus     = NULL;
+  wq->cpu_max  = 0;
+  wq->cpu_node = NULL;
+#ifdef __linux__
+  if (wq->affinity != WORKQ_AFFINITY_NONE) {
+    status = workq_topology(wq, wqattr);
+    if (status != 0)
+      return status;
+  }
+#endif
+  wq->ring = NULL;
+  if (wq->mode == WORKQ_RING) {
+    wq->ring =
+        workq_ring_init(wqattr != NULL ? wqattr->capacity : WORKQ_RING_SIZE);
+    if (wq->ring == NULL) {
+      free(wq->cpus);
+      free(wq->cpu_node);
+      return ENOMEM;
+    }
+  }
+  wq->shards  = NULL;
+  wq->nshards = 0;
+  if (wq->mode == WORKQ_SHARD) {
+    wq->nshards =
+        (wqattr != NULL && wqattr->shards > 0 ? wqattr->shards : threads);
+    wq->shards = workq_shards_init(wq->nshards);
+    if (wq->shards == NULL) {
+      free(wq->cpus);
+      free(wq->cpu_node);
+      return ENOMEM;
+    }
+  }
+  status = workq_workers_init(wq);
+  if (status != 0) {
+    if (wq->ring != NULL)
+      workq_ring_destroy(wq->ring);
+    if (wq->shards != NULL)
+      workq_shards_destroy(wq->shards, wq->nshards);
+    free(wq->cpus);
+    free(wq->cpu_node);
+    return status;
+  }
+
+  status = pthread_attr_init(&wq->attr);
+  if (status != 0) {
+    workq_workers_destroy(wq);
+    return status;
+  }
+  status = pthread_attr_setdetachstate(&wq->attr, PTHREAD_CREATE_DETACHED);
+  if (status != 0) {
+    pthread_attr_destroy(&wq->attr);
+    workq_workers_destroy(wq);
+    return status;
+  }
+  status = pthread_mutex_init(&wq->mutex, NULL);
+  if (status != 0) {
+    pthread_attr_destroy(&wq->attr);
+    workq_workers_destroy(wq);
+    return status;
+  }
+  status = pthread_cond_init(&wq->cv, NULL);
+  if (status != 0) {
+    pthread_mutex_destroy(&wq->mutex);
+    pthread_attr_destroy(&wq->attr);
+    workq_workers_destroy(wq);
+    return status;
+  }
+  status = pthread_cond_init(&wq->space, NULL);
+  if (status != 0) {
+    pthread_cond_destroy(&wq->cv);
+    pthread_mutex_destroy(&wq->mutex);
+    pthread_attr_destroy(&wq->attr);
+    workq_workers_destroy(wq);
+    return status;
+  }
+  status = pthread_cond_init(&wq->quiet, NULL);
+  if (status != 0) {
+    pthread_cond_destroy(&wq->space);
+    pthread_cond_destroy(&wq->cv);
+    pthread_mutex_destroy(&wq->mutex);
+    pthread_attr_destroy(&wq->attr);
+    workq_workers_destroy(wq);
+    return status;
+  }
+  wq->quiescers = 0;
+  atomic_init(&wq->abandon, 0);
+  wq->abandoned     = NULL;
+  wq->abandoned_arg = NULL;
+  atomic_init(&wq->full_waiters, 0);
+  wq->quit = 0; /* not time to quit */
+  for (count = 0; count < WORKQ_PRIORITIES; count++)
+    wq->first[count] = wq->last[count] = NULL; /* no queue entries */
+  atomic_init(&wq->ready, 0);
+  atomic_init(&wq->counter, 0); /* no server threads yet */
+  atomic_init(&wq->idle, 0);    /* no idle servers */
+  atomic_init(&wq->epoch, 0);
+  atomic_init(&wq->sleepers, 0);
+  wq->wakeups = 0;
+  wq->alive      = 0;
+  wq->engine     = engine;
+  wq->engine_ctx = engine_ctx;
+  wq->valid      = WORKQ_VALID;
+
+  /*
+   * Start the resident servers.
+   */
+  if (wq->min_threads > 0) {
+    status = pthread_mutex_lock(&wq->mutex);
+    if (status != 0) {
+      workq_destroy(wq);
+      return status;
+    }
+    while (status == 0 && wq->counter < wq->min_threads)
+      status = workq_start(wq);
+    pthread_mutex_unlock(&wq->mutex);
+    if (status != 0) {
+      workq_destroy(wq);
+      return status;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Initialize a work queue.
+ */
+int
+workq_init_attr(workq_t* wq,
+                const workq_attr_t* wqattr,
+                int threads,
+                void (*engine)(void* arg))
+{
+  return workq_setup(wq, wqattr, threads, engine, NULL);
+}
+
+/*
+ * Initialize a work queue whose engine is passed the calling
+ * server's context (see workq_attr_setcontext) along with each
+ * request.
+ */
+int
+workq_init_context(workq_t* wq,
+                   const workq_attr_t* wqattr,
+                   int threads,
+                   void (*engine)(void* context, void* data))
+{
+  return workq_setup(wq, wqattr, threads, NULL, engine);
+}
+
+/*
+ * Destroy a work queue, after running every request already
+ * queued.
+ */
+int
+workq_destroy(workq_t* wq)
+{
+  return workq_shutdown(wq, WORKQ_DRAIN, NULL, NULL, NULL);
+}
+
+/*
+ * Destroy a work queue. With WORKQ_DRAIN, the servers first run
+ * every request already queued -- unless "abstime" (on the
+ * CLOCK_REALTIME clock) is non-NULL and passes first, whereupon
+ * the remaining requests are abandoned. With WORKQ_ABANDON, they
+ * are abandoned at once. Requests that have started still run
+ * to completion before workq_shutdown returns.
+ *
+ * Each abandoned request is passed, with "arg", to the
+ * "abandoned" routine (if it's non-NULL), which is called by a
+ * server thread, so that the caller can reclaim its data. An
+ * abandoned request queued by workq_submit is also cancelled;
+ * as with workq_destroy, though, every completion handle must
+ * have been released before the work queue is shut down.
+ */
+int
+workq_shutdown(workq_t* wq,
+               int how,
+               const struct timespec* abstime,
+               void (*abandoned)(void* data, void* arg),
+               void* arg)
+{
+  int status, status1, status2;
+
+  if (wq->valid != WORKQ_VALID)
+    return EINVAL;
+  if (how != WORKQ_DRAIN && how != WORKQ_ABANDON)
+    return EINVAL;
+  status = pthread_mutex_lock(&wq->mutex);
+  if (status != 0)
+    return status;
+  wq->valid         = 0; /* prevent any other operations */
+  wq->abandoned     = abandoned;
+  wq->abandoned_arg = arg;
+  if (how == WORKQ_ABANDON)
+    atomic_store_explicit(&wq->abandon, 1, memory_order_release);
+
+  /*
+   * Turn away any producers waiting for room on the ring.
+   */
+  if (wq->mode == WORKQ_RING) {
+    wq->quit = 1;
+    pthread_cond_broadcast(&wq->space);
+  }
+
+  /*
+   * Check whether any threads are active, and run them down:
+   *
+   * 1.       set the quit flag
+   * 2.       broadcast to wake any servers that may be asleep
+   * 4.       wait for all threads to quit (alive goes to 0),
+   *          abandoning the rest of the work if the time limit
+   *          passes. Because we don't use join, we don't need
+   *          to worry about tracking thread IDs.
+   */
+  if (wq->alive > 0) {
+    wq->quit = 1;
+    /*
+     * Wake any threads that are waiting for work. (Servers
+     * count themselves idle, and look for "quit", with the
+     * mutex locked, so none can be left asleep.)
+     */
+    status = workq_unpark(wq, atomic_load(&wq->idle));
+    if (status != 0) {
+      pthread_mutex_unlock(&wq->mutex);
+      return status;
+    }
+
+    /*
+     * Just to prove that every rule has an exception, I'm
+     * using the "cv" condition for two separate predicates
+     * here. That's OK, since the case used here applies
+     * only once during the life of a work queue -- during
+     * rundown. The overhead is minimal and it's not worth
+     * creating a separate condition variable that would be
+     * waited and signalled exactly once!
+     */
+    while (wq->alive > 0) {
+      if (abstime != NULL && !atomic_load(&wq->abandon))
+        status = pthread_cond_timedwait(&wq->cv, &wq->mutex, abstime);
+      else
+        status = pthread_cond_wait(&wq->cv, &wq->mutex);
+      if (status == ETIMEDOUT) {
+        DPRINTF(("Work queue drain timed out\n"));
+        atomic_store_explicit(&wq->abandon, 1, memory_order_release);
+        status = 0;
+      }
+      if (status != 0) {
+        pthread_mutex_unlock(&wq->mutex);
+        return status;
+      }
+    }
+  }
+  status = pthread_mutex_unlock(&wq->mutex);
+  if (status != 0)
+    return status;
+  status  = pthread_mutex_destroy(&wq->mutex);
+  status1 = pthread_cond_destroy(&wq->cv);
+  if (status1 == 0)
+    status1 = pthread_cond_destroy(&wq->space);
+  if (status1 == 0)
+    status1 = pthread_cond_destroy(&wq->quiet);
+  status2 = pthread_attr_destroy(&wq->attr);
+  workq_workers_destroy(wq);
+  return (status ? status : (status1 ? status1 : status2));
+}
+
+/*
+ * Wait until the work queue has run out of work, or until
+ * "abstime" (on the CLOCK_REALTIME clock) if it's non-NULL:
+ * every request queued before the call has been run (or
+ * dropped), and every server is idle. The work queue remains
+ * usable. Returns ETIMEDOUT if the time passes first, or
+ * EDEADLK if called by a server of the queue, which could
+ * never be idle.
+ *
+ * Requests queued meanwhile by other threads must also run
+ * before the queue is quiet, so the caller should stop them
+ * first if it wants to be sure that the wait ends.
+ */
+int
+workq_timedquiesce(workq_t* wq, const struct timespec* abstime)
+{
+  int status;
+
+  if (wq->valid != WORKQ_VALID)
+    return EINVAL;
+  if (workq_local(wq) != NULL)
+    return EDEADLK;
+  status = pthread_mutex_lock(&wq->mutex);
+  if (status != 0)
+    return status;
+  wq->quiescers++;
+  while (!workq_quiet(wq)) {
+    if (abstime != NULL)
+      status = pthread_cond_timedwait(&wq->quiet, &wq->mutex, abstime);
+    else
+      status = pthread_cond_wait(&wq->quiet, &wq->mutex);
+    if (status != 0)
+      break;
+  }
+  wq->quiescers--;
+  pthread_mutex_unlock(&wq->mutex);
+  return status;
+}
+
+/*
+ * Wait until the work queue has run out of work.
+ */
+int
+workq_quiesce(workq_t* wq)
+{
+  return workq_timedquiesce(wq, NULL);
+}
+
+/*
+ * Fill in a newly allocated request structure.
+ */
+static void
+workq_request_fill(workq_t* wq,
+                   workq_worker_t* self,
+                   workq_ele_t* item,
+                   const workq_reqattr_t* attr,
+                   workq_group_t* group,
+                   void* (*routine)(void*),
+                   void* element)
+{
+  item->routine = routine;
+  item->data    = element;
+  item->node    = workq_node(wq, self);
+  item->group   = group;
+  item->next    = NULL;
+  if (attr != NULL)
+    item->deadline = attr->deadline;
+  workq_stamp(wq, &item->queued);
+}
+
+/*
+ * Allocate and fill in a request structure, and its completion
+ * handle if "handlep" is non-NULL. A server of the queue
+ * passes its slot as "self"; other threads must hold the
+ * workq_t mutex.
+ */
+static workq_ele_t*
+workq_request(workq_t* wq,
+              workq_worker_t* self,
+              const workq_reqattr_t* attr,
+              workq_group_t* group,
+              void* (*routine)(void*),
+              void* element,
+              workq_handle_t** handlep)
+{
+  workq_ele_t* item;
+
+  item = workq_ele_alloc(wq, self);
+  if (item == NULL)
+    return NULL;
+  if (handlep != NULL) {
+    item->handle = workq_handle_alloc(wq, self);
+    if (item->handle == NULL) {
+      workq_pool_return(wq, item, item);
+      return NULL;
+    }
+    *handlep = item->handle;
+  }
+  workq_request_fill(wq, self, item, attr, group, routine, element);
+  return item;
+}
+
+/*
+ * Free a request structure that couldn't be queued, along with
+ * its completion handle.
+ */
+static void
+workq_unrequest(workq_t* wq, workq_ele_t* item)
+{
+  if (item->handle != NULL) {
+    workq_handle_unref(item->handle);
+    workq_handle_unref(item->handle);
+  }
+  workq_pool_return(wq, item, item);
+}
+
+/*
+ * Make servers available for "count" requests just put on the
+ * ring or a shard. As when a server pushes onto its own deque, only take
+ * the mutex if there's an idle server to wake (the fence pairs
+ * with the one a server makes when it declares itself idle) or
+ * room for another server.
+ */
+static int
+workq_lazy_wake(workq_t* wq, size_t count)
+{
+  int status;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&wq->idle) == 0
+      && atomic_load(&wq->counter) >= wq->parallelism)
+    return 0;
+  status = pthread_mutex_lock(&wq->mutex);
+  if (status != 0)
+    return status;
+  status = workq_wake(wq, count);
+  pthread_mutex_unlock(&wq->mutex);
+  return status;
+}
+
+/*
+ * Put "count" requests on the ring, copied from "request" but
+ * for their data, waiting for room as the full policy says, and
+ * wake servers for them.
+ */
+static int
+workq_ring_add(workq_t* wq,
+               workq_worker_t* self,
+               void** data,
+               size_t count,
+               workq_ele_t* request)
+{
+  int spins = 0, status;
+
+  workq_stamp(wq, &request->queued);
+  while (workq_ring_put(wq->ring, data, count, request) != 0) {
+    if (wq->full == WORKQ_FULL_FAIL || self != NULL)
+      return EAGAIN;
+    if (wq->full == WORKQ_FULL_SPIN && spins++ < WORKQ_FULL_SPINS)
+      continue;
+
+    /*
+     * Count ourselves as waiting before checking for room
+     * again, so that a server that makes room either is seen
+     * here or sees us and broadcasts.
+     */
+    status = pthread_mutex_lock(&wq->mutex);
+    if (status != 0)
+      return status;
+    atomic_fetch_add(&wq->full_waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (workq_ring_full(wq->ring, count) && !wq->quit) {
+      status = pthread_cond_wait(&wq->space, &wq->mutex);
+      if (status != 0)
+        break;
+    }
+    atomic_fetch_sub(&wq->full_waiters, 1);
+    if (wq->quit && status == 0)
+      status = EINVAL;
+    pthread_mutex_unlock(&wq->mutex);
+    if (status != 0)
+      return status;
+    spins = 0;
+    workq_stamp(wq, &request->queued);
+  }
+  if (wq->stats)
+    workq_depth(wq, workq_ring_depth(wq->ring));
+  workq_arrival(wq);
+  return workq_lazy_wake(wq, count);
+}
+
+/*
+ * Queue a request on a WORKQ_RING work queue.
+ */
+static int
+workq_ring_queue(workq_t* wq,
+                 const workq_reqattr_t* attr,
+                 workq_group_t* group,
+                 void* (*routine)(void*),
+                 void* element,
+                 workq_handle_t** handlep)
+{
+  workq_worker_t* self;
+  workq_handle_t* handle = NULL;
+  workq_ele_t request    = {NULL};
+  int status;
+
+  self = workq_local(wq);
+  if (handlep != NULL) {
+    if (self == NULL) {
+      status = pthread_mutex_lock(&wq->mutex);
+      if (status != 0)
+        return status;
+      handle = workq_handle_alloc(wq, NULL);
+      pthread_mutex_unlock(&wq->mutex);
+    }
+    else
+      handle = workq_handle_alloc(wq, self);
+    if (handle == NULL)
+      return ENOMEM;
+    *handlep = handle;
+  }
+  request.routine = routine;
+  request.handle  = handle;
+  request.group   = group;
+  if (attr != NULL)
+    request.deadline = attr->deadline;
+  status = workq_ring_add(wq, self, &element, 1, &request);
+  if (status != 0 && handle != NULL) {
+    workq_handle_unref(handle);
+    workq_handle_unref(handle);
+  }
+  return status;
+}
+
+/*
+ * Queue a request on a WORKQ_SHARD work queue. A server
+ * allocates the request structure from its own cache, and any
+ * other thread from the pool of the shard it chose, so that it
+ * needs the workq_t mutex only for a completion handle, or to
+ * wake a server.
+ */
+static int
+workq_shard_queue(workq_t* wq,
+                  const workq_reqattr_t* attr,
+                  workq_group_t* group,
+                  void* (*routine)(void*),
+                  void* element,
+                  workq_handle_t** handlep)
+{
+  workq_worker_t* self;
+  workq_shard_t* shard;
+  workq_handle_t* handle = NULL;
+  workq_ele_t* item;
+  int status, hit;
+
+  self  = workq_local(wq);
+  shard = workq_shard_pick(wq, self);
+  if (self != NULL) {
+    item = workq_request(wq, self, attr, group, routine, element, handlep);
+    if (item == NULL)
+      return ENOMEM;
+    status = pthread_mutex_lock(&shard->mutex);
+    if (status != 0) {
+      workq_unrequest(wq, item);
+      return status;
+    }
+  }
+  else {
+    if (handlep != NULL) {
+      status = pthread_mutex_lock(&wq->mutex);
+      if (status != 0)
+        return status;
+      handle = workq_handle_alloc(wq, NULL);
+      pthread_mutex_unlock(&wq->mutex);
+      if (handle == NULL)
+        return ENOMEM;
+    }
+    status = pthread_mutex_lock(&shard->mutex);
+    if (status == 0) {
+      item = workq_ele_take(wq, &shard->free, &hit);
+      if (item == NULL) {
+        pthread_mutex_unlock(&shard->mutex);
+        status = ENOMEM;
+      }
+    }
+    if (status != 0) {
+      if (handle != NULL) {
+        workq_handle_unref(handle);
+        workq_handle_unref(handle);
+      }
+      return status;
+    }
+    if (hit)
+      shard->pool_hits++;
+    else
+      shard->pool_misses++;
+    item->handle = handle;
+    workq_request_fill(wq, NULL, item, attr, group, routine, element);
+    if (handlep != NULL)
+      *handlep = handle;
+  }
+  workq_shard_append(wq, shard, item, item, 1);
+  pthread_mutex_unlock(&shard->mutex);
+  workq_arrival(wq);
+  return workq_lazy_wake(wq, 1);
+}
+
+/*
+ * Add a batch of items to a WORKQ_SHARD work queue, all on the
+ * one shard, chosen as for a single request.
+ */
+static int
+workq_shard_batch(workq_t* wq,
+                  workq_worker_t* self,
+                  void** elements,
+                  size_t count)
+{
+  workq_shard_t* shard = workq_shard_pick(wq, self);
+  workq_ele_t *first = NULL, *last = NULL, *item;
+  struct timespec now;
+  size_t index;
+  int status, hit, node;
+
+  if (self != NULL) {
+    first = workq_chain_alloc(wq, self, elements, count, &last);
+    if (first == NULL)
+      return ENOMEM;
+  }
+  status = pthread_mutex_lock(&shard->mutex);
+  if (status != 0) {
+    if (first != NULL)
+      workq_pool_return(wq, first, last);
+    return status;
+  }
+  if (self == NULL) {
+    node = workq_node(wq, NULL);
+    workq_stamp(wq, &now);
+    for (index = 0; index < count; index++) {
+      item = workq_ele_take(wq, &shard->free, &hit);
+      if (item == NULL) {
+        if (first != NULL) {
+          last->next  = shard->free;
+          shard->free = first;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        return ENOMEM;
+      }
+      if (hit)
+        shard->pool_hits++;
+      else
+        shard->pool_misses++;
+      item->data   = elements[index];
+      item->node   = node;
+      item->queued = now;
+      if (first == NULL)
+        first = item;
+      else
+        last->next = item;
+      last = item;
+    }
+  }
+  workq_shard_append(wq, shard, first, last, count);
+  pthread_mutex_unlock(&shard->mutex);
+  workq_arrival(wq);
+  return workq_lazy_wake(wq, count);
+}
+
+/*
+ * Queue a request, with the attributes given by "attr" (or the
+ * defaults if it's NULL), as a task of "group" if that's
+ * non-NULL: the common part of workq_add, workq_submit and
+ * workq_group_spawn.
+ */
+static int
+workq_queue(workq_t* wq,
+            const workq_reqattr_t* attr,
+            workq_group_t* group,
+            void* (*routine)(void*),
+            void* element,
+            workq_handle_t** handlep)
+{
+  workq_worker_t* self;
+  workq_ele_t* item = NULL;
+  int priority = (attr != NULL ? attr->priority : WORKQ_PRIO_DEFAULT);
+  int status;
+
+  if (wq->valid != WORKQ_VALID)
+    return EINVAL;
+  if (attr != NULL && attr->valid != WORKQ_REQATTR_VALID)
+    return EINVAL;
+  if (wq->mode == WORKQ_RING)
+    return workq_ring_queue(wq, attr, group, routine, element, handlep);
+  if (wq->mode == WORKQ_SHARD)
+    return workq_shard_queue(wq, attr, group, routine, element, handlep);
+
+  /*
+   * A server of this queue allocates the request structure from
+   * its own cache. Other threads allocate from the shared pool
+   * once they hold the mutex.
+   */
+  self = workq_local(wq);
+  if (self != NULL) {
+    item = workq_request(wq, self, attr, group, routine, element, handlep);
+    if (item == NULL)
+      return ENOMEM;
+  }
+
+  if (wq->mode == WORKQ_STEAL && self != NULL
+      && priority == WORKQ_PRIO_DEFAULT) {
+    /*
+     * A server of this queue is adding work: push it onto the
+     * server's own deque without locking. (Requests of other
+     * priorities go onto the shared queue, to be ordered.) Only
+     * take the mutex if there's an idle server to wake (the
+     * fence pairs with the one a server makes when it declares
+     * itself idle) or room for another server.
+     */
+    status = workq_deque_push(&self->deque, item);
+    if (status != 0) {
+      workq_unrequest(wq, item);
+      return status;
+    }
+    if (wq->stats)
+      workq_depth(wq, workq_deque_size(&self->deque));
+    workq_arrival(wq);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&wq->idle) == 0
+        && atomic_load(&wq->counter) >= wq->parallelism)
+      return 0;
+    status = pthread_mutex_lock(&wq->mutex);
+    if (status != 0)
+      return status;
+  }
+  else {
+    status = pthread_mutex_lock(&wq->mutex);
+    if (status != 0) {
+      if (item != NULL)
+        workq_unrequest(wq, item);
+      return status;
+    }
+    if (item == NULL) {
+      item =
+          workq_request(wq, NULL, attr, group, routine, element, handlep);
+      if (item == NULL) {
+        pthread_mutex_unlock(&wq->mutex);
+        return ENOMEM;
+      }
+    }
+    workq_arrival(wq);
+
+    /*
+     * Add the request to the end of the queue for its
+     * priority.
+     */
+    workq_append(wq, item, item, priority);
+  }
+
+  status = workq_wake(wq, 1);
+  if (status != 0) {
+    pthread_mutex_unlock(&wq->mutex);
+    return status;
+  }
+  pthread_mutex_unlock(&wq->mutex);
+  return 0;
+}
+
+/*
+ * Add an item to a work queue.
+ */
+int
+workq_add(workq_t* wq, void* element)
+{
+  return workq_queue(wq, NULL, NULL, NULL, element, NULL);
+}
+
+/*
+ * Add an item to a work queue, with the priority given by
+ * "attr" (or the default if it's NULL).
+ */
+int
+workq_add_attr(workq_t* wq, const workq_reqattr_t* attr, void* element)
+{
+  return workq_queue(wq, attr, NULL, NULL, element, NULL);
+}
+
+/*
+ * Queue a call to "routine" (or to the queue's engine, if
+ * routine is NULL) with argument "arg", and return a
+ * completion handle through which the caller can wait for the
+ * routine's return value. The handle must be released with
+ * workq_release.
+ */
+int
+workq_submit(workq_t* wq,
+             void* (*routine)(void*),
+             void* arg,
+             workq_handle_t** handle)
+{
+  return workq_submit_attr(wq, NULL, routine, arg, handle);
+}
+
+/*
+ * Queue a call to "routine", as workq_submit does, with the
+ * attributes given by "attr" (or the defaults if it's NULL).
+ */
+int
+workq_submit_attr(workq_t* wq,
+                  const workq_reqattr_t* attr,
+                  void* (*routine)(void*),
+                  void* arg,
+                  workq_handle_t** handle)
+{
+  int status;
+
+  status = workq_queue(wq, attr, NULL, routine, arg, handle);
+  if (status != 0)
+    *handle = NULL;
+  return status;
+}
+
+/*
+ * Check whether a request is complete, without blocking.
+ * Returns EBUSY if it isn't, or ECANCELED if it was cancelled
+ * or expired without running.
+ */
+int
+workq_trywait(workq_handle_t* handle, void** result)
+{
+  int state = atomic_load_explicit(&handle->state, memory_order_acquire);
+
+  if (state == WORKQ_CANCELED)
+    return ECANCELED;
+  if (state != WORKQ_DONE)
+    return EBUSY;
+  if (result != NULL)
+    *result = handle->result;
+  return 0;
+}
+
+/*
+ * Handle cleanup when a wait for completion is cancelled.
+ */
+static void
+workq_waitcleanup(void* arg)
+{
+  workq_handle_t* handle = (workq_handle_t*) arg;
+
+  handle->waiters--;
+  pthread_mutex_unlock(&handle->mutex);
+}
+
+/*
+ * Wait for a request to complete, until "abstime" (on the
+ * CLOCK_REALTIME clock) if it's non-NULL. Returns ETIMEDOUT if
+ * the time passes first, or ECANCELED if the request was
+ * cancelled or expired without running.
+ */
+int
+workq_timedwait(workq_handle_t* handle,
+                const struct timespec* abstime,
+                void** result)
+{
+  int state, status;
+
+  status = workq_trywait(handle, result);
+  if (status != EBUSY)
+    return status;
+  status = pthread_mutex_lock(&handle->mutex);
+  if (status != 0)
+    return status;
+  handle->waiters++;
+  pthread_cleanup_push(workq_waitcleanup, (void*) handle);
+  for (;;) {
+    state = atomic_load_explicit(&handle->state, memory_order_acquire);
+    if (state == WORKQ_DONE || state == WORKQ_CANCELED)
+      break;
+    if (abstime != NULL)
+      status = pthread_cond_timedwait(&handle->cv, &handle->mutex, abstime);
+    else
+      status = pthread_cond_wait(&handle->cv, &handle->mutex);
+    if (status != 0)
+      break;
+  }
+  pthread_cleanup_pop(0);
+  handle->waiters--;
+  if (status == 0 && state == WORKQ_CANCELED)
+    status = ECANCELED;
+  else if (status == 0 && result != NULL)
+    *result = handle->result;
+  pthread_mutex_unlock(&handle->mutex);
+  return status;
+}
+
+/*
+ * Wait for a request to complete.
  */
-#include "workq.h"
-#include <pthread.h>
-#include <stdlib.h>
-#include <time.h>
-#include "errors.h"
+int
+workq_wait(workq_handle_t* handle, void** result)
+{
+  return workq_timedwait(handle, NULL, result);
+}
 
 /*
- * Thread start routine to serve the work queue.
+ * Cancel a request queued by workq_submit, if no server has
+ * started it: it will be dropped, and waiters see ECANCELED.
+ * Returns EBUSY if it has started or is complete. The caller
+ * must still release the handle.
  */
-static void*
-workq_server(void* arg)
+int
+workq_cancel(workq_handle_t* handle)
 {
-  struct timespec timeout;
-  workq_t* wq = (workq_t*) arg;
-  workq_ele_t* we;
-  int status, timedout;
+  int state = atomic_load_explicit(&handle->state, memory_order_acquire);
 
-  /*
-   * We don't need to validate the workq_t here... we don't
-   * create server threads until requests are queued (the
-   * queue has been initialized by then!) and we wait for all
-   * server threads to terminate before destroying a work
-   * queue.
-   */
-  DPRINTF(("A worker is starting\n"));
-  status = pthread_mutex_lock(&wq->mutex);
-  if (status != 0)
-    return NULL;
+  if (state == WORKQ_CANCELED)
+    return 0;
+  return workq_handle_cancel(handle);
+}
 
-  while (1) {
-    timedout = 0;
-    DPRINTF(("Worker waiting for work\n"));
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec += 2;
+/*
+ * Release the caller's reference to a completion handle. The
+ * request needn't be complete; the handle returns to the pool
+ * once the server is also done with it.
+ */
+int
+workq_release(workq_handle_t* handle)
+{
+  workq_handle_unref(handle);
+  return 0;
+}
 
-    while (wq->first == NULL && !wq->quit) {
-      /*
-       * Server threads time out after spending 2 seconds
-       * waiting for new work, and exit.
-       */
-      status = pthread_cond_timedwait(&wq->cv, &wq->mutex, &timeout);
-      if (status == ETIMEDOUT) {
-        DPRINTF(("Worker wait timed out\n"));
-        timedout = 1;
-        break;
-      }
-      else if (status != 0) {
-        /*
-         * This shouldn't happen, so the work queue
-         * package should fail. Because the work queue
-         * API is asynchronous, that would add
-         * complication. Because the chances of failure
-         * are slim, I choose to avoid that
-         * complication. The server thread will return,
-         * and allow another server thread to pick up
-         * the work later. Note that, if this was the
-         * only server thread, the queue won't be
-         * serviced until a new work item is
-         * queued. That could be fixed by creating a new
-         * server here.
-         */
-        DPRINTF(("Worker wait failed, %d (%s)\n", status, strerror(status)));
-        wq->counter--;
-        pthread_mutex_unlock(&wq->mutex);
-        return NULL;
-      }
-    }
-    DPRINTF(("Work queue: %#lx, quit: %d\n", wq->first, wq->quit));
-    we = wq->first;
+/*
+ * Add a batch of items to a work queue. The whole batch is
+ * queued with one lock acquisition, and one wakeup covers as
+ * many idle servers as there are items. A server of the queue
+ * builds the chain of request structures from its own cache
+ * before locking (and in WORKQ_STEAL mode doesn't lock at all
+ * unless there are servers to wake).
+ *
+ * On a WORKQ_SHARD work queue, the whole batch goes onto one
+ * shard, locking only that shard.
+ *
+ * On a WORKQ_RING work queue, the batch is put into consecutive
+ * cells. A batch larger than the ring is refused (EINVAL),
+ * whatever the queue's full policy, since it could only be
+ * queued in parts, and a failure part way (say, because the
+ * queue is shut down while waiting for room) would leave the
+ * caller unable to tell which items were queued. When the full
+ * policy is WORKQ_FULL_FAIL, or the caller is a server, a batch
+ * that doesn't fit now is queued not at all (EAGAIN).
+ */
+int
+workq_add_batch(workq_t* wq, void** elements, size_t count)
+{
+  workq_worker_t* self;
+  workq_ele_t *first = NULL, *last, *item, *next;
+  workq_ele_t request = {NULL};
+  int status;
 
-    if (we != NULL) {
-      wq->first = we->next;
-      if (wq->last == we)
-        wq->last = NULL;
-      status = pthread_mutex_unlock(&wq->mutex);
-      if (status != 0)
-        return NULL;
-      DPRINTF(("Worker calling engine\n"));
-      wq->engine(we->data);
-      free(we);
-      status = pthread_mutex_lock(&wq->mutex);
-      if (status != 0)
-        return NULL;
-    }
+  if (wq->valid != WORKQ_VALID)
+    return EINVAL;
+  if (count == 0)
+    return 0;
+
+  self = workq_local(wq);
+  if (wq->mode == WORKQ_RING) {
+    if (count > wq->ring->mask + 1)
+      return EINVAL;
+    return workq_ring_add(wq, self, elements, count, &request);
+  }
+  if (wq->mode == WORKQ_SHARD)
+    return workq_shard_batch(wq, self, elements, count);
+
+  if (self != NULL) {
+    first = workq_chain_alloc(wq, self, elements, count, &last);
+    if (first == NULL)
+      return ENOMEM;
+  }
 
+  item = first;
+  if (wq->mode == WORKQ_STEAL && self != NULL) {
     /*
-     * If there are no more work requests, and the servers
-     * have been asked to quit, then shut down.
+     * A server pushes the batch onto its own deque. (Pick up
+     * "next" first: once pushed, an element may be stolen,
+     * run and freed.) If the deque can't grow, the rest of the
+     * batch goes onto the shared queue.
      */
-    if (wq->first == NULL && wq->quit) {
-      DPRINTF(("Worker shutting down\n"));
-      wq->counter--;
+    while (item != NULL) {
+      next = item->next;
+      if (workq_deque_push(&self->deque, item) != 0)
+        break;
+      item = next;
+    }
+    if (wq->stats)
+      workq_depth(wq, workq_deque_size(&self->deque));
+    if (item == NULL) {
+      workq_arrival(wq);
+      atomic_thread_fence(memory_order_seq_cst);
+      if (atomic_load(&wq->idle) == 0
+          && atomic_load(&wq->counter) >= wq->parallelism)
+        return 0;
+    }
+  }
 
-      /*
-       * NOTE: Just to prove that every rule has an
-       * exception, I'm using the "cv" condition for two
-       * separate predicates here.  That's OK, since the
-       * case used here applies only once during the life
-       * of a work queue -- during rundown. The overhead
-       * is minimal and it's not worth creating a separate
-       * condition variable that would be waited and
-       * signaled exactly once!
-       */
-      if (wq->counter == 0)
-        pthread_cond_broadcast(&wq->cv);
+  status = pthread_mutex_lock(&wq->mutex);
+  if (status != 0) {
+    if (item != NULL)
+      workq_pool_return(wq, item, last);
+    return status;
+  }
+  if (self == NULL) {
+    item = workq_chain_alloc(wq, NULL, elements, count, &last);
+    if (item == NULL) {
       pthread_mutex_unlock(&wq->mutex);
-      return NULL;
+      return ENOMEM;
     }
-
+  }
+  if (item != NULL) {
     /*
-     * If there's no more work, and we wait for as long as
-     * we're allowed, then terminate this server thread.
+     * Splice the chain onto the end of the queue.
      */
-    if (wq->first == NULL && timedout) {
-      DPRINTF(("engine terminating due to timeout.\n"));
-      wq->counter--;
-      break;
-    }
+    workq_append(wq, item, last, WORKQ_PRIO_DEFAULT);
+    workq_arrival(wq);
+  }
+  status = workq_wake(wq, count);
+  if (status != 0) {
+    pthread_mutex_unlock(&wq->mutex);
+    return status;
   }
+  return pthread_mutex_unlock(&wq->mutex);
+}
 
-  pthread_mutex_unlock(&wq->mutex);
-  DPRINTF(("Worker exiting\n"));
-  return NULL;
+/*
+ * Return the engine context of the calling thread, if it's a
+ * server of the work queue, or NULL. (Routines queued by
+ * workq_submit aren't passed the context.)
+ */
+void*
+workq_context(workq_t* wq)
+{
+  workq_worker_t* self = workq_local(wq);
+
+  return (self != NULL ? self->context : NULL);
 }
 
 /*
- * Initialize a work queue.
+ * Run one queued request on behalf of a server that's waiting
+ * for a task group, taking it as the server's own loop would:
+ * from the ring in WORKQ_RING mode, from the shards (its own
+ * first) in WORKQ_SHARD mode, from the shared queue in
+ * WORKQ_LIST mode, and in WORKQ_STEAL mode from the server's own
+ * deque, then the other servers', then the shared queue. Returns
+ * 0 if there was nothing to run.
+ */
+static int
+workq_help(workq_t* wq, workq_worker_t* self)
+{
+  workq_ele_t item, *we = NULL;
+  int level;
+
+  if (wq->mode == WORKQ_RING) {
+    if (!workq_ring_get(wq->ring, &item))
+      return 0;
+    workq_ring_taken(wq);
+    workq_call(wq, self, &item);
+    return 1;
+  }
+  if (wq->mode == WORKQ_SHARD)
+    we = workq_shard_get(wq, self);
+  else if (wq->mode == WORKQ_STEAL) {
+    we = workq_deque_take(&self->deque);
+    if (we == NULL)
+      we = workq_steal(wq, self);
+  }
+  if (we == NULL && workq_ready(wq) != 0) {
+    if (pthread_mutex_lock(&wq->mutex) != 0)
+      return 0;
+    if (wq->mode == WORKQ_STEAL)
+      we = workq_inject_take(wq, self);
+    else {
+      level = workq_level(wq);
+      if (level >= 0)
+        we = workq_dequeue(wq, level, workq_node(wq, self));
+    }
+    pthread_mutex_unlock(&wq->mutex);
+  }
+  if (we == NULL)
+    return 0;
+  workq_run(wq, self, we);
+  return 1;
+}
+
+/*
+ * Initialize a task group, whose tasks will run on the work
+ * queue "wq".
  */
 int
-workq_init(workq_t* wq, int threads, void (*engine)(void* arg))
+workq_group_init(workq_group_t* group, workq_t* wq)
 {
   int status;
 
-  status = pthread_attr_init(&wq->attr);
+  if (wq->valid != WORKQ_VALID)
+    return EINVAL;
+  status = pthread_mutex_init(&group->mutex, NULL);
   if (status != 0)
     return status;
-  status = pthread_attr_setdetachstate(&wq->attr, PTHREAD_CREATE_DETACHED);
-  if (status != 0) {
-    pthread_attr_destroy(&wq->attr);
-    return status;
-  }
-  status = pthread_mutex_init(&wq->mutex, NULL);
-  if (status != 0) {
-    pthread_attr_destroy(&wq->attr);
-    return status;
-  }
-  status = pthread_cond_init(&wq->cv, NULL);
+  status = pthread_cond_init(&group->cv, NULL);
   if (status != 0) {
-    pthread_mutex_destroy(&wq->mutex);
-    pthread_attr_destroy(&wq->attr);
+    pthread_mutex_destroy(&group->mutex);
     return status;
   }
-  wq->quit  = 0;                  /* not time to quit */
-  wq->first = wq->last = NULL;    /* no queue entries */
-  wq->parallelism      = threads; /* max servers */
-  wq->counter          = 0;       /* no server threads yet */
-  wq->idle             = 0;       /* no idle servers */
-  wq->engine           = engine;
-  wq->valid            = WORKQ_VALID;
+  group->wq = wq;
+  atomic_init(&group->pending, 0);
+  group->waiters = 0;
+  group->valid   = WORKQ_GROUP_VALID;
   return 0;
 }
 
 /*
- * Destroy a work queue.
+ * Destroy a task group. Returns EBUSY if any of its tasks
+ * haven't finished, or a thread is waiting on it.
  */
 int
-workq_destroy(workq_t* wq)
+workq_group_destroy(workq_group_t* group)
 {
-  int status, status1, status2;
+  int status, status1;
 
-  if (wq->valid != WORKQ_VALID)
+  if (group->valid != WORKQ_GROUP_VALID)
     return EINVAL;
-  status = pthread_mutex_lock(&wq->mutex);
+  status = pthread_mutex_lock(&group->mutex);
   if (status != 0)
     return status;
-  wq->valid = 0; /* prevent any other operations */
+  if (atomic_load(&group->pending) > 0 || group->waiters > 0) {
+    pthread_mutex_unlock(&group->mutex);
+    return EBUSY;
+  }
+  group->valid = 0;
+  pthread_mutex_unlock(&group->mutex);
+  status  = pthread_mutex_destroy(&group->mutex);
+  status1 = pthread_cond_destroy(&group->cv);
+  return (status != 0 ? status : status1);
+}
 
-  /*
-   * Check whether any threads are active, and run them down:
-   *
-   * 1.       set the quit flag
-   * 2.       broadcast to wake any servers that may be asleep
-   * 4.       wait for all threads to quit (counter goes to 0)
-   *          Because we don't use join, we don't need to worry
-   *          about tracking thread IDs.
-   */
-  if (wq->counter > 0) {
-    wq->quit = 1;
-    /* if any threads are idling, wake them. */
-    if (wq->idle > 0) {
-      status = pthread_cond_broadcast(&wq->cv);
-      if (status != 0) {
-        pthread_mutex_unlock(&wq->mutex);
-        return status;
-      }
+/*
+ * Queue a call to "routine" (or to the queue's engine, if
+ * routine is NULL) with argument "arg", as a task of the group.
+ * The routine's return value is ignored. A task may itself
+ * spawn tasks, in its own group or another.
+ */
+int
+workq_group_spawn(workq_group_t* group, void* (*routine)(void*), void* arg)
+{
+  int status;
+
+  if (group->valid != WORKQ_GROUP_VALID)
+    return EINVAL;
+  atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+  status = workq_queue(group->wq, NULL, group, routine, arg, NULL);
+  if (status != 0)
+    workq_group_done(group);
+  return status;
+}
+
+/*
+ * Wait for all the tasks spawned in a group to finish. A server
+ * of the group's work queue (that is, a task waiting for the
+ * tasks it spawned) runs queued requests while it waits; any
+ * other thread simply blocks.
+ */
+int
+workq_group_wait(workq_group_t* group)
+{
+  struct timespec nap;
+  workq_worker_t* self;
+  int status = 0, spins = 0;
+
+  if (group->valid != WORKQ_GROUP_VALID)
+    return EINVAL;
+  self = workq_local(group->wq);
+  while (self != NULL
+         && atomic_load_explicit(&group->pending, memory_order_acquire) > 0) {
+    if (workq_help(group->wq, self)) {
+      spins = 0;
+      continue;
+    }
+    if (spins < WORKQ_IDLE_SPINS) {
+      workq_relax(spins++);
+      continue;
     }
 
     /*
-     * Just to prove that every rule has an exception, I'm
-     * using the "cv" condition for two separate predicates
-     * here. That's OK, since the case used here applies
-     * only once during the life of a work queue -- during
-     * rundown. The overhead is minimal and it's not worth
-     * creating a separate condition variable that would be
-     * waited and signalled exactly once!
+     * Nothing to run: the group's tasks are all running on
+     * other servers. Sleep until they finish, but not for long,
+     * in case they spawn more work we could help with.
      */
-    while (wq->counter > 0) {
-      status = pthread_cond_wait(&wq->cv, &wq->mutex);
-      if (status != 0) {
-        pthread_mutex_unlock(&wq->mutex);
-        return status;
+    spins  = 0;
+    status = pthread_mutex_lock(&group->mutex);
+    if (status != 0)
+      return status;
+    if (atomic_load(&group->pending) > 0) {
+      clock_gettime(CLOCK_REALTIME, &nap);
+      nap.tv_nsec += WORKQ_GROUP_NAP * 1000;
+      if (nap.tv_nsec >= 1000000000) {
+        nap.tv_sec++;
+        nap.tv_nsec -= 1000000000;
       }
+      group->waiters++;
+      status = pthread_cond_timedwait(&group->cv, &group->mutex, &nap);
+      group->waiters--;
     }
+    pthread_mutex_unlock(&group->mutex);
+    if (status != 0 && status != ETIMEDOUT)
+      return status;
   }
-  status = pthread_mutex_unlock(&wq->mutex);
+
+  /*
+   * Even when the count is already zero, take the mutex: the
+   * last task's server may still hold it, and we mustn't return
+   * (and let the caller destroy the group) until it lets go.
+   */
+  status = pthread_mutex_lock(&group->mutex);
   if (status != 0)
     return status;
-  status  = pthread_mutex_destroy(&wq->mutex);
-  status1 = pthread_cond_destroy(&wq->cv);
-  status2 = pthread_attr_destroy(&wq->attr);
-  return (status ? status : (status1 ? status1 : status2));
+  group->waiters++;
+  while (atomic_load(&group->pending) > 0) {
+    status = pthread_cond_wait(&group->cv, &group->mutex);
+    if (status != 0)
+      break;
+  }
+  group->waiters--;
+  pthread_mutex_unlock(&group->mutex);
+  return status;
 }
 
 /*
- * Add an item to a work queue.
+ * Report work queue statistics. Counters kept by the server
+ * slots are summed when read.
  */
 int
-workq_add(workq_t* wq, void* element)
+workq_getstats(workq_t* wq, workq_stats_t* stats)
 {
-  workq_ele_t* item;
-  pthread_t id;
-  int status;
+  workq_worker_t* worker;
+  int count, bucket, status;
 
   if (wq->valid != WORKQ_VALID)
     return EINVAL;
-
-  /*
-   * Create and initialize a request structure.
-   */
-  item = (workq_ele_t*) malloc(sizeof(workq_ele_t));
-  if (item == NULL)
-    return ENOMEM;
-  item->data = element;
-  item->next = NULL;
-  status     = pthread_mutex_lock(&wq->mutex);
-  if (status != 0) {
-    free(item);
+  status = pthread_mutex_lock(&wq->mutex);
+  if (status != 0)
     return status;
+  stats->pool_hits       = wq->pool_hits;
+  stats->pool_misses     = wq->pool_misses;
+  stats->thread_creates  = wq->thread_creates;
+  stats->thread_exits    = wq->thread_exits;
+  stats->thread_timeouts = wq->thread_timeouts;
+  stats->wake_idle       = wq->wake_idle;
+  stats->wake_create     = wq->wake_create;
+  stats->parks           = wq->parks;
+  stats->unparks         = wq->unparks;
+  stats->expired         = 0;
+  stats->cancelled       = 0;
+  stats->threads         = wq->counter;
+  stats->idle_timeout    = wq->idle_timeout;
+  stats->enabled         = wq->stats;
+  stats->executed        = 0;
+  stats->depth_max = atomic_load_explicit(&wq->depth_max, memory_order_relaxed);
+  memset(stats->wait, 0, sizeof(stats->wait));
+  memset(stats->run, 0, sizeof(stats->run));
+  for (count = 0; count < wq->parallelism; count++) {
+    worker = &wq->workers[count];
+    stats->pool_hits +=
+        atomic_load_explicit(&worker->pool_hits, memory_order_relaxed);
+    stats->pool_misses +=
+        atomic_load_explicit(&worker->pool_misses, memory_order_relaxed);
+    stats->expired +=
+        atomic_load_explicit(&worker->expired, memory_order_relaxed);
+    stats->cancelled +=
+        atomic_load_explicit(&worker->cancelled, memory_order_relaxed);
+    if (worker->stats == NULL)
+      continue;
+    stats->executed +=
+        atomic_load_explicit(&worker->stats->executed, memory_order_relaxed);
+    for (bucket = 0; bucket < WORKQ_HIST_BUCKETS; bucket++) {
+      stats->wait[bucket] += atomic_load_explicit(&worker->stats->wait[bucket],
+                                                  memory_order_relaxed);
+      stats->run[bucket] += atomic_load_explicit(&worker->stats->run[bucket],
+                                                 memory_order_relaxed);
+    }
+  }
+  for (count = 0; count < wq->nshards; count++) {
+    pthread_mutex_lock(&wq->shards[count].mutex);
+    stats->pool_hits += wq->shards[count].pool_hits;
+    stats->pool_misses += wq->shards[count].pool_misses;
+    pthread_mutex_unlock(&wq->shards[count].mutex);
   }
+  return pthread_mutex_unlock(&wq->mutex);
+}
 
-  /*
-   * Add the request to the end of the queue, updating the
-   * first and last pointers.
-   */
-  if (wq->first == NULL)
-    wq->first = item;
-  else
-    wq->last->next = item;
-  wq->last = item;
+/*
+ * Return the smallest value (in nanoseconds) counted in a
+ * histogram bucket.
+ */
+long
+workq_hist_value(int bucket)
+{
+  if (bucket < WORKQ_HIST_SUB)
+    return bucket;
+  return (long) (WORKQ_HIST_SUB + bucket % WORKQ_HIST_SUB)
+         << (bucket / WORKQ_HIST_SUB - 1);
+}
 
-  /*
-   * if any threads are idling, wake one.
-   */
-  if (wq->idle > 0) {
-    status = pthread_cond_signal(&wq->cv);
-    if (status != 0) {
-      pthread_mutex_unlock(&wq->mutex);
-      return status;
-    }
-  }
-  else if (wq->counter < wq->parallelism) {
-    /*
-     * If there were no idling threads, and we're allowed to
-     * create a new thread, do so.
-     */
-    DPRINTF(("Creating new worker\n"));
-    status = pthread_create(&id, &wq->attr, workq_server, (void*) wq);
-    if (status != 0) {
-      pthread_mutex_unlock(&wq->mutex);
-      return status;
-    }
-    wq->counter++;
+/*
+ * Return the value below which "percent" of the values counted
+ * in a histogram lie: the largest value in the bucket where
+ * that percentile falls. Returns 0 if the histogram is empty.
+ */
+long
+workq_hist_percentile(const unsigned long* hist, double percent)
+{
+  unsigned long total = 0, rank, seen = 0;
+  int bucket;
+
+  for (bucket = 0; bucket < WORKQ_HIST_BUCKETS; bucket++) total += hist[bucket];
+  if (total == 0)
+    return 0;
+  rank = (unsigned long) (total * percent / 100.0);
+  if (rank < 1)
+    rank = 1;
+  for (bucket = 0; bucket < WORKQ_HIST_BUCKETS - 1; bucket++) {
+    seen += hist[bucket];
+    if (seen >= rank)
+      break;
   }
-  pthread_mutex_unlock(&wq->mutex);
+  if (bucket == WORKQ_HIST_BUCKETS - 1)
+    return workq_hist_value(bucket);
+  return workq_hist_value(bucket + 1) - 1;
+}
+
+/*
+ * Print one latency histogram's percentiles, in microseconds.
+ */
+static void
+workq_hist_dump(FILE* file, const char* name, const unsigned long* hist)
+{
+  fprintf(file,
+          "  %s (usec): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+          name,
+          workq_hist_percentile(hist, 50.0) / 1000.0,
+          workq_hist_percentile(hist, 90.0) / 1000.0,
+          workq_hist_percentile(hist, 99.0) / 1000.0,
+          workq_hist_percentile(hist, 99.9) / 1000.0,
+          workq_hist_percentile(hist, 100.0) / 1000.0);
+}
+
+/*
+ * Print a summary of a work queue's statistics.
+ */
+int
+workq_stats_dump(workq_t* wq, FILE* file)
+{
+  workq_stats_t stats;
+  int status;
+
+  status = workq_getstats(wq, &stats);
+  if (status != 0)
+    return status;
+  fprintf(file,
+          "work queue: %d servers, idle timeout %d msec\n",
+          stats.threads,
+          stats.idle_timeout);
+  fprintf(file,
+          "  servers: %lu created, %lu exited, %lu timed out\n",
+          stats.thread_creates,
+          stats.thread_exits,
+          stats.thread_timeouts);
+  fprintf(file,
+          "  wakeups: %lu idle servers woken, %lu servers created\n",
+          stats.wake_idle,
+          stats.wake_create);
+  fprintf(file,
+          "  idle servers: %lu went to sleep, %lu wakeup calls\n",
+          stats.parks,
+          stats.unparks);
+  fprintf(file,
+          "  element pool: %lu hits, %lu misses\n",
+          stats.pool_hits,
+          stats.pool_misses);
+  fprintf(file,
+          "  dropped: %lu expired, %lu cancelled\n",
+          stats.expired,
+          stats.cancelled);
+  if (!stats.enabled)
+    return 0;
+  fprintf(file,
+          "  requests: %lu run, deepest queue %ld\n",
+          stats.executed,
+          stats.depth_max);
+  workq_hist_dump(file, "wait", stats.wait);
+  workq_hist_dump(file, "run", stats.run);
   return 0;
 }
@@ -19,8 +19,95 @@
  * processing engine until the queue is empty; at that point,
  * processing threads will begin to shut down. (They will be
  * restarted when work appears.)
+ *
+ * A server that runs out of work polls for more for a little
+ * while, and then sleeps on an "eventcount", which a thread
+ * queueing work wakes with a system call only if a server is
+ * actually asleep. The WORKQ_WAKE_SIGNAL attribute instead has
+ * idle servers wait on a condition variable at once, and signals
+ * it for each request while any server is idle, as the work
+ * queue used to; it's there for comparison.
+ *
+ * By default all servers share a single queue protected by one
+ * mutex. A work queue created with the WORKQ_STEAL mode instead
+ * gives each server thread its own work-stealing deque: work
+ * queued by a server goes onto its own deque, work queued by
+ * other threads goes onto the shared queue, and a server that
+ * runs out of work steals from the others.
+ *
+ * Queue elements are allocated from a pool kept by each work
+ * queue, so workq_add doesn't normally call malloc.
+ *
+ * A work queue created with the WORKQ_RING mode instead queues
+ * requests on a fixed-size lock-free ring. When the ring is
+ * full, workq_add blocks, fails with EAGAIN, or spins for a
+ * while and then blocks, as the queue's "full policy" says.
+ * workq_add_batch queues a batch all or nothing, so it refuses
+ * (EINVAL) a batch larger than the ring. Requests on a ring are
+ * served in order, whatever their priority.
+ *
+ * A work queue created with the WORKQ_SHARD mode splits the
+ * shared queue into several "shards", each with its own mutex.
+ * workq_add puts each request on the shorter of two shards
+ * chosen at random, and each server serves one shard first and
+ * then looks at the others in turn. Like the ring, the shards
+ * ignore priorities.
+ *
+ * workq_submit queues a call to a routine that returns a
+ * result, and returns a completion handle on which the caller
+ * can wait for that result. A request that hasn't started yet
+ * can be cancelled through its handle, and a request may be
+ * given a deadline, after which it's dropped rather than run.
+ *
+ * workq_destroy runs every request already queued before it
+ * tears the work queue down. workq_shutdown can instead abandon
+ * the requests that haven't started, handing them back to the
+ * caller, either at once or when a time limit on draining the
+ * queue passes. workq_quiesce waits for the work queue to run
+ * out of work, without tearing it down.
+ *
+ * A work queue created with workq_init_context passes its engine
+ * a context pointer as well as the request: each server thread
+ * calls the context init routine (set in the attributes) when it
+ * starts, and the fini routine when it exits, so that an engine
+ * can keep scratch buffers and counters for its thread without
+ * looking them up on every call.
+ *
+ * A task group collects fork-join tasks: workq_group_spawn
+ * queues a call in the group, and workq_group_wait waits for all
+ * of the group's tasks to finish. A server of the queue that
+ * waits on a group runs queued requests itself while it waits
+ * ("help first"), rather than blocking, so that tasks can spawn
+ * and wait for subtasks, to any depth, without needing a server
+ * thread per level of nesting.
+ *
+ * Each request has one of WORKQ_PRIORITIES priorities, set
+ * with a request attributes object; servers take the oldest
+ * request of the highest priority. An optional aging interval
+ * raises the effective priority of waiting requests so that
+ * low priorities can't starve.
+ *
+ * On Linux, servers can be placed on particular CPUs: packed
+ * onto as few cores and nodes as possible, spread over them, or
+ * confined to a given set of CPUs. The topology is read from
+ * /sys/devices/system. Servers placed on a NUMA node prefer
+ * requests queued by threads running on the same node.
+ *
+ * A work queue created with statistics on also records how long
+ * requests wait to be run and how long they run, in histograms,
+ * and the deepest its queue has been. workq_stats_dump prints a
+ * summary of them.
  */
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Completion handle for a request; private to workq.c
+ */
+typedef struct workq_handle_tag workq_handle_t;
 
 /*
  * Structure to keep track of work queue requests.
@@ -28,31 +115,324 @@
 typedef struct workq_ele_tag {
   struct workq_ele_tag* next;
   void* data;
+  void* (*routine)(void*); /* if not the engine */
+  workq_handle_t* handle;  /* completion handle, if any */
+  struct timespec queued;        /* time queued, when aging */
+  struct timespec deadline;      /* drop if not started by then, or 0 */
+  int node;                      /* NUMA node of submitter, or -1 */
+  struct workq_group_tag* group; /* task group, if spawned in one */
 } workq_ele_t;
 
+/*
+ * Work queue modes
+ */
+#define WORKQ_LIST 0  /* one queue shared by all servers */
+#define WORKQ_STEAL 1 /* per-server work-stealing deques */
+#define WORKQ_RING 2  /* bounded lock-free ring */
+#define WORKQ_SHARD 3 /* several queues, each with its own mutex */
+
+/*
+ * What workq_add does when a WORKQ_RING queue is full
+ */
+#define WORKQ_FULL_BLOCK 0 /* wait for room */
+#define WORKQ_FULL_FAIL 1  /* return EAGAIN */
+#define WORKQ_FULL_SPIN 2  /* retry for a while, then wait */
+
+/*
+ * How idle servers sleep, and are woken
+ */
+#define WORKQ_WAKE_EVENT 0  /* poll, then sleep on the eventcount */
+#define WORKQ_WAKE_SIGNAL 1 /* sleep on "cv", signalled per request */
+
+/*
+ * What workq_shutdown does with requests that haven't started
+ */
+#define WORKQ_DRAIN 0   /* run them, as workq_destroy does */
+#define WORKQ_ABANDON 1 /* hand them back to the caller */
+
+/*
+ * Request priorities: higher priorities are served first.
+ */
+#define WORKQ_PRIORITIES 4
+#define WORKQ_PRIO_LOW 0
+#define WORKQ_PRIO_DEFAULT 1
+#define WORKQ_PRIO_HIGH (WORKQ_PRIORITIES - 1)
+
+/*
+ * Server placement policies
+ */
+#define WORKQ_AFFINITY_NONE 0    /* let the system place servers */
+#define WORKQ_AFFINITY_COMPACT 1 /* one per CPU, filling cores and nodes */
+#define WORKQ_AFFINITY_SCATTER 2 /* one per CPU, spread over nodes/cores */
+#define WORKQ_AFFINITY_CPUSET 3  /* all confined to the attribute's CPUs */
+
+#define WORKQ_MAX_CPUS 1024
+
+/*
+ * Latency histograms have WORKQ_HIST_SUB buckets for each power
+ * of 2 nanoseconds, so that each bucket is no wider than 1/8th
+ * of the values it counts, up to 2^40 nsec (about 18 minutes).
+ */
+#define WORKQ_HIST_SUB_BITS 3
+#define WORKQ_HIST_SUB (1 << WORKQ_HIST_SUB_BITS)
+#define WORKQ_HIST_BUCKETS (39 * WORKQ_HIST_SUB)
+
+/*
+ * Structure describing work queue creation attributes.
+ */
+typedef struct workq_attr_tag {
+  int valid;                              /* set when valid */
+  int mode;                               /* WORKQ_LIST etc. */
+  int capacity;                           /* ring size (WORKQ_RING) */
+  int full;                               /* full policy (WORKQ_RING) */
+  int wakeup;                             /* WORKQ_WAKE_EVENT etc. */
+  int shards;                             /* shards (WORKQ_SHARD), or 0 */
+  int min_threads;                        /* resident servers */
+  int idle_min;                           /* idle timeout bounds (msec) */
+  int idle_max;
+  int aging;                              /* msec per priority step, or 0 */
+  int affinity;                           /* WORKQ_AFFINITY_NONE etc. */
+  int ncpus;                              /* CPUs in "cpus", 0 for all */
+  unsigned char cpus[WORKQ_MAX_CPUS / 8]; /* CPUs servers may use */
+  int stats;                              /* keep statistics */
+  void* (*context_init)(void*);           /* per-server context */
+  void (*context_fini)(void*, void*);
+  void* context_arg;                      /* argument for both */
+} workq_attr_t;
+
+#define WORKQ_ATTR_VALID 0xdec1993
+
+/*
+ * Structure describing the attributes of a request.
+ */
+typedef struct workq_reqattr_tag {
+  int valid;                /* set when valid */
+  int priority;             /* 0 to WORKQ_PRIORITIES - 1 */
+  struct timespec deadline; /* CLOCK_REALTIME, or 0 for none */
+} workq_reqattr_t;
+
+#define WORKQ_REQATTR_VALID 0xdec1994
+
+/*
+ * Work queue statistics, returned by workq_getstats.
+ */
+typedef struct workq_stats_tag {
+  unsigned long pool_hits;                /* elements reused from the pool */
+  unsigned long pool_misses;              /* elements that required a malloc */
+  unsigned long thread_creates;           /* servers started */
+  unsigned long thread_exits;             /* servers shut down */
+  unsigned long thread_timeouts;          /* servers that exited idle */
+  unsigned long wake_idle;                /* idle servers woken for work */
+  unsigned long wake_create;              /* servers started for work */
+  unsigned long parks;                    /* sleeps by idle servers */
+  unsigned long unparks;                  /* wakeups needing a system call */
+  unsigned long expired;                  /* requests dropped at deadline */
+  unsigned long cancelled;                /* cancelled requests dropped */
+  int threads;                            /* current servers */
+  int idle_timeout;                       /* current idle timeout (msec) */
+  int enabled;                            /* statistics below are kept */
+  unsigned long executed;                 /* requests run */
+  long depth_max;                         /* deepest queue */
+  unsigned long wait[WORKQ_HIST_BUCKETS]; /* time queued (nsec) */
+  unsigned long run[WORKQ_HIST_BUCKETS];  /* time running (nsec) */
+} workq_stats_t;
+
+/*
+ * Per-server state and slabs; private to workq.c
+ */
+struct workq_worker_tag;
+struct workq_slab_tag;
+struct workq_hslab_tag;
+struct workq_ring_tag;
+struct workq_shard_tag;
+
 /*
  * Structure describing a work queue.
  */
 typedef struct workq_tag {
   pthread_mutex_t mutex;
-  pthread_cond_t cv;         /* wait for work */
-  pthread_attr_t attr;       /* create detached threads */
-  workq_ele_t *first, *last; /* work queue */
-  int valid;                 /* set when valid */
-  int quit;                  /* set when workq should quit */
-  int parallelism;           /* number of threads required */
-  int counter;               /* current number of threads */
-  int idle;                  /* number of idle threads */
-  void (*engine)(void* arg); /* user engine */
+  pthread_cond_t cv;                       /* wait for work */
+  pthread_attr_t attr;                     /* create detached threads */
+  workq_ele_t* first[WORKQ_PRIORITIES];    /* work queue, per priority */
+  workq_ele_t* last[WORKQ_PRIORITIES];
+  atomic_uint ready;                       /* priorities with work queued */
+  int aging;                               /* msec per priority step */
+  int affinity;                            /* server placement policy */
+  int nodes;                               /* NUMA nodes used by servers */
+  int ncpus;                               /* length of cpus */
+  int* cpus;                               /* CPU for each server slot */
+  int cpu_max;                             /* length of cpu_node */
+  int* cpu_node;                           /* NUMA node of each CPU */
+  int valid;                               /* set when valid */
+  int quit;                                /* set when workq should quit */
+  int parallelism;                         /* number of threads required */
+  atomic_int counter;                      /* current number of threads */
+  atomic_int idle;                         /* number of idle threads */
+  atomic_uint epoch;                       /* eventcount for idle servers */
+  atomic_int sleepers;                     /* idle servers asleep */
+  int wakeups;                             /* servers woken, not yet up */
+  int wakeup;                              /* WORKQ_WAKE_EVENT etc. */
+  int idle_spins;                          /* polls for work before sleep */
+  void (*engine)(void* arg);               /* user engine */
+  void (*engine_ctx)(void*, void*);        /* or one taking a context */
+  void* (*context_init)(void*);            /* per-server context */
+  void (*context_fini)(void*, void*);
+  void* context_arg;                       /* argument for both */
+  int alive;                               /* threads yet to exit */
+  int mode;                                /* WORKQ_LIST etc. */
+  struct workq_worker_tag* workers;        /* server slots */
+  struct workq_ring_tag* ring;             /* request ring (WORKQ_RING) */
+  int full;                                /* full policy (WORKQ_RING) */
+  pthread_cond_t space;                    /* wait for room on ring */
+  atomic_int full_waiters;                 /* threads waiting for room */
+  struct workq_shard_tag* shards;          /* queues (WORKQ_SHARD) */
+  int nshards;                             /* length of shards */
+  workq_ele_t* free;                       /* element pool (under mutex) */
+  _Atomic(workq_ele_t*) returned;          /* elements freed by servers */
+  _Atomic(struct workq_slab_tag*) slabs;   /* element memory */
+  unsigned long pool_hits;                 /* pool allocations (under mutex) */
+  unsigned long pool_misses;               /* slab allocations (under mutex) */
+  int min_threads;                         /* resident servers */
+  int idle_min, idle_max;                  /* idle timeout bounds (msec) */
+  int idle_timeout;                        /* current idle timeout (msec) */
+  atomic_long arrival;                     /* time of last request (usec) */
+  atomic_long lull;                        /* average lull (usec) */
+  unsigned long thread_creates;            /* servers started */
+  unsigned long thread_exits;              /* servers shut down */
+  unsigned long thread_timeouts;           /* servers that exited idle */
+  unsigned long wake_idle;                 /* idle servers woken */
+  unsigned long wake_create;               /* servers started for work */
+  unsigned long parks;                     /* sleeps by idle servers */
+  unsigned long unparks;                   /* wakeup system calls */
+  int stats;                               /* keep statistics */
+  long depth;                              /* shared queue length */
+  atomic_long depth_max;                   /* deepest queue */
+  workq_handle_t* hfree;                   /* handle pool (under mutex) */
+  _Atomic(workq_handle_t*) hreturned;      /* handles released */
+  _Atomic(struct workq_hslab_tag*) hslabs; /* handle memory */
+  pthread_cond_t quiet;                    /* wait for work to run out */
+  int quiescers;                           /* threads waiting on quiet */
+  atomic_int abandon;                      /* drop requests not started */
+  void (*abandoned)(void*, void*);         /* given dropped requests */
+  void* abandoned_arg;                     /* argument for abandoned */
 } workq_t;
 
 #define WORKQ_VALID 0xdec1992
 
+/*
+ * Structure describing a task group: the tasks spawned in it
+ * that haven't yet finished.
+ */
+typedef struct workq_group_tag {
+  pthread_mutex_t mutex;
+  pthread_cond_t cv;   /* wait for tasks to finish */
+  workq_t* wq;         /* queue the tasks run on */
+  atomic_long pending; /* tasks spawned, not yet finished */
+  int waiters;         /* threads waiting on cv */
+  int valid;           /* set when valid */
+} workq_group_t;
+
+#define WORKQ_GROUP_VALID 0xdec1995
+
 /*
  * Define work queue functions
  */
+extern int workq_attr_init(workq_attr_t* attr);
+extern int workq_attr_destroy(workq_attr_t* attr);
+extern int workq_attr_setmode(workq_attr_t* attr, int mode);
+extern int workq_attr_getmode(const workq_attr_t* attr, int* mode);
+extern int workq_attr_setcapacity(workq_attr_t* attr, int size);
+extern int workq_attr_getcapacity(const workq_attr_t* attr, int* size);
+extern int workq_attr_setfullpolicy(workq_attr_t* attr, int policy);
+extern int workq_attr_getfullpolicy(const workq_attr_t* attr, int* policy);
+extern int workq_attr_setwakeup(workq_attr_t* attr, int wakeup);
+extern int workq_attr_getwakeup(const workq_attr_t* attr, int* wakeup);
+extern int workq_attr_setshards(workq_attr_t* attr, int shards);
+extern int workq_attr_getshards(const workq_attr_t* attr, int* shards);
+extern int workq_attr_setminthreads(workq_attr_t* attr, int threads);
+extern int workq_attr_getminthreads(const workq_attr_t* attr, int* threads);
+extern int workq_attr_setidletimeout(workq_attr_t* attr,
+                                     int min_msec,
+                                     int max_msec);
+extern int workq_attr_getidletimeout(const workq_attr_t* attr,
+                                     int* min_msec,
+                                     int* max_msec);
+extern int workq_attr_setaging(workq_attr_t* attr, int msec);
+extern int workq_attr_getaging(const workq_attr_t* attr, int* msec);
+extern int workq_attr_setaffinity(workq_attr_t* attr, int policy);
+extern int workq_attr_getaffinity(const workq_attr_t* attr, int* policy);
+extern int workq_attr_setcpus(workq_attr_t* attr, const int* cpus, int count);
+extern int workq_attr_getcpus(const workq_attr_t* attr,
+                              int* cpus,
+                              int size,
+                              int* count);
+extern int workq_attr_setstats(workq_attr_t* attr, int stats);
+extern int workq_attr_getstats(const workq_attr_t* attr, int* stats);
+extern int workq_attr_setcontext(workq_attr_t* attr,
+                                 void* (*init)(void* arg),
+                                 void (*fini)(void* context, void* arg),
+                                 void* arg);
+extern int workq_attr_getcontext(const workq_attr_t* attr,
+                                 void* (**init)(void* arg),
+                                 void (**fini)(void* context, void* arg),
+                                 void** arg);
+extern int workq_reqattr_init(workq_reqattr_t* attr);
+extern int workq_reqattr_destroy(workq_reqattr_t* attr);
+extern int workq_reqattr_setpriority(workq_reqattr_t* attr, int priority);
+extern int workq_reqattr_getpriority(const workq_reqattr_t* attr,
+                                     int* priority);
+extern int workq_reqattr_setdeadline(workq_reqattr_t* attr,
+                                     const struct timespec* abstime);
+extern int workq_reqattr_getdeadline(const workq_reqattr_t* attr,
+                                     struct timespec* abstime);
 extern int workq_init(workq_t* wq,
                       int threads,            /* maximum threads */
                       void (*engine)(void*)); /* engine routine */
+extern int workq_init_attr(workq_t* wq,
+                           const workq_attr_t* attr, /* NULL for defaults */
+                           int threads,
+                           void (*engine)(void*));
+extern int workq_init_context(workq_t* wq,
+                              const workq_attr_t* attr,
+                              int threads,
+                              void (*engine)(void* context, void* data));
 extern int workq_destroy(workq_t* wq);
+extern int workq_shutdown(workq_t* wq,
+                          int how, /* WORKQ_DRAIN or WORKQ_ABANDON */
+                          const struct timespec* abstime,
+                          void (*abandoned)(void* data, void* arg),
+                          void* arg);
+extern int workq_quiesce(workq_t* wq);
+extern int workq_timedquiesce(workq_t* wq, const struct timespec* abstime);
 extern int workq_add(workq_t* wq, void* data);
+extern int workq_add_attr(workq_t* wq,
+                          const workq_reqattr_t* attr,
+                          void* data);
+extern int workq_add_batch(workq_t* wq, void** data, size_t count);
+extern int workq_submit(workq_t* wq,
+                        void* (*routine)(void*), /* NULL for engine */
+                        void* arg,
+                        workq_handle_t** handle);
+extern int workq_submit_attr(workq_t* wq,
+                             const workq_reqattr_t* attr,
+                             void* (*routine)(void*),
+                             void* arg,
+                             workq_handle_t** handle);
+extern int workq_wait(workq_handle_t* handle, void** result);
+extern int workq_trywait(workq_handle_t* handle, void** result);
+extern int workq_timedwait(workq_handle_t* handle,
+                           const struct timespec* abstime,
+                           void** result);
+extern int workq_release(workq_handle_t* handle);
+extern int workq_cancel(workq_handle_t* handle);
+extern void* workq_context(workq_t* wq);
+extern int workq_group_init(workq_group_t* group, workq_t* wq);
+extern int workq_group_destroy(workq_group_t* group);
+extern int workq_group_spawn(workq_group_t* group,
+                             void* (*routine)(void*),
+                             void* arg);
+extern int workq_group_wait(workq_group_t* group);
+extern int workq_getstats(workq_t* wq, workq_stats_t* stats);
+extern int workq_stats_dump(workq_t* wq, FILE* file);
+extern long workq_hist_value(int bucket);
+extern long workq_hist_percentile(const unsigned long* hist, double percent);
@@ -0,0 +1,136 @@
+/*
+ * workq_batch_main.c
+ *
+ * Compare queueing work one request at a time, with workq_add,
+ * against queueing it in batches with workq_add_batch.
+ *
+ * Each run queues ITEMS trivial requests from one thread, and
+ * waits for the servers to finish them all. Run with an argument
+ * of "steal" to use a WORKQ_STEAL work queue, or "ring" to use
+ * a WORKQ_RING work queue, whose ring holds RING requests: as
+ * many as the largest batch, which workq_add_batch would
+ * otherwise refuse.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "errors.h"
+#include "workq.h"
+
+#define ITEMS 1000000
+#define THREADS 4
+#define RING 4096
+
+atomic_long completed;
+pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t done_cv     = PTHREAD_COND_INITIALIZER;
+void* items[ITEMS];
+
+/*
+ * Engine routine: count the request, and wake main when the
+ * last one is done.
+ */
+void
+engine_routine(void* arg)
+{
+  if (atomic_fetch_add(&completed, 1) + 1 == ITEMS) {
+    pthread_mutex_lock(&done_mutex);
+    pthread_cond_signal(&done_cv);
+    pthread_mutex_unlock(&done_mutex);
+  }
+}
+
+/*
+ * Return the time in seconds since an arbitrary starting point.
+ */
+double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Queue ITEMS requests, "batch" at a time (or with workq_add if
+ * batch is 0), and report how long it took to queue and run
+ * them.
+ */
+void
+run(int mode, size_t batch)
+{
+  workq_t workq;
+  workq_attr_t attr;
+  double start, queued, finished;
+  size_t count, n;
+  int status;
+
+  status = workq_attr_init(&attr);
+  if (status != 0)
+    err_abort(status, "Init work queue attributes");
+  status = workq_attr_setmode(&attr, mode);
+  if (status != 0)
+    err_abort(status, "Set work queue mode");
+  status = workq_attr_setcapacity(&attr, RING);
+  if (status != 0)
+    err_abort(status, "Set ring capacity");
+  status = workq_init_attr(&workq, &attr, THREADS, engine_routine);
+  if (status != 0)
+    err_abort(status, "Init work queue");
+  workq_attr_destroy(&attr);
+  atomic_store(&completed, 0);
+
+  start = now();
+  for (count = 0; count < ITEMS; count += n) {
+    if (batch == 0) {
+      n      = 1;
+      status = workq_add(&workq, items[count]);
+    }
+    else {
+      n      = (ITEMS - count < batch ? ITEMS - count : batch);
+      status = workq_add_batch(&workq, &items[count], n);
+    }
+    if (status != 0)
+      err_abort(status, "Add to work queue");
+  }
+  queued = now();
+
+  pthread_mutex_lock(&done_mutex);
+  while (atomic_load(&completed) < ITEMS)
+    pthread_cond_wait(&done_cv, &done_mutex);
+  pthread_mutex_unlock(&done_mutex);
+  finished = now();
+
+  if (batch == 0)
+    printf("%-20s", "workq_add");
+  else
+    printf("workq_add_batch %-4lu", (unsigned long) batch);
+  printf(" queue %7.3fs  total %7.3fs  %10.0f items/s\n",
+         queued - start,
+         finished - start,
+         ITEMS / (finished - start));
+
+  status = workq_destroy(&workq);
+  if (status != 0)
+    err_abort(status, "Destroy work queue");
+}
+
+int
+main(int argc, char* argv[])
+{
+  static const size_t batches[] = {0, 16, 256, RING};
+  int mode                      = WORKQ_LIST;
+  size_t count;
+
+  if (argc > 1 && strcmp(argv[1], "steal") == 0)
+    mode = WORKQ_STEAL;
+  else if (argc > 1 && strcmp(argv[1], "ring") == 0)
+    mode = WORKQ_RING;
+  for (count = 0; count < ITEMS; count++) items[count] = (void*) count;
+  for (count = 0; count < sizeof(batches) / sizeof(batches[0]); count++)
+    run(mode, batches[count]);
+  return 0;
+}
@@ -0,0 +1,383 @@
+/*
+ * workq_bench_main.c
+ *
+ * Benchmark the work queue modes under a configurable load, and
+ * report the results as CSV or JSON, one record per mode, so
+ * that runs can be compared over time.
+ *
+ * Each of the producer threads queues its share of the items in
+ * bursts, pausing between bursts, and each item burns a given
+ * number of nanoseconds of CPU in the engine. For each mode, the
+ * benchmark reports the throughput, percentiles of the time
+ * items waited on the queue (from the work queue's statistics,
+ * which are kept for every mode alike), and the CPU time used,
+ * both as a share of the machine and per item.
+ *
+ * Options:
+ *
+ *      -p producers    producer threads (1)
+ *      -c consumers    work queue servers (4)
+ *      -n items        items per producer (100000)
+ *      -w nsec         CPU burned per item (1000)
+ *      -b burst        items per burst (1)
+ *      -g usec         pause between bursts (0)
+ *      -m mode         list, steal, ring, shard or all (all)
+ *      -f format       csv or json (csv)
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "errors.h"
+#include "workq.h"
+
+typedef struct config_tag {
+  int producers;      /* producer threads */
+  int consumers;      /* work queue servers */
+  long items;         /* items per producer */
+  long cost;          /* nsec of CPU per item */
+  long burst;         /* items per burst */
+  long gap;           /* usec between bursts */
+  const char* format; /* "csv" or "json" */
+} config_t;
+
+typedef struct result_tag {
+  const char* mode;
+  double seconds;      /* elapsed time */
+  double rate;         /* items per second */
+  long wait[5];        /* p50, p90, p99, p99.9, max (nsec) */
+  long run_p50;        /* median time running (nsec) */
+  double cpu_cores;    /* CPU seconds per second */
+  double cpu_pct;      /* share of all online CPUs */
+  double cpu_per_item; /* CPU nsec per item */
+  workq_stats_t stats;
+} result_t;
+
+config_t config = {1, 4, 100000, 1000, 1, 0, "csv"};
+double loops_per_nsec; /* calibrated spin rate */
+atomic_int go;         /* producers may start */
+atomic_ulong sink;     /* keeps the spin from being optimized out */
+
+/*
+ * Return the time in nanoseconds, on the given clock, since an
+ * arbitrary starting point.
+ */
+long
+nsec_on(clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Burn CPU for "loops" iterations.
+ */
+void
+spin(long loops)
+{
+  unsigned long x = 0;
+  long count;
+
+  for (count = 0; count < loops; count++) x += count ^ (x >> 3);
+  atomic_store_explicit(&sink, x, memory_order_relaxed);
+}
+
+/*
+ * Measure how many spin iterations take a nanosecond of this
+ * thread's CPU time, so that the engine needn't read the clock.
+ */
+void
+calibrate(void)
+{
+  long loops = 1000000, start, elapsed;
+
+  do {
+    loops *= 2;
+    start = nsec_on(CLOCK_THREAD_CPUTIME_ID);
+    spin(loops);
+    elapsed = nsec_on(CLOCK_THREAD_CPUTIME_ID) - start;
+  } while (elapsed < 20000000);
+  loops_per_nsec = (double) loops / elapsed;
+}
+
+/*
+ * Engine routine: burn the configured cost.
+ */
+void
+engine_routine(void* arg)
+{
+  spin((long) (config.cost * loops_per_nsec));
+}
+
+/*
+ * Thread start routine that queues one producer's items, in
+ * bursts.
+ */
+void*
+producer_routine(void* arg)
+{
+  workq_t* wq = (workq_t*) arg;
+  struct timespec gap;
+  long sent = 0, count;
+  int status;
+
+  gap.tv_sec  = config.gap / 1000000;
+  gap.tv_nsec = (config.gap % 1000000) * 1000;
+  while (!atomic_load(&go)) sched_yield();
+  while (sent < config.items) {
+    for (count = 0; count < config.burst && sent < config.items; count++) {
+      status = workq_add(wq, NULL);
+      if (status != 0)
+        err_abort(status, "Add item");
+      sent++;
+    }
+    if (config.gap > 0)
+      nanosleep(&gap, NULL);
+  }
+  return NULL;
+}
+
+/*
+ * Run the load on a work queue of the given mode.
+ */
+void
+run(const char* name, int mode, result_t* result)
+{
+  workq_t workq;
+  workq_attr_t attr;
+  pthread_t* producers;
+  struct rusage before, after;
+  long start, elapsed, items, cpu, ncpus;
+  int count, status;
+
+  producers = (pthread_t*) malloc(config.producers * sizeof(pthread_t));
+  if (producers == NULL)
+    errno_abort("Allocate producers");
+  status = workq_attr_init(&attr);
+  if (status != 0)
+    err_abort(status, "Init work queue attributes");
+  status = workq_attr_setmode(&attr, mode);
+  if (status != 0)
+    err_abort(status, "Set work queue mode");
+  status = workq_attr_setstats(&attr, 1);
+  if (status != 0)
+    err_abort(status, "Set work queue statistics");
+  status = workq_init_attr(&workq, &attr, config.consumers, engine_routine);
+  if (status != 0)
+    err_abort(status, "Init work queue");
+  workq_attr_destroy(&attr);
+
+  atomic_store(&go, 0);
+  for (count = 0; count < config.producers; count++) {
+    status = pthread_create(
+        &producers[count], NULL, producer_routine, (void*) &workq);
+    if (status != 0)
+      err_abort(status, "Create producer");
+  }
+  getrusage(RUSAGE_SELF, &before);
+  start = nsec_on(CLOCK_MONOTONIC);
+  atomic_store(&go, 1);
+  for (count = 0; count < config.producers; count++) {
+    status = pthread_join(producers[count], NULL);
+    if (status != 0)
+      err_abort(status, "Join producer");
+  }
+  status = workq_quiesce(&workq);
+  if (status != 0)
+    err_abort(status, "Quiesce work queue");
+  elapsed = nsec_on(CLOCK_MONOTONIC) - start;
+  getrusage(RUSAGE_SELF, &after);
+  status = workq_getstats(&workq, &result->stats);
+  if (status != 0)
+    err_abort(status, "Get work queue statistics");
+  status = workq_destroy(&workq);
+  if (status != 0)
+    err_abort(status, "Destroy work queue");
+  free(producers);
+
+  items = config.items * config.producers;
+  cpu   = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1000000000L
+        + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) * 1000L
+        + (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000000000L
+        + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) * 1000L;
+  result->mode      = name;
+  result->seconds   = elapsed / 1e9;
+  result->rate      = items / result->seconds;
+  result->wait[0]   = workq_hist_percentile(result->stats.wait, 50.0);
+  result->wait[1]   = workq_hist_percentile(result->stats.wait, 90.0);
+  result->wait[2]   = workq_hist_percentile(result->stats.wait, 99.0);
+  result->wait[3]   = workq_hist_percentile(result->stats.wait, 99.9);
+  result->wait[4]   = workq_hist_percentile(result->stats.wait, 100.0);
+  result->run_p50   = workq_hist_percentile(result->stats.run, 50.0);
+
+  ncpus                = sysconf(_SC_NPROCESSORS_ONLN);
+  result->cpu_cores    = (double) cpu / elapsed;
+  result->cpu_pct      = 100.0 * result->cpu_cores / ncpus;
+  result->cpu_per_item = (double) cpu / items;
+}
+
+/*
+ * Print one result as a CSV row, after the header if "first".
+ */
+void
+print_csv(const result_t* result, int first)
+{
+  if (first)
+    printf("mode,producers,consumers,items,cost_ns,burst,gap_us,seconds,"
+           "items_per_sec,wait_p50_ns,wait_p90_ns,wait_p99_ns,"
+           "wait_p999_ns,wait_max_ns,run_p50_ns,cpu_cores,cpu_pct,"
+           "cpu_ns_per_item,thread_creates,parks,unparks,depth_max\n");
+  printf("%s,%d,%d,%ld,%ld,%ld,%ld,%.6f,%.0f,%ld,%ld,%ld,%ld,%ld,%ld,"
+         "%.3f,%.1f,%.0f,%lu,%lu,%lu,%ld\n",
+         result->mode,
+         config.producers,
+         config.consumers,
+         config.items * config.producers,
+         config.cost,
+         config.burst,
+         config.gap,
+         result->seconds,
+         result->rate,
+         result->wait[0],
+         result->wait[1],
+         result->wait[2],
+         result->wait[3],
+         result->wait[4],
+         result->run_p50,
+         result->cpu_cores,
+         result->cpu_pct,
+         result->cpu_per_item,
+         result->stats.thread_creates,
+         result->stats.parks,
+         result->stats.unparks,
+         result->stats.depth_max);
+}
+
+/*
+ * Print one result as a JSON object, as an element of an array
+ * that's opened if "first" and closed if "last".
+ */
+void
+print_json(const result_t* result, int first, int last)
+{
+  printf("%s  {\"mode\": \"%s\", \"producers\": %d, \"consumers\": %d, "
+         "\"items\": %ld, \"cost_ns\": %ld, \"burst\": %ld, "
+         "\"gap_us\": %ld,\n",
+         (first ? "[\n" : ""),
+         result->mode,
+         config.producers,
+         config.consumers,
+         config.items * config.producers,
+         config.cost,
+         config.burst,
+         config.gap);
+  printf("   \"seconds\": %.6f, \"items_per_sec\": %.0f,\n"
+         "   \"wait_ns\": {\"p50\": %ld, \"p90\": %ld, \"p99\": %ld, "
+         "\"p999\": %ld, \"max\": %ld}, \"run_p50_ns\": %ld,\n",
+         result->seconds,
+         result->rate,
+         result->wait[0],
+         result->wait[1],
+         result->wait[2],
+         result->wait[3],
+         result->wait[4],
+         result->run_p50);
+  printf("   \"cpu_cores\": %.3f, \"cpu_pct\": %.1f, "
+         "\"cpu_ns_per_item\": %.0f,\n"
+         "   \"thread_creates\": %lu, \"parks\": %lu, \"unparks\": %lu, "
+         "\"depth_max\": %ld}%s\n",
+         result->cpu_cores,
+         result->cpu_pct,
+         result->cpu_per_item,
+         result->stats.thread_creates,
+         result->stats.parks,
+         result->stats.unparks,
+         result->stats.depth_max,
+         (last ? "\n]" : ","));
+}
+
+void
+usage(const char* name)
+{
+  fprintf(stderr,
+          "usage: %s [-p producers] [-c consumers] [-n items] [-w nsec]\n"
+          "       [-b burst] [-g usec] [-m list|steal|ring|shard|all]\n"
+          "       [-f csv|json]\n",
+          name);
+  exit(2);
+}
+
+int
+main(int argc, char* argv[])
+{
+  static const char* names[] = {"list", "steal", "ring", "shard"};
+  static const int modes[]   = {
+      WORKQ_LIST, WORKQ_STEAL, WORKQ_RING, WORKQ_SHARD};
+  result_t result;
+  const char* mode = "all";
+  int nmodes       = sizeof(modes) / sizeof(modes[0]);
+  int option, count, first = 1, last;
+
+  while ((option = getopt(argc, argv, "p:c:n:w:b:g:m:f:")) != -1) {
+    switch (option) {
+    case 'p':
+      config.producers = atoi(optarg);
+      break;
+    case 'c':
+      config.consumers = atoi(optarg);
+      break;
+    case 'n':
+      config.items = atol(optarg);
+      break;
+    case 'w':
+      config.cost = atol(optarg);
+      break;
+    case 'b':
+      config.burst = atol(optarg);
+      break;
+    case 'g':
+      config.gap = atol(optarg);
+      break;
+    case 'm':
+      mode = optarg;
+      break;
+    case 'f':
+      config.format = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (config.producers < 1 || config.consumers < 1 || config.items < 1
+      || config.cost < 0 || config.burst < 1 || config.gap < 0
+      || (strcmp(config.format, "csv") != 0
+          && strcmp(config.format, "json") != 0))
+    usage(argv[0]);
+  for (count = 0; count < nmodes; count++) {
+    if (strcmp(mode, "all") == 0 || strcmp(mode, names[count]) == 0)
+      break;
+  }
+  if (count == nmodes)
+    usage(argv[0]);
+
+  calibrate();
+  for (count = 0; count < nmodes; count++) {
+    if (strcmp(mode, "all") != 0 && strcmp(mode, names[count]) != 0)
+      continue;
+    run(names[count], modes[count], &result);
+    last = (strcmp(mode, "all") != 0 || count == nmodes - 1);
+    if (strcmp(config.format, "json") == 0)
+      print_json(&result, first, last);
+    else
+      print_csv(&result, first);
+    fflush(stdout);
+    first = 0;
+  }
+  return 0;
+}
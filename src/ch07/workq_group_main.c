@@ -0,0 +1,238 @@
+/*
+ * workq_group_main.c
+ *
+ * Demonstrate fork-join task groups with a parallel quicksort.
+ * Each task partitions its part of the array, spawns a task to
+ * sort the left half, sorts the right half itself, and waits
+ * for the left half in a task group; parts of no more than
+ * CUTOFF elements are sorted with qsort. Waiting tasks run
+ * queued tasks themselves, so THREADS servers are enough for
+ * any depth of recursion.
+ *
+ * The same array of ELEMENTS random integers is sorted on a
+ * work queue of each mode, and by qsort alone for comparison.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "errors.h"
+#include "workq.h"
+
+#define THREADS 4
+#define ELEMENTS 2000000 /* integers to sort */
+#define CUTOFF 10000     /* sort parts this small with qsort */
+
+typedef struct sort_tag {
+  workq_t* wq;
+  int* base;
+  long count;
+} sort_t;
+
+int original[ELEMENTS];
+int array[ELEMENTS];
+
+/*
+ * Return the time in microseconds since an arbitrary starting
+ * point.
+ */
+long
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int
+compare(const void* a, const void* b)
+{
+  int x = *(const int*) a, y = *(const int*) b;
+
+  return (x > y) - (x < y);
+}
+
+void
+swap(int* a, int* b)
+{
+  int temp = *a;
+
+  *a = *b;
+  *b = temp;
+}
+
+/*
+ * Partition "count" (at least 2) elements around the median of
+ * the first, middle and last, and return the length of the left
+ * part, which is between 1 and count - 1.
+ */
+long
+partition(int* base, long count)
+{
+  long mid = count / 2, i = -1, j = count;
+  int pivot;
+
+  if (base[mid] < base[0])
+    swap(&base[mid], &base[0]);
+  if (base[count - 1] < base[0])
+    swap(&base[count - 1], &base[0]);
+  if (base[count - 1] < base[mid])
+    swap(&base[count - 1], &base[mid]);
+  swap(&base[0], &base[mid]);
+  pivot = base[0];
+
+  while (1) {
+    do
+      i++;
+    while (base[i] < pivot);
+    do
+      j--;
+    while (base[j] > pivot);
+    if (i >= j)
+      return j + 1;
+    swap(&base[i], &base[j]);
+  }
+}
+
+/*
+ * Task routine: sort one part of the array.
+ */
+void*
+sort_task(void* arg)
+{
+  sort_t* part = (sort_t*) arg;
+  sort_t left, right;
+  workq_group_t group;
+  long split;
+  int status;
+
+  if (part->count <= CUTOFF) {
+    qsort(part->base, part->count, sizeof(int), compare);
+    return NULL;
+  }
+  split       = partition(part->base, part->count);
+  left.wq     = part->wq;
+  left.base   = part->base;
+  left.count  = split;
+  right.wq    = part->wq;
+  right.base  = part->base + split;
+  right.count = part->count - split;
+
+  status = workq_group_init(&group, part->wq);
+  if (status != 0)
+    err_abort(status, "Init task group");
+  status = workq_group_spawn(&group, sort_task, &left);
+  if (status == EAGAIN)
+    sort_task(&left); /* ring full: sort it ourselves */
+  else if (status != 0)
+    err_abort(status, "Spawn task");
+  sort_task(&right);
+  status = workq_group_wait(&group);
+  if (status != 0)
+    err_abort(status, "Wait for task group");
+  status = workq_group_destroy(&group);
+  if (status != 0)
+    err_abort(status, "Destroy task group");
+  return NULL;
+}
+
+/*
+ * Check that the array is sorted.
+ */
+int
+sorted(void)
+{
+  long index;
+
+  for (index = 1; index < ELEMENTS; index++)
+    if (array[index - 1] > array[index])
+      return 0;
+  return 1;
+}
+
+/*
+ * Sort the array on a work queue of the given mode, and compare
+ * the time it takes with "serial", the time qsort took.
+ */
+void
+run(const char* name, int mode, long serial)
+{
+  workq_t workq;
+  workq_attr_t attr;
+  workq_group_t group;
+  workq_stats_t stats;
+  sort_t whole;
+  long start, elapsed;
+  int status;
+
+  status = workq_attr_init(&attr);
+  if (status != 0)
+    err_abort(status, "Init work queue attributes");
+  status = workq_attr_setmode(&attr, mode);
+  if (status != 0)
+    err_abort(status, "Set work queue mode");
+  status = workq_attr_setstats(&attr, 1);
+  if (status != 0)
+    err_abort(status, "Set work queue statistics");
+  status = workq_init_attr(&workq, &attr, THREADS, NULL);
+  if (status != 0)
+    err_abort(status, "Init work queue");
+  workq_attr_destroy(&attr);
+
+  memcpy(array, original, sizeof(array));
+  whole.wq    = &workq;
+  whole.base  = array;
+  whole.count = ELEMENTS;
+  start       = now();
+  status      = workq_group_init(&group, &workq);
+  if (status != 0)
+    err_abort(status, "Init task group");
+  status = workq_group_spawn(&group, sort_task, &whole);
+  if (status != 0)
+    err_abort(status, "Spawn task");
+  status = workq_group_wait(&group);
+  if (status != 0)
+    err_abort(status, "Wait for task group");
+  elapsed = now() - start;
+  status  = workq_group_destroy(&group);
+  if (status != 0)
+    err_abort(status, "Destroy task group");
+
+  status = workq_getstats(&workq, &stats);
+  if (status != 0)
+    err_abort(status, "Get work queue statistics");
+  status = workq_destroy(&workq);
+  if (status != 0)
+    err_abort(status, "Destroy work queue");
+  printf("%-6s %8.1f msec  speedup %5.2f  %5lu tasks  %s\n",
+         name,
+         elapsed / 1000.0,
+         (double) serial / elapsed,
+         stats.executed,
+         sorted() ? "sorted" : "NOT SORTED");
+}
+
+int
+main(int argc, char* argv[])
+{
+  long index, start, serial;
+
+  srand(1);
+  for (index = 0; index < ELEMENTS; index++)
+    original[index] = rand();
+
+  memcpy(array, original, sizeof(array));
+  start = now();
+  qsort(array, ELEMENTS, sizeof(int), compare);
+  serial = now() - start;
+  printf("qsort  %8.1f msec\n", serial / 1000.0);
+
+  run("list", WORKQ_LIST, serial);
+  run("steal", WORKQ_STEAL, serial);
+  run("ring", WORKQ_RING, serial);
+  run("shard", WORKQ_SHARD, serial);
+  return 0;
+}
@@ -23,18 +23,35 @@ typedef struct engine_tag {
   int calls;
 } engine_t;
 
-pthread_key_t engine_key; /* Keep track of active engines */
 pthread_mutex_t engine_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 engine_t* engine_list_head        = NULL;
 workq_t workq;
 
 /*
- * Thread-specific data destructor routine for engine_key
+ * Context init routine, called by each work queue server as it
+ * starts, to set up the engine_t it keeps its counts in.
+ */
+void*
+engine_init(void* arg)
+{
+  engine_t* engine;
+
+  engine = (engine_t*) malloc(sizeof(engine_t));
+  if (engine == NULL)
+    errno_abort("Allocate engine");
+  engine->thread_id = pthread_self();
+  engine->calls     = 0;
+  return (void*) engine;
+}
+
+/*
+ * Context fini routine, called by each work queue server as it
+ * exits, to keep track of the engines that have run.
  */
 void
-destructor(void* value_ptr)
+engine_fini(void* context, void* arg)
 {
-  engine_t* engine = (engine_t*) value_ptr;
+  engine_t* engine = (engine_t*) context;
 
   pthread_mutex_lock(&engine_list_mutex);
   engine->link     = engine_list_head;
@@ -44,27 +61,17 @@ destructor(void* value_ptr)
 
 /*
  * This is the routine called by the work queue servers to
- * perform operations in parallel.
+ * perform operations in parallel. The server passes its own
+ * engine_t, so there's no need to look it up.
  */
 void
-engine_routine(void* arg)
+engine_routine(void* context, void* arg)
 {
-  engine_t* engine;
-  power_t* power = (power_t*) arg;
+  engine_t* engine = (engine_t*) context;
+  power_t* power   = (power_t*) arg;
   int result, count;
-  int status;
 
-  engine = pthread_getspecific(engine_key);
-  if (engine == NULL) {
-    engine = (engine_t*) malloc(sizeof(engine_t));
-    status = pthread_setspecific(engine_key, (void*) engine);
-    if (status != 0)
-      err_abort(status, "Set tsd");
-    engine->thread_id = pthread_self();
-    engine->calls     = 1;
-  }
-  else
-    engine->calls++;
+  engine->calls++;
   result = 1;
   printf("Engine: computing %d^%d\n", power->value, power->power);
   for (count = 1; count <= power->power; count++) result *= power->value;
@@ -105,15 +112,33 @@ main(int argc, char* argv[])
 {
   pthread_t thread_id;
   engine_t* engine;
+  workq_attr_t attr;
   int count = 0, calls = 0;
   int status;
 
-  status = pthread_key_create(&engine_key, destructor);
+  status = workq_attr_init(&attr);
   if (status != 0)
-    err_abort(status, "Create key");
-  status = workq_init(&workq, 4, engine_routine);
+    err_abort(status, "Init work queue attributes");
+
+  /*
+   * Run with an argument of "steal" to use per-server
+   * work-stealing deques instead of a single shared queue.
+   */
+  if (argc > 1 && strcmp(argv[1], "steal") == 0) {
+    status = workq_attr_setmode(&attr, WORKQ_STEAL);
+    if (status != 0)
+      err_abort(status, "Set work queue mode");
+  }
+  status = workq_attr_setstats(&attr, 1);
+  if (status != 0)
+    err_abort(status, "Set work queue statistics");
+  status = workq_attr_setcontext(&attr, engine_init, engine_fini, NULL);
+  if (status != 0)
+    err_abort(status, "Set engine context");
+  status = workq_init_context(&workq, &attr, 4, engine_routine);
   if (status != 0)
     err_abort(status, "Init work queue");
+  workq_attr_destroy(&attr);
   status = pthread_create(&thread_id, NULL, thread_routine, NULL);
   if (status != 0)
     err_abort(status, "Create thread");
@@ -121,13 +146,24 @@ main(int argc, char* argv[])
   status = pthread_join(thread_id, NULL);
   if (status != 0)
     err_abort(status, "Join thread");
+
+  /*
+   * Let the servers finish what's queued before reporting, so
+   * that the statistics cover every request.
+   */
+  status = workq_quiesce(&workq);
+  if (status != 0)
+    err_abort(status, "Quiesce work queue");
+  status = workq_stats_dump(&workq, stdout);
+  if (status != 0)
+    err_abort(status, "Dump work queue statistics");
   status = workq_destroy(&workq);
   if (status != 0)
     err_abort(status, "Destroy work queue");
 
   /*
    * By now, all of the engine_t structures have been placed
-   * on the list (by the engine thread destructors), so we
+   * on the list (by the servers' context fini routine), so we
    * can count and summarize them.
    */
   engine = engine_list_head;
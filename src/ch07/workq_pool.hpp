@@ -0,0 +1,557 @@
+#ifndef SRC_CH07_WORKQ_POOL_HPP_
+#define SRC_CH07_WORKQ_POOL_HPP_
+
+/*
+ * workq_pool.hpp
+ *
+ * A C++17 thread pool with the semantics of the work queue
+ * package (workq.h), in a single header. A workq_pool runs
+ * callables on at most "parallelism" server threads. Servers are
+ * created only when work arrives and none is idle, and they
+ * exit after waiting for the "idle timeout" with nothing to do.
+ * Destroying the pool runs everything already queued, and then
+ * waits for the servers to exit.
+ *
+ * Callables are held by a workq_task, a move-only counterpart of
+ * std::function. It stores a callable of up to
+ * workq_task::capacity bytes in place (a "small buffer"), so
+ * posting a small lambda doesn't allocate; larger callables, or
+ * those that might throw when moved, go on the heap. Queue nodes
+ * are kept on a freelist when they're done with, as the C
+ * package pools its queue elements.
+ *
+ * submit returns a workq_future, through which the caller waits
+ * for the callable's result, or the exception it threw. A
+ * std::promise allocates its shared state, and a
+ * std::packaged_task in a copyable std::function needs another
+ * allocation to share it; here the result, the callable and the
+ * synchronization share a single allocation, which is freed
+ * when both the future and the server are done with it.
+ */
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+/*
+ * Move-only wrapper for a callable that takes no arguments.
+ */
+class workq_task {
+ public:
+  static constexpr std::size_t capacity = 6 * sizeof(void*);
+
+  workq_task() noexcept = default;
+
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, workq_task>>>
+  workq_task(F&& f)
+  {
+    using D = std::decay_t<F>;
+
+    if constexpr (fits<D>()) {
+      new (&buffer_) D(std::forward<F>(f));
+      ops_ = &inline_ops<D>;
+    }
+    else {
+      *reinterpret_cast<D**>(&buffer_) = new D(std::forward<F>(f));
+      ops_ = &heap_ops<D>;
+    }
+  }
+
+  workq_task(workq_task&& other) noexcept { take(other); }
+
+  workq_task& operator=(workq_task&& other) noexcept
+  {
+    if (this != &other) {
+      reset();
+      take(other);
+    }
+    return *this;
+  }
+
+  workq_task(const workq_task&) = delete;
+  workq_task& operator=(const workq_task&) = delete;
+
+  ~workq_task() { reset(); }
+
+  explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+  void operator()() { ops_->invoke(&buffer_); }
+
+ private:
+  /*
+   * What to do with the callable in the buffer: "move" moves it
+   * into another buffer and destroys the original.
+   */
+  struct ops_t {
+    void (*invoke)(void* buffer);
+    void (*move)(void* to, void* from);
+    void (*destroy)(void* buffer);
+  };
+
+  template <typename D>
+  static constexpr bool fits()
+  {
+    return sizeof(D) <= capacity && alignof(D) <= alignof(std::max_align_t)
+           && std::is_nothrow_move_constructible_v<D>;
+  }
+
+  template <typename D>
+  static constexpr ops_t inline_ops = {
+      [](void* buffer) { (*static_cast<D*>(buffer))(); },
+      [](void* to, void* from) {
+        new (to) D(std::move(*static_cast<D*>(from)));
+        static_cast<D*>(from)->~D();
+      },
+      [](void* buffer) { static_cast<D*>(buffer)->~D(); }};
+
+  template <typename D>
+  static constexpr ops_t heap_ops = {
+      [](void* buffer) { (**static_cast<D**>(buffer))(); },
+      [](void* to, void* from) {
+        *static_cast<D**>(to) = *static_cast<D**>(from);
+      },
+      [](void* buffer) { delete *static_cast<D**>(buffer); }};
+
+  void take(workq_task& other) noexcept
+  {
+    ops_ = other.ops_;
+    if (ops_ != nullptr) {
+      ops_->move(&buffer_, &other.buffer_);
+      other.ops_ = nullptr;
+    }
+  }
+
+  void reset() noexcept
+  {
+    if (ops_ != nullptr) {
+      ops_->destroy(&buffer_);
+      ops_ = nullptr;
+    }
+  }
+
+  std::aligned_storage_t<capacity, alignof(std::max_align_t)> buffer_;
+  const ops_t* ops_ = nullptr;
+};
+
+/*
+ * The result of a submitted callable: its value, if it has one.
+ */
+template <typename T>
+struct workq_value {
+  std::optional<T> value;
+
+  template <typename F>
+  void set(F& f) { value.emplace(f()); }
+
+  T take() { return std::move(*value); }
+};
+
+template <>
+struct workq_value<void> {
+  template <typename F>
+  void set(F& f) { f(); }
+
+  void take() {}
+};
+
+/*
+ * State shared by a workq_future and the server that runs its
+ * callable. It starts with two references, one for each.
+ */
+template <typename T>
+class workq_state {
+ public:
+  virtual ~workq_state() = default;
+
+  void release() noexcept
+  {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      delete this;
+  }
+
+  bool ready() const noexcept { return done_.load(std::memory_order_acquire); }
+
+  void wait()
+  {
+    if (ready())
+      return;
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return ready(); });
+  }
+
+  template <typename Clock, typename Duration>
+  bool wait_until(const std::chrono::time_point<Clock, Duration>& deadline)
+  {
+    if (ready())
+      return true;
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_until(lock, deadline, [this] { return ready(); });
+  }
+
+  T take()
+  {
+    wait();
+    if (error_)
+      std::rethrow_exception(error_);
+    return result_.take();
+  }
+
+ protected:
+  /*
+   * Record that the callable has returned (or thrown, or will
+   * never run), and wake any waiters.
+   */
+  void finish(std::exception_ptr error) noexcept
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    error_ = error;
+    done_.store(true, std::memory_order_release);
+    cv_.notify_all();
+  }
+
+  workq_value<T> result_;
+
+ private:
+  std::atomic<int> refs_{2};
+  std::atomic<bool> done_{false};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::exception_ptr error_;
+};
+
+/*
+ * A submitted callable and its shared state, in one allocation.
+ */
+template <typename T, typename F>
+class workq_job final : public workq_state<T> {
+ public:
+  template <typename G>
+  explicit workq_job(G&& f) : fn_(std::forward<G>(f)) {}
+
+  void run() noexcept
+  {
+    try {
+      this->result_.set(fn_);
+    }
+    catch (...) {
+      this->finish(std::current_exception());
+      return;
+    }
+    this->finish(nullptr);
+  }
+
+  void abandon() noexcept
+  {
+    this->finish(std::make_exception_ptr(
+        std::future_error(std::future_errc::broken_promise)));
+  }
+
+ private:
+  F fn_;
+};
+
+/*
+ * The task queued for a submitted callable: just a pointer to
+ * its job, so it always fits in a workq_task. If the task is
+ * destroyed without being run, waiters see a broken promise.
+ */
+template <typename T, typename F>
+class workq_runner {
+ public:
+  explicit workq_runner(workq_job<T, F>* job) noexcept : job_(job) {}
+
+  workq_runner(workq_runner&& other) noexcept
+      : job_(std::exchange(other.job_, nullptr)) {}
+
+  workq_runner(const workq_runner&) = delete;
+  workq_runner& operator=(const workq_runner&) = delete;
+  workq_runner& operator=(workq_runner&&) = delete;
+
+  ~workq_runner()
+  {
+    if (job_ != nullptr) {
+      job_->abandon();
+      job_->release();
+    }
+  }
+
+  void operator()()
+  {
+    job_->run();
+    std::exchange(job_, nullptr)->release();
+  }
+
+ private:
+  workq_job<T, F>* job_;
+};
+
+/*
+ * Handle through which to wait for the result of a callable
+ * given to workq_pool::submit. Like std::future, it's move-only
+ * and its result can be taken once.
+ */
+template <typename T>
+class workq_future {
+ public:
+  workq_future() noexcept = default;
+
+  explicit workq_future(workq_state<T>* state) noexcept : state_(state) {}
+
+  workq_future(workq_future&& other) noexcept
+      : state_(std::exchange(other.state_, nullptr)) {}
+
+  workq_future& operator=(workq_future&& other) noexcept
+  {
+    if (this != &other) {
+      if (state_ != nullptr)
+        state_->release();
+      state_ = std::exchange(other.state_, nullptr);
+    }
+    return *this;
+  }
+
+  workq_future(const workq_future&) = delete;
+  workq_future& operator=(const workq_future&) = delete;
+
+  ~workq_future()
+  {
+    if (state_ != nullptr)
+      state_->release();
+  }
+
+  bool valid() const noexcept { return state_ != nullptr; }
+
+  bool ready() const noexcept { return state_->ready(); }
+
+  void wait() const { state_->wait(); }
+
+  template <typename Rep, typename Period>
+  std::future_status wait_for(
+      const std::chrono::duration<Rep, Period>& timeout) const
+  {
+    return wait_until(std::chrono::steady_clock::now() + timeout);
+  }
+
+  template <typename Clock, typename Duration>
+  std::future_status wait_until(
+      const std::chrono::time_point<Clock, Duration>& deadline) const
+  {
+    return (state_->wait_until(deadline) ? std::future_status::ready
+                                         : std::future_status::timeout);
+  }
+
+  /*
+   * Wait for the result, and return it (or throw the exception
+   * the callable threw). The future is no longer valid after.
+   */
+  T get()
+  {
+    workq_future<T> self(std::move(*this));
+
+    return self.state_->take();
+  }
+
+ private:
+  workq_state<T>* state_ = nullptr;
+};
+
+/*
+ * The thread pool.
+ */
+class workq_pool {
+ public:
+  explicit workq_pool(
+      int parallelism                       = default_parallelism(),
+      std::chrono::milliseconds idle_timeout = std::chrono::milliseconds(2000))
+      : parallelism_(parallelism > 0 ? parallelism : 1),
+        idle_timeout_(idle_timeout) {}
+
+  workq_pool(const workq_pool&) = delete;
+  workq_pool& operator=(const workq_pool&) = delete;
+
+  /*
+   * Run everything already queued, and wait for the servers to
+   * exit.
+   */
+  ~workq_pool()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    quit_ = true;
+    if (idle_ > 0)
+      cv_.notify_all();
+    done_.wait(lock, [this] { return counter_ == 0; });
+    while (free_ != nullptr) delete std::exchange(free_, free_->next);
+  }
+
+  /*
+   * Queue a call to "f", whose result is ignored. If it throws,
+   * the program terminates, as it would if "f" were run by a
+   * std::thread.
+   */
+  template <typename F>
+  void post(F&& f) { enqueue(workq_task(std::forward<F>(f))); }
+
+  /*
+   * Queue a call to "f", and return a future for its result.
+   */
+  template <typename F>
+  workq_future<std::invoke_result_t<std::decay_t<F>&>> submit(F&& f)
+  {
+    using T   = std::invoke_result_t<std::decay_t<F>&>;
+    using Job = workq_job<T, std::decay_t<F>>;
+
+    auto job = new Job(std::forward<F>(f));
+    workq_future<T> future(job);
+
+    enqueue(workq_task(workq_runner<T, std::decay_t<F>>(job)));
+    return future;
+  }
+
+  /*
+   * Return the number of server threads.
+   */
+  int threads()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return counter_;
+  }
+
+ private:
+  struct node_t {
+    node_t* next;
+    workq_task task;
+  };
+
+  static int default_parallelism() noexcept
+  {
+    unsigned int cpus = std::thread::hardware_concurrency();
+
+    return (cpus > 0 ? static_cast<int>(cpus) : 1);
+  }
+
+  /*
+   * Queue a task, and make a server available for it: wake an
+   * idle one if there is one, or else start a new one if there
+   * are fewer than "parallelism". A woken server stops counting
+   * as idle at once, so that the next task doesn't count on it.
+   */
+  void enqueue(workq_task&& task)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    node_t* node;
+
+    if (free_ != nullptr) {
+      node       = std::exchange(free_, free_->next);
+      node->task = std::move(task);
+    }
+    else
+      node = new node_t{nullptr, std::move(task)};
+    if (idle_ == 0 && counter_ < parallelism_) {
+      try {
+        std::thread(&workq_pool::server, this).detach();
+        counter_++;
+      }
+      catch (...) {
+        /*
+         * Without a server, the task would never run. Otherwise
+         * the servers there are will get to it.
+         */
+        if (counter_ == 0) {
+          node->task = workq_task();
+          node->next = free_;
+          free_      = node;
+          throw;
+        }
+      }
+    }
+    node->next = nullptr;
+    if (last_ == nullptr)
+      first_ = node;
+    else
+      last_->next = node;
+    last_ = node;
+    if (idle_ > 0) {
+      idle_--;
+      wakeups_++;
+      cv_.notify_one();
+    }
+  }
+
+  /*
+   * Server thread: run tasks until there are none, and then wait
+   * for more, for the idle timeout, before exiting.
+   */
+  void server()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    bool timedout = false;
+
+    while (true) {
+      if (first_ != nullptr) {
+        node_t* node = std::exchange(first_, first_->next);
+        workq_task task(std::move(node->task));
+
+        if (first_ == nullptr)
+          last_ = nullptr;
+        node->next = free_;
+        free_      = node;
+        timedout   = false;
+        lock.unlock();
+        task();
+        task = workq_task();
+        lock.lock();
+        continue;
+      }
+      if (quit_ || timedout)
+        break;
+
+      /*
+       * A server woken by enqueue was taken off "idle" by the
+       * thread that woke it. A server that wakes up by itself
+       * while wakeups are outstanding stands in for one of the
+       * servers woken, since it's no longer idle either.
+       */
+      idle_++;
+      auto deadline = std::chrono::steady_clock::now() + idle_timeout_;
+      auto status   = cv_.wait_until(lock, deadline);
+      if (wakeups_ > 0)
+        wakeups_--;
+      else {
+        idle_--;
+        if (status == std::cv_status::timeout)
+          timedout = true;
+      }
+    }
+
+    counter_--;
+    if (quit_ && counter_ == 0)
+      done_.notify_all();
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;             /* wait for work */
+  std::condition_variable done_;           /* wait for servers to exit */
+  node_t* first_ = nullptr;                /* queued tasks */
+  node_t* last_  = nullptr;
+  node_t* free_  = nullptr;                /* node pool */
+  int parallelism_;                        /* maximum servers */
+  std::chrono::milliseconds idle_timeout_; /* idle wait before exiting */
+  int counter_ = 0;                        /* current servers */
+  int idle_    = 0;                        /* servers waiting for work */
+  int wakeups_ = 0;                        /* servers woken, not yet up */
+  bool quit_   = false;                    /* set when pool should quit */
+};
+
+#endif  // SRC_CH07_WORKQ_POOL_HPP_
@@ -0,0 +1,112 @@
+/*
+ * workq_pool_cpp.cpp
+ *
+ * Demonstrate the C++ thread pool (workq_pool.hpp). Tasks are
+ * submitted for their results, including one that captures a
+ * move-only std::unique_ptr and one that throws; then a batch of
+ * small tasks is posted, and global operator new is counted to
+ * show that posting them doesn't allocate once the pool's queue
+ * nodes are recycled, and that each submit allocates once.
+ */
+#include "workq_pool.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#define THREADS 4
+#define TASKS 10000
+
+std::atomic<long> allocations{0};
+
+void*
+operator new(std::size_t size)
+{
+  void* ptr;
+
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  ptr = std::malloc(size > 0 ? size : 1);
+  if (ptr == nullptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void
+operator delete(void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void
+operator delete(void* ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+
+int
+main(int argc, char* argv[])
+{
+  workq_pool pool(THREADS);
+  std::atomic<long> counter{0};
+  long before, after;
+  int count;
+
+  /*
+   * Submit a callable for its result.
+   */
+  auto square = pool.submit([] { return 7 * 7; });
+  std::cout << "square: " << square.get() << std::endl;
+
+  /*
+   * A move-only callable: std::function couldn't hold this one.
+   */
+  auto owned = std::make_unique<std::string>("moved into the task");
+  auto text  = pool.submit([p = std::move(owned)] { return *p; });
+  std::cout << "text: " << text.get() << std::endl;
+
+  /*
+   * An exception thrown by the callable is rethrown by get.
+   */
+  auto failed =
+      pool.submit([]() -> int { throw std::runtime_error("task failed"); });
+  try {
+    failed.get();
+    std::cout << "no exception?" << std::endl;
+  }
+  catch (const std::exception& e) {
+    std::cout << "exception: " << e.what() << std::endl;
+  }
+
+  /*
+   * Post a batch to fill the node pool, wait for it to finish,
+   * and then count allocations for a second batch.
+   */
+  for (count = 0; count < TASKS; count++)
+    pool.post([&counter] { counter.fetch_add(1); });
+  while (counter.load() < TASKS) std::this_thread::yield();
+
+  before = allocations.load();
+  for (count = 0; count < TASKS; count++)
+    pool.post([&counter] { counter.fetch_add(1); });
+  after = allocations.load();
+  while (counter.load() < 2 * TASKS) std::this_thread::yield();
+  std::cout << "post: " << (double) (after - before) / TASKS
+            << " allocations per task" << std::endl;
+
+  before = allocations.load();
+  for (count = 0; count < TASKS; count++) {
+    auto future = pool.submit([count] { return count; });
+    if (future.get() != count)
+      std::cout << "wrong result" << std::endl;
+  }
+  after = allocations.load();
+  std::cout << "submit: " << (double) (after - before) / TASKS
+            << " allocations per task" << std::endl;
+
+  std::cout << "servers: " << pool.threads() << std::endl;
+  return 0;
+}
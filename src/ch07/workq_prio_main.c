@@ -0,0 +1,200 @@
+/*
+ * workq_prio_main.c
+ *
+ * Measure how long latency-critical requests wait behind bulk
+ * work. A feeder thread keeps BACKLOG low priority "bulk"
+ * requests queued, so that the servers are always busy, while
+ * the main thread queues PROBES "probe" requests, one every
+ * PROBE_GAP microseconds, and each probe notes how long it
+ * waited to start.
+ *
+ * The probes are queued first at the same priority as the bulk
+ * work (plain FIFO), then at WORKQ_PRIO_HIGH, and then at
+ * WORKQ_PRIO_HIGH on a work queue with aging. Run with an
+ * argument of "steal" to use a WORKQ_STEAL work queue.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "errors.h"
+#include "workq.h"
+
+#define THREADS 4
+#define BACKLOG 2000   /* bulk requests kept queued */
+#define BULK_COST 20   /* usec of work per bulk request */
+#define PROBES 500     /* probe requests per run */
+#define PROBE_GAP 1000 /* usec between probes */
+#define AGING 20       /* msec per priority step, for aging run */
+
+typedef struct probe_tag {
+  long queued;  /* time queued (usec) */
+  long latency; /* time until started (usec) */
+} probe_t;
+
+probe_t probes[PROBES];
+atomic_int probes_done;
+atomic_int backlog;
+atomic_int stop;
+atomic_long bulk_done;
+
+/*
+ * Return the time in microseconds since an arbitrary starting
+ * point.
+ */
+long
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * Engine routine. Bulk requests (NULL) burn BULK_COST
+ * microseconds of CPU; probes record their latency.
+ */
+void
+engine_routine(void* arg)
+{
+  probe_t* probe = (probe_t*) arg;
+  long start     = now();
+
+  if (probe == NULL) {
+    while (now() - start < BULK_COST)
+      ;
+    atomic_fetch_sub(&backlog, 1);
+    atomic_fetch_add(&bulk_done, 1);
+  }
+  else {
+    probe->latency = start - probe->queued;
+    atomic_fetch_add(&probes_done, 1);
+  }
+}
+
+/*
+ * Thread start routine that keeps the work queue saturated with
+ * low priority bulk requests.
+ */
+void*
+feeder_routine(void* arg)
+{
+  workq_t* wq = (workq_t*) arg;
+  workq_reqattr_t attr;
+  struct timespec pause = {0, 100000};
+  int status;
+
+  workq_reqattr_init(&attr);
+  workq_reqattr_setpriority(&attr, WORKQ_PRIO_LOW);
+  while (!atomic_load(&stop)) {
+    if (atomic_load(&backlog) >= BACKLOG) {
+      nanosleep(&pause, NULL);
+      continue;
+    }
+    atomic_fetch_add(&backlog, 1);
+    status = workq_add_attr(wq, &attr, NULL);
+    if (status != 0)
+      err_abort(status, "Add bulk request");
+  }
+  workq_reqattr_destroy(&attr);
+  return NULL;
+}
+
+int
+compare_latency(const void* a, const void* b)
+{
+  long la = ((const probe_t*) a)->latency;
+  long lb = ((const probe_t*) b)->latency;
+
+  return (la > lb) - (la < lb);
+}
+
+/*
+ * Run one experiment, queueing probes at "priority" on a work
+ * queue with the given mode and aging interval.
+ */
+void
+run(const char* name, int mode, int priority, int aging)
+{
+  workq_t workq;
+  workq_attr_t attr;
+  workq_reqattr_t reqattr;
+  pthread_t feeder;
+  struct timespec gap = {0, PROBE_GAP * 1000};
+  long start, elapsed;
+  int count, status;
+
+  status = workq_attr_init(&attr);
+  if (status != 0)
+    err_abort(status, "Init work queue attributes");
+  status = workq_attr_setmode(&attr, mode);
+  if (status != 0)
+    err_abort(status, "Set work queue mode");
+  status = workq_attr_setaging(&attr, aging);
+  if (status != 0)
+    err_abort(status, "Set work queue aging");
+  status = workq_init_attr(&workq, &attr, THREADS, engine_routine);
+  if (status != 0)
+    err_abort(status, "Init work queue");
+  workq_attr_destroy(&attr);
+  workq_reqattr_init(&reqattr);
+  status = workq_reqattr_setpriority(&reqattr, priority);
+  if (status != 0)
+    err_abort(status, "Set request priority");
+
+  atomic_store(&probes_done, 0);
+  atomic_store(&backlog, 0);
+  atomic_store(&stop, 0);
+  status = pthread_create(&feeder, NULL, feeder_routine, (void*) &workq);
+  if (status != 0)
+    err_abort(status, "Create feeder");
+
+  /*
+   * Let the backlog build up before the first probe.
+   */
+  while (atomic_load(&backlog) < BACKLOG) sched_yield();
+  atomic_store(&bulk_done, 0);
+  start = now();
+  for (count = 0; count < PROBES; count++) {
+    probes[count].queued = now();
+    status               = workq_add_attr(&workq, &reqattr, &probes[count]);
+    if (status != 0)
+      err_abort(status, "Add probe");
+    nanosleep(&gap, NULL);
+  }
+  while (atomic_load(&probes_done) < PROBES) nanosleep(&gap, NULL);
+  elapsed = now() - start;
+
+  atomic_store(&stop, 1);
+  status = pthread_join(feeder, NULL);
+  if (status != 0)
+    err_abort(status, "Join feeder");
+  status = workq_destroy(&workq);
+  if (status != 0)
+    err_abort(status, "Destroy work queue");
+  workq_reqattr_destroy(&reqattr);
+
+  qsort(probes, PROBES, sizeof(probes[0]), compare_latency);
+  printf("%-22s p50 %8ldus  p99 %8ldus  max %8ldus  bulk %8.0f/s\n",
+         name,
+         probes[PROBES / 2].latency,
+         probes[PROBES * 99 / 100].latency,
+         probes[PROBES - 1].latency,
+         atomic_load(&bulk_done) * 1e6 / elapsed);
+}
+
+int
+main(int argc, char* argv[])
+{
+  int mode = WORKQ_LIST;
+
+  if (argc > 1 && strcmp(argv[1], "steal") == 0)
+    mode = WORKQ_STEAL;
+  run("same priority (FIFO)", mode, WORKQ_PRIO_LOW, 0);
+  run("high priority", mode, WORKQ_PRIO_HIGH, 0);
+  run("high priority, aging", mode, WORKQ_PRIO_HIGH, AGING);
+  return 0;
+}
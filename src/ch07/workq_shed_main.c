@@ -0,0 +1,187 @@
+/*
+ * workq_shed_main.c
+ *
+ * Demonstrate shedding stale work under overload. The main
+ * thread queues REQUESTS requests, one every GAP microseconds,
+ * to a work queue whose servers can't keep up: each request
+ * burns COST microseconds of CPU. Each request notes how long
+ * it waited to start.
+ *
+ * The requests are queued first without deadlines, so the
+ * backlog (and the wait) grows without limit, and then with a
+ * deadline of DEADLINE milliseconds, so that servers drop
+ * requests that have already waited too long instead of
+ * running them. Every CANCEL'th request is submitted with a
+ * completion handle and then cancelled.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "errors.h"
+#include "workq.h"
+
+#define THREADS 2
+#define REQUESTS 4000 /* requests per run */
+#define GAP 50        /* usec between requests */
+#define COST 200      /* usec of work per request */
+#define DEADLINE 10   /* msec a request may wait */
+#define CANCEL 10     /* cancel every CANCEL'th request */
+
+long queued[REQUESTS]; /* time each request was queued (usec) */
+atomic_long waited;    /* total wait of requests run (usec) */
+atomic_long longest;   /* longest wait of a request run (usec) */
+atomic_int started;    /* requests run */
+
+/*
+ * Return the time in microseconds, on the given clock, since an
+ * arbitrary starting point.
+ */
+long
+now_on(clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+long
+now(void)
+{
+  return now_on(CLOCK_MONOTONIC);
+}
+
+/*
+ * Engine routine: note how long the request waited, and burn
+ * COST microseconds of CPU. (CPU time, not elapsed time, so
+ * that the work takes as long whether or not the server is
+ * preempted.)
+ */
+void
+engine_routine(void* arg)
+{
+  long wait = now() - queued[(long) arg];
+  long max  = atomic_load(&longest);
+  long cpu  = now_on(CLOCK_THREAD_CPUTIME_ID);
+
+  atomic_fetch_add(&waited, wait);
+  while (wait > max && !atomic_compare_exchange_weak(&longest, &max, wait))
+    ;
+  atomic_fetch_add(&started, 1);
+  while (now_on(CLOCK_THREAD_CPUTIME_ID) - cpu < COST)
+    ;
+}
+
+/*
+ * Routine for requests that are submitted and then cancelled.
+ */
+void*
+cancelled_routine(void* arg)
+{
+  engine_routine(arg);
+  return arg;
+}
+
+/*
+ * Run the requests, giving them deadlines if "deadlines" is
+ * non-zero.
+ */
+void
+run(const char* name, int deadlines)
+{
+  workq_t workq;
+  workq_attr_t attr;
+  workq_reqattr_t reqattr;
+  workq_handle_t* handle;
+  workq_stats_t stats;
+  struct timespec gap = {0, GAP * 1000}, deadline;
+  long start, elapsed, count;
+  int status;
+
+  status = workq_attr_init(&attr);
+  if (status != 0)
+    err_abort(status, "Init work queue attributes");
+  status = workq_attr_setstats(&attr, 1);
+  if (status != 0)
+    err_abort(status, "Set work queue statistics");
+  status = workq_init_attr(&workq, &attr, THREADS, engine_routine);
+  if (status != 0)
+    err_abort(status, "Init work queue");
+  workq_attr_destroy(&attr);
+  workq_reqattr_init(&reqattr);
+
+  atomic_store(&waited, 0);
+  atomic_store(&longest, 0);
+  atomic_store(&started, 0);
+  start = now();
+  for (count = 0; count < REQUESTS; count++) {
+    queued[count] = now();
+    if (deadlines) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += DEADLINE * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      status = workq_reqattr_setdeadline(&reqattr, &deadline);
+      if (status != 0)
+        err_abort(status, "Set request deadline");
+    }
+    if (count % CANCEL == 0) {
+      status = workq_submit_attr(
+          &workq, &reqattr, cancelled_routine, (void*) count, &handle);
+      if (status != 0)
+        err_abort(status, "Submit request");
+      status = workq_cancel(handle);
+      if (status != 0 && status != EBUSY)
+        err_abort(status, "Cancel request");
+      status = workq_release(handle);
+      if (status != 0)
+        err_abort(status, "Release request");
+    }
+    else {
+      status = workq_add_attr(&workq, &reqattr, (void*) count);
+      if (status != 0)
+        err_abort(status, "Add request");
+    }
+    nanosleep(&gap, NULL);
+  }
+
+  /*
+   * Wait until every request has been run or dropped.
+   */
+  for (;;) {
+    status = workq_getstats(&workq, &stats);
+    if (status != 0)
+      err_abort(status, "Get work queue statistics");
+    if (stats.executed + stats.expired + stats.cancelled >= REQUESTS)
+      break;
+    nanosleep(&gap, NULL);
+  }
+  status = workq_destroy(&workq);
+  if (status != 0)
+    err_abort(status, "Destroy work queue");
+  elapsed = now() - start;
+  workq_reqattr_destroy(&reqattr);
+
+  printf("%-14s ran %4d (avg wait %7.1f msec, max %7.1f msec), "
+         "%4lu expired, %4lu cancelled, %.2f sec\n",
+         name,
+         atomic_load(&started),
+         atomic_load(&waited) / 1000.0 / atomic_load(&started),
+         atomic_load(&longest) / 1000.0,
+         stats.expired,
+         stats.cancelled,
+         elapsed / 1e6);
+}
+
+int
+main(int argc, char* argv[])
+{
+  run("no deadlines", 0);
+  run("deadlines", 1);
+  return 0;
+}
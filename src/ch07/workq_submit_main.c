@@ -0,0 +1,123 @@
+/*
+ * workq_submit_main.c
+ *
+ * Demonstrate work queue completion handles. The main thread
+ * submits a set of power computations, each of which returns
+ * its result, then feeds each result, as it becomes available,
+ * into a second request that sums its decimal digits.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "errors.h"
+#include "workq.h"
+
+#define ITERATIONS 25
+
+workq_t workq;
+
+/*
+ * Compute value^power, where the argument encodes value * 10 +
+ * power.
+ */
+void*
+power_routine(void* arg)
+{
+  intptr_t value = (intptr_t) arg / 10, power = (intptr_t) arg % 10;
+  intptr_t result = 1;
+
+  while (power-- > 0) result *= value;
+  return (void*) result;
+}
+
+/*
+ * Sum the decimal digits of the argument.
+ */
+void*
+digits_routine(void* arg)
+{
+  intptr_t value = (intptr_t) arg, sum = 0;
+
+  for (; value > 0; value /= 10) sum += value % 10;
+  return (void*) sum;
+}
+
+int
+main(int argc, char* argv[])
+{
+  workq_handle_t* powers[ITERATIONS];
+  workq_handle_t* digits[ITERATIONS];
+  struct timespec deadline;
+  unsigned int seed = (unsigned int) time(NULL);
+  intptr_t args[ITERATIONS];
+  void* result;
+  int count, pending = 0;
+  int status;
+
+  status = workq_init(&workq, 4, NULL);
+  if (status != 0)
+    err_abort(status, "Init work queue");
+
+  for (count = 0; count < ITERATIONS; count++) {
+    args[count] = (rand_r(&seed) % 20) * 10 + rand_r(&seed) % 7;
+    status      = workq_submit(
+        &workq, power_routine, (void*) args[count], &powers[count]);
+    if (status != 0)
+      err_abort(status, "Submit power");
+    digits[count] = NULL;
+    pending++;
+  }
+
+  /*
+   * Start the second stage for whichever computations have
+   * finished, without blocking; then wait (a second at a time)
+   * for the rest.
+   */
+  while (pending > 0) {
+    for (count = 0; count < ITERATIONS; count++) {
+      if (digits[count] != NULL)
+        continue;
+      status = workq_trywait(powers[count], &result);
+      if (status == EBUSY)
+        continue;
+      else if (status != 0)
+        err_abort(status, "Try wait");
+      status = workq_submit(&workq, digits_routine, result, &digits[count]);
+      if (status != 0)
+        err_abort(status, "Submit digits");
+      pending--;
+    }
+    if (pending > 0) {
+      for (count = 0; digits[count] != NULL; count++)
+        ;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += 1;
+      status = workq_timedwait(powers[count], &deadline, NULL);
+      if (status != 0 && status != ETIMEDOUT)
+        err_abort(status, "Timed wait");
+    }
+  }
+
+  for (count = 0; count < ITERATIONS; count++) {
+    status = workq_wait(powers[count], &result);
+    if (status != 0)
+      err_abort(status, "Wait power");
+    printf("%2ld^%ld = %8ld",
+           (long) args[count] / 10,
+           (long) args[count] % 10,
+           (long) (intptr_t) result);
+    status = workq_wait(digits[count], &result);
+    if (status != 0)
+      err_abort(status, "Wait digits");
+    printf(", digits sum to %ld\n", (long) (intptr_t) result);
+    workq_release(powers[count]);
+    workq_release(digits[count]);
+  }
+
+  status = workq_destroy(&workq);
+  if (status != 0)
+    err_abort(status, "Destroy work queue");
+  return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * workq_wake_main.c
+ *
+ * Measure what it costs a work queue to wake its servers. The
+ * main thread queues BURSTS bursts of BURST requests, pausing
+ * for GAP microseconds between bursts so that the servers run
+ * out of work and go idle, and each request burns COST
+ * microseconds of CPU.
+ *
+ * Each work queue mode is run twice: with the eventcount
+ * ("event"), on which idle servers sleep after polling for work
+ * for a while, and which makes a system call to wake them only
+ * if one is asleep; and with the condition variable signal under
+ * the mutex that it replaced ("signal"), made for each request
+ * while any server is idle (WORKQ_WAKE_SIGNAL).
+ *
+ * For each, report the number of servers created, the number of
+ * times idle servers went to sleep and the number of calls made
+ * to wake them (futex wakes, or condition variable signals and
+ * broadcasts), and the context switches of the whole process,
+ * per request.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "errors.h"
+#include "workq.h"
+
+#define THREADS 4
+#define BURSTS 200 /* bursts of requests */
+#define BURST 50   /* requests per burst */
+#define GAP 2000   /* usec between bursts */
+#define COST 5     /* usec of work per request */
+#define IDLE 20    /* server idle timeout (msec) */
+
+/*
+ * Return the time in microseconds since an arbitrary starting
+ * point.
+ */
+long
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * Engine routine: burn COST microseconds of CPU.
+ */
+void
+engine_routine(void* arg)
+{
+  long start = now();
+
+  while (now() - start < COST)
+    ;
+}
+
+/*
+ * Run the bursts on a work queue of the given mode, waking its
+ * servers as "wakeup" says.
+ */
+void
+run(const char* name, int mode, int wakeup)
+{
+  workq_t workq;
+  workq_attr_t attr;
+  workq_stats_t stats;
+  struct rusage before, after;
+  struct timespec gap = {0, GAP * 1000};
+  long start, elapsed, switches;
+  int burst, count, status;
+  double items = (double) BURSTS * BURST;
+
+  status = workq_attr_init(&attr);
+  if (status != 0)
+    err_abort(status, "Init work queue attributes");
+  status = workq_attr_setmode(&attr, mode);
+  if (status != 0)
+    err_abort(status, "Set work queue mode");
+  status = workq_attr_setwakeup(&attr, wakeup);
+  if (status != 0)
+    err_abort(status, "Set wakeup");
+  status = workq_attr_setidletimeout(&attr, IDLE, IDLE);
+  if (status != 0)
+    err_abort(status, "Set idle timeout");
+  status = workq_init_attr(&workq, &attr, THREADS, engine_routine);
+  if (status != 0)
+    err_abort(status, "Init work queue");
+  workq_attr_destroy(&attr);
+
+  getrusage(RUSAGE_SELF, &before);
+  start = now();
+  for (burst = 0; burst < BURSTS; burst++) {
+    for (count = 0; count < BURST; count++) {
+      status = workq_add(&workq, NULL);
+      if (status != 0)
+        err_abort(status, "Add request");
+    }
+    nanosleep(&gap, NULL);
+  }
+  status = workq_getstats(&workq, &stats);
+  if (status != 0)
+    err_abort(status, "Get work queue statistics");
+  status = workq_destroy(&workq);
+  if (status != 0)
+    err_abort(status, "Destroy work queue");
+  elapsed = now() - start;
+  getrusage(RUSAGE_SELF, &after);
+
+  switches = (after.ru_nvcsw - before.ru_nvcsw)
+             + (after.ru_nivcsw - before.ru_nivcsw);
+  printf("%-6s %-6s %9.0f/s  creates %.4f  sleeps %.4f  wake calls %.4f"
+         "  switches %.3f per request\n",
+         name,
+         wakeup == WORKQ_WAKE_SIGNAL ? "signal" : "event",
+         items * 1e6 / elapsed,
+         stats.thread_creates / items,
+         stats.parks / items,
+         stats.unparks / items,
+         switches / items);
+}
+
+int
+main(int argc, char* argv[])
+{
+  static const char* names[] = {"list", "steal", "ring"};
+  static const int modes[]    = {WORKQ_LIST, WORKQ_STEAL, WORKQ_RING};
+  int index;
+
+  for (index = 0; index < 3; index++) {
+    run(names[index], modes[index], WORKQ_WAKE_SIGNAL);
+    run(names[index], modes[index], WORKQ_WAKE_EVENT);
+  }
+  return 0;
+}